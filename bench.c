@@ -0,0 +1,145 @@
+/**
+ * @file bench.c
+ *
+ * Multi-search stress benchmark for search.so. Runs many independent searches
+ * of the same directory on an increasing number of threads, checks that every
+ * search sees the same entries as a single-threaded baseline, and reports how
+ * throughput scales.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "search.h"
+
+struct worker {
+    pthread_t thread;
+    const char *root;
+    const char *pattern;
+    int searches;
+    uint64_t expected;   // entries every search should produce
+    uint64_t entries;    // entries produced by all of this worker's searches
+    int mismatches;
+};
+
+static int count_batch(void *ctx, const struct search_entry *entries, size_t count)
+{
+    uint64_t *total = ctx;
+    (void) entries;
+    *total += count;
+    return 0;
+}
+
+static uint64_t run_search(const char *root, const char *pattern)
+{
+    struct search_opts opts;
+    search_opts_init(&opts);
+    opts.pattern = pattern;
+    uint64_t total = 0;
+    if (search_run(root, &opts, count_batch, &total) == -1) {
+        perror("search_run");
+        exit(1);
+    }
+    return total;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    for (int i = 0; i < w->searches; ++i) {
+        uint64_t count = run_search(w->root, w->pattern);
+        if (count != w->expected) {
+            w->mismatches++;
+        }
+        w->entries += count;
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-t max-threads] [-n searches-per-thread] "
+            "directory [search-pattern]\n", prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    int searches = 8;
+    int c;
+    while ((c = getopt(argc, argv, "t:n:")) != -1) {
+        switch (c) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'n':
+                searches = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || max_threads <= 0 || searches <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *root = argv[optind];
+    const char *pattern = optind + 1 < argc ? argv[optind + 1] : "";
+
+    // also warms the page cache so every run sees the same conditions
+    uint64_t expected = run_search(root, pattern);
+    printf("baseline: %llu entries per search\n", (unsigned long long) expected);
+    printf("threads\tsearches\tseconds\tsearches/s\tentries/s\n");
+
+    int failed = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        struct worker *workers = calloc(threads, sizeof(struct worker));
+        if (workers == NULL) {
+            perror("calloc");
+            return 1;
+        }
+
+        double start = now();
+        for (int i = 0; i < threads; ++i) {
+            workers[i].root = root;
+            workers[i].pattern = pattern;
+            workers[i].searches = searches;
+            workers[i].expected = expected;
+            if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+        uint64_t entries = 0;
+        int mismatches = 0;
+        for (int i = 0; i < threads; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            entries += workers[i].entries;
+            mismatches += workers[i].mismatches;
+        }
+        double elapsed = now() - start;
+
+        int total = threads * searches;
+        printf("%d\t%d\t%.3f\t%.1f\t%.0f\n", threads, total, elapsed,
+                total / elapsed, entries / elapsed);
+        if (mismatches > 0) {
+            fprintf(stderr, "%d of %d searches saw a different number of entries\n",
+                    mismatches, total);
+            failed = 1;
+        }
+        free(workers);
+    }
+    return failed;
+}
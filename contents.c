@@ -0,0 +1,127 @@
+/**
+ * @file contents.c
+ *
+ * Implementation of the file content search declared in contents.h.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "contents.h"
+
+const char *contents_find(const char *haystack, size_t len, const char *needle,
+        size_t needle_len)
+{
+    if (needle_len == 0) {
+        return haystack;
+    }
+    if (needle_len > len) {
+        return NULL;
+    }
+    if (needle_len == 1) {
+        return memchr(haystack, needle[0], len);
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Compare the first and last bytes of the needle against 16 candidate
+     * positions at once; most blocks have no position where both match. */
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (haystack + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // the last few positions (or everything, without SSE2)
+    return memmem(haystack + i, len - i, needle, needle_len);
+}
+
+static bool is_binary(const char *data, size_t len)
+{
+    return memchr(data, '\0', len < CONTENTS_BINARY_PROBE ? len : CONTENTS_BINARY_PROBE) != NULL;
+}
+
+/**
+ * Reads a small file with as few calls as possible (normally just one).
+ *
+ * @return the number of bytes read, or -1 on error.
+ */
+static ssize_t read_small(int fd, char *buffer)
+{
+    size_t len = 0;
+    while (len < CONTENTS_MMAP_MIN) {
+        ssize_t n = pread(fd, buffer + len, CONTENTS_MMAP_MIN - len, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+int contents_match(const char *path, const char *pattern, size_t pattern_len, char *buffer)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    int rc;
+    if (st.st_size < CONTENTS_MMAP_MIN) {
+        ssize_t len = read_small(fd, buffer);
+        if (len == -1) {
+            rc = -1;
+        } else {
+            rc = !is_binary(buffer, len)
+                && contents_find(buffer, len, pattern, pattern_len) != NULL;
+        }
+    } else {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            rc = -1;
+        } else {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            rc = !is_binary(data, st.st_size)
+                && contents_find(data, st.st_size, pattern, pattern_len) != NULL;
+            munmap(data, st.st_size);
+        }
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    return rc;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file contents.h
+ *
+ * Searching inside files for --contains. Small files are read with a single
+ * pread() into a buffer the caller reuses from file to file; larger ones are
+ * mapped and read sequentially, so a file whose match comes early is never
+ * read in full. Files with a NUL byte near the start are taken to be binary
+ * and skipped, as grep(1) does.
+ */
+
+#ifndef _CONTENTS_H_
+#define _CONTENTS_H_
+
+#include <stddef.h>
+
+/**
+ * Files smaller than this are read into the caller's buffer, which must be
+ * this large; bigger files are mapped. Can be overridden at compile time,
+ * e.g., -DCONTENTS_MMAP_MIN=4096.
+ */
+#ifndef CONTENTS_MMAP_MIN
+#define CONTENTS_MMAP_MIN (256 * 1024)
+#endif
+
+/**
+ * Number of bytes at the start of a file checked for NUL bytes.
+ */
+#define CONTENTS_BINARY_PROBE 8192
+
+/**
+ * Finds the first occurrence of 'needle' in 'haystack'. Uses SSE2 to check 16
+ * positions at a time for the needle's first and last bytes, and compares the
+ * rest only where both match.
+ *
+ * @return the start of the match, or NULL.
+ */
+const char *contents_find(const char *haystack, size_t len, const char *needle,
+        size_t needle_len);
+
+/**
+ * Checks whether a (non-binary) file contains 'pattern'. 'buffer' must hold
+ * CONTENTS_MMAP_MIN bytes.
+ *
+ * @return 1 if it does, 0 if it doesn't or is binary, or -1 if it could not be
+ * read (errno is set).
+ */
+int contents_match(const char *path, const char *pattern, size_t pattern_len, char *buffer);
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file copy.c
+ *
+ * Implementation of the file copies declared in copy.h. A method is only
+ * given up on if it fails before copying anything, with an error meaning the
+ * filesystems don't support it; any other error fails the copy.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy.h"
+
+/**
+ * Largest amount passed to a single copy_file_range() or sendfile() call.
+ */
+#define COPY_CHUNK (1024 * 1024 * 1024)
+
+/**
+ * Checks whether an error means "not possible here" rather than a failure.
+ */
+static bool unsupported(int err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/**
+ * Creates the missing directories leading up to 'path'.
+ */
+static int make_parents(const char *path)
+{
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return -1;
+    }
+    for (char *slash = strchr(copy + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        // other threads may be creating the same directories
+        if (mkdir(copy, 0777) == -1 && errno != EEXIST) {
+            free(copy);
+            return -1;
+        }
+        *slash = '/';
+    }
+    free(copy);
+    return 0;
+}
+
+/**
+ * Copies with copy_file_range() or sendfile(), whichever 'method' is.
+ *
+ * @return 1 when done, 0 if the method isn't supported, or -1 on error.
+ */
+static int copy_in_kernel(int in, int out, enum copy_method method)
+{
+    bool copied = false;
+    for (;;) {
+        ssize_t n = method == COPY_RANGE
+            ? copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)
+            : sendfile(out, in, NULL, COPY_CHUNK);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return !copied && unsupported(errno) ? 0 : -1;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        copied = true;
+    }
+}
+
+static int copy_read_write(int in, int out, char *buffer)
+{
+    ssize_t n;
+    while ((n = read(in, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = write(out, buffer + done, n - done);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written == -1) {
+                return -1;
+            }
+            done += written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copies the contents of 'in' to 'out', trying each method in turn.
+ *
+ * @return the method used, or -1 on error.
+ */
+static int copy_contents(int in, int out, const struct stat *st, char *buffer)
+{
+    if (ioctl(out, FICLONE, in) == 0) {
+        return COPY_CLONE;
+    }
+    // files reporting no size may still have contents (e.g., in /proc)
+    if (st->st_size > 0) {
+        for (int method = COPY_RANGE; method <= COPY_SENDFILE; ++method) {
+            int rc = copy_in_kernel(in, out, method);
+            if (rc != 0) {
+                return rc == 1 ? method : -1;
+            }
+        }
+    }
+    return copy_read_write(in, out, buffer) == 0 ? COPY_READ_WRITE : -1;
+}
+
+int copy_file(const char *src, const char *dest, char *buffer)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        int err = errno;
+        close(in);
+        errno = err;
+        return -1;
+    }
+
+    /* Not truncated on open: if 'dest' turns out to be the source itself,
+     * it has to be left alone. */
+    int out = open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (out == -1 && errno == ENOENT && make_parents(dest) == 0) {
+        out = open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    }
+    struct stat dest_st;
+    int rc = -1;
+    if (out == -1 || fstat(out, &dest_st) == -1) {
+        // errno is set
+    } else if (dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino) {
+        errno = EINVAL;
+    } else if (ftruncate(out, 0) == 0) {
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        rc = copy_contents(in, out, &st, buffer);
+    }
+
+    if (rc != -1) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if (fchmod(out, st.st_mode & 0777) == -1 || futimens(out, times) == -1) {
+            rc = -1;
+        }
+    }
+    int err = errno;
+    if (out != -1 && close(out) == -1 && rc != -1) {
+        // delayed write errors (e.g., on NFS) show up here
+        err = errno;
+        rc = -1;
+    }
+    close(in);
+    errno = err;
+    return rc;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file copy.h
+ *
+ * Copying files out of the searched tree for --copy-to. Each copy tries the
+ * cheapest method the filesystems allow and falls back from there:
+ *
+ * 1. FICLONE shares the source's extents (a reflink), copying no data at all
+ *    on filesystems like Btrfs and XFS.
+ * 2. copy_file_range() copies within the kernel, and can be offloaded to the
+ *    storage on some filesystems (and NFS servers).
+ * 3. sendfile() still avoids copying through user space.
+ * 4. Plain read() and write() work everywhere else.
+ */
+
+#ifndef _COPY_H_
+#define _COPY_H_
+
+/**
+ * Size of the buffer used by the read()/write() fallback.
+ */
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+enum copy_method {
+    COPY_CLONE,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+    COPY_METHODS,
+};
+
+/**
+ * Copies a regular file to 'dest', replacing any file there and creating
+ * missing parent directories. The copy keeps the source's permission bits and
+ * modification time. 'buffer' must hold COPY_BUFFER_SIZE bytes.
+ *
+ * @return the method that made the copy, or -1 on error (errno is set).
+ */
+int copy_file(const char *src, const char *dest, char *buffer);
+
+#endif
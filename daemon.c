@@ -0,0 +1,1016 @@
+/**
+ * @file daemon.c
+ *
+ * Implementation of the indexing daemon and its client declared in daemon.h.
+ *
+ * The index is a tree of nodes stored in one array and linked by index: every
+ * node knows its parent, its first child and its next sibling. Directories
+ * also carry an inotify watch descriptor, and a table maps watch descriptors
+ * back to nodes so events can be applied to the tree directly.
+ */
+
+#define _GNU_SOURCE // struct ucred
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "ext_set.h"
+#include "logger.h"
+#include "output.h"
+
+#define NO_NODE UINT32_MAX
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/**
+ * Most clients served at once; any more are turned away and search directly.
+ */
+#define MAX_CLIENTS 64
+
+/**
+ * Seconds a client may take to send its request, and to take each part of the
+ * reply, before the daemon hangs up on it.
+ */
+#define REQUEST_TIMEOUT 5
+#define REPLY_TIMEOUT 60
+
+struct node {
+    char *name;             // NULL for free nodes
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t last_child;    // children are kept in the order they were found
+    uint32_t next_sibling;  // also links the free list
+    int wd;                 // inotify watch of a directory, or -1
+    unsigned char type;     // DT_REG or DT_DIR
+};
+
+struct tree {
+    struct node *nodes;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t free_list;
+    uint32_t root;
+    char *root_path;
+
+    int inotify_fd;
+    uint32_t *watches;      // watch descriptor -> node
+    size_t watches_cap;
+};
+
+/**
+ * Every client is served on a thread of its own, so a slow or silent one only
+ * holds up itself. Queries read the tree under 'tree_lock' while the main
+ * thread applies inotify events to it.
+ */
+struct server {
+    struct tree tree;
+    pthread_rwlock_t tree_lock;
+
+    pthread_mutex_t lock;       // protects the fields below
+    pthread_cond_t idle;        // the last client has been served
+    int clients[MAX_CLIENTS];   // sockets being served, or -1
+    size_t active;
+};
+
+struct client {
+    struct server *server;
+    size_t slot;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop(int signo)
+{
+    (void) signo;
+    stopping = 1;
+}
+
+void daemon_default_socket(char *buf, size_t len)
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != NULL && runtime_dir[0] != '\0') {
+        snprintf(buf, len, "%s/search.sock", runtime_dir);
+    } else {
+        snprintf(buf, len, "/tmp/search-%u/search.sock", (unsigned) getuid());
+    }
+}
+
+/**
+ * Checks that 'path' is of 'type' (S_IFDIR, S_IFSOCK), belongs to this user
+ * and can't be written by anyone else.
+ */
+static bool is_private(const char *path, mode_t type)
+{
+    struct stat st;
+    return lstat(path, &st) == 0 && (st.st_mode & S_IFMT) == type
+        && st.st_uid == getuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/**
+ * Retrieves the directory holding a socket. 'buf' holds PATH_MAX bytes.
+ */
+static const char *socket_dir(const char *socket_path, char *buf)
+{
+    snprintf(buf, PATH_MAX, "%s", socket_path);
+    return dirname(buf);
+}
+
+static uint32_t node_alloc(struct tree *tree, const char *name, size_t name_len,
+        unsigned char type, uint32_t parent)
+{
+    uint32_t id;
+    if (tree->free_list != NO_NODE) {
+        id = tree->free_list;
+        tree->free_list = tree->nodes[id].next_sibling;
+    } else {
+        if (tree->len == tree->cap) {
+            uint32_t cap = tree->cap == 0 ? 1024 : tree->cap * 2;
+            struct node *nodes = realloc(tree->nodes, cap * sizeof(struct node));
+            if (nodes == NULL) {
+                return NO_NODE;
+            }
+            tree->nodes = nodes;
+            tree->cap = cap;
+        }
+        id = tree->len++;
+    }
+
+    struct node *node = &tree->nodes[id];
+    node->name = strndup(name, name_len);
+    if (node->name == NULL) {
+        node->next_sibling = tree->free_list;
+        tree->free_list = id;
+        return NO_NODE;
+    }
+    node->type = type;
+    node->wd = -1;
+    node->first_child = NO_NODE;
+    node->last_child = NO_NODE;
+    node->parent = parent;
+    node->next_sibling = NO_NODE;
+    if (parent != NO_NODE) {
+        // appended, so answers list entries in the order a direct scan does
+        struct node *p = &tree->nodes[parent];
+        if (p->last_child == NO_NODE) {
+            p->first_child = id;
+        } else {
+            tree->nodes[p->last_child].next_sibling = id;
+        }
+        p->last_child = id;
+    }
+    return id;
+}
+
+static uint32_t find_child(struct tree *tree, uint32_t parent, const char *name)
+{
+    for (uint32_t id = tree->nodes[parent].first_child; id != NO_NODE;
+            id = tree->nodes[id].next_sibling) {
+        if (strcmp(tree->nodes[id].name, name) == 0) {
+            return id;
+        }
+    }
+    return NO_NODE;
+}
+
+/**
+ * Builds the full path of a node into 'buf', which holds PATH_MAX bytes.
+ *
+ * @return 0 on success, or -1 if the path is too long.
+ */
+static int node_path(struct tree *tree, uint32_t id, char *buf)
+{
+    // fill the buffer from the end, one ancestor at a time
+    size_t pos = PATH_MAX - 1;
+    buf[pos] = '\0';
+    for (; id != tree->root; id = tree->nodes[id].parent) {
+        size_t name_len = strlen(tree->nodes[id].name);
+        if (name_len + 1 > pos) {
+            return -1;
+        }
+        pos -= name_len;
+        memcpy(buf + pos, tree->nodes[id].name, name_len);
+        buf[--pos] = '/';
+    }
+    size_t root_len = strlen(tree->root_path);
+    if (root_len == 1 && buf[pos] == '/') {
+        // the root is "/", which the first name already starts with
+        root_len = 0;
+    }
+    if (root_len > pos) {
+        return -1;
+    }
+    pos -= root_len;
+    memcpy(buf + pos, tree->root_path, root_len);
+    memmove(buf, buf + pos, PATH_MAX - pos);
+    return 0;
+}
+
+static void watch_dir(struct tree *tree, uint32_t id, const char *path)
+{
+    int wd = inotify_add_watch(tree->inotify_fd, path, WATCH_MASK);
+    if (wd == -1) {
+        // typically fs.inotify.max_user_watches; this subtree won't be live
+        perror("inotify_add_watch");
+        return;
+    }
+    if ((size_t) wd >= tree->watches_cap) {
+        size_t cap = tree->watches_cap == 0 ? 1024 : tree->watches_cap;
+        while (cap <= (size_t) wd) {
+            cap *= 2;
+        }
+        uint32_t *watches = realloc(tree->watches, cap * sizeof(uint32_t));
+        if (watches == NULL) {
+            inotify_rm_watch(tree->inotify_fd, wd);
+            return;
+        }
+        for (size_t i = tree->watches_cap; i < cap; ++i) {
+            watches[i] = NO_NODE;
+        }
+        tree->watches = watches;
+        tree->watches_cap = cap;
+    }
+    tree->watches[wd] = id;
+    tree->nodes[id].wd = wd;
+}
+
+/**
+ * Frees a node and everything beneath it, removing their watches.
+ */
+static void node_free(struct tree *tree, uint32_t id)
+{
+    struct node *node = &tree->nodes[id];
+    uint32_t child = node->first_child;
+    while (child != NO_NODE) {
+        uint32_t next = tree->nodes[child].next_sibling;
+        node_free(tree, child);
+        child = next;
+    }
+    node = &tree->nodes[id];
+    if (node->wd != -1) {
+        inotify_rm_watch(tree->inotify_fd, node->wd);
+        tree->watches[node->wd] = NO_NODE;
+    }
+    free(node->name);
+    node->name = NULL;
+    node->first_child = NO_NODE;
+    node->last_child = NO_NODE;
+    node->next_sibling = tree->free_list;
+    tree->free_list = id;
+}
+
+/**
+ * Unlinks a child from its parent and frees it.
+ */
+static void remove_child(struct tree *tree, uint32_t parent, uint32_t id)
+{
+    uint32_t prev = NO_NODE;
+    uint32_t *link = &tree->nodes[parent].first_child;
+    while (*link != id) {
+        prev = *link;
+        link = &tree->nodes[*link].next_sibling;
+    }
+    *link = tree->nodes[id].next_sibling;
+    if (tree->nodes[parent].last_child == id) {
+        tree->nodes[parent].last_child = prev;
+    }
+    node_free(tree, id);
+}
+
+/**
+ * Adds everything beneath directory node 'id' (at 'path') to the tree, and
+ * watches every directory found.
+ */
+static void scan_dir(struct tree *tree, uint32_t id, const char *path)
+{
+    watch_dir(tree, id, path);
+
+    struct search_opts opts;
+    search_opts_init(&opts);
+    opts.show_hidden = true;
+    struct search *it = search_open(path, &opts);
+    if (it == NULL) {
+        perror("opendir");
+        return;
+    }
+
+    // parents[d] is the directory that holds the entries at depth d
+    uint32_t *parents = malloc(64 * sizeof(uint32_t));
+    size_t parents_cap = 64;
+    if (parents == NULL) {
+        search_close(it);
+        return;
+    }
+    parents[0] = id;
+
+    struct search_entry entry;
+    while (search_next(it, &entry) == 1) {
+        /* Events that race with the scan are queued and applied afterward;
+         * a create event for a name that is already present replaces it. */
+        uint32_t child = node_alloc(tree, entry.name, entry.name_len, entry.type,
+                parents[entry.depth]);
+        if (child == NO_NODE) {
+            perror("malloc");
+            break;
+        }
+        if (entry.type == DT_DIR) {
+            if ((size_t) entry.depth + 1 >= parents_cap) {
+                parents_cap *= 2;
+                uint32_t *grown = realloc(parents, parents_cap * sizeof(uint32_t));
+                if (grown == NULL) {
+                    perror("realloc");
+                    break;
+                }
+                parents = grown;
+            }
+            parents[entry.depth + 1] = child;
+            watch_dir(tree, child, entry.path);
+        }
+    }
+    free(parents);
+    search_close(it);
+}
+
+static int build_tree(struct tree *tree)
+{
+    tree->root = node_alloc(tree, tree->root_path, strlen(tree->root_path), DT_DIR, NO_NODE);
+    if (tree->root == NO_NODE) {
+        return -1;
+    }
+    scan_dir(tree, tree->root, tree->root_path);
+    LOG("Indexed %u nodes under %s\n", tree->len, tree->root_path);
+    return 0;
+}
+
+/**
+ * Applies a batch of inotify events to the tree.
+ */
+static void apply_events(struct tree *tree)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(tree->inotify_fd, buf, sizeof(buf));
+    if (len <= 0) {
+        return;
+    }
+
+    for (char *p = buf; p < buf + len; ) {
+        struct inotify_event *event = (struct inotify_event *) p;
+        p += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // events were lost, so the only safe option is to start over
+            if (tree->root != NO_NODE) {
+                LOGP("inotify queue overflowed; rebuilding the index\n");
+                node_free(tree, tree->root);
+                build_tree(tree);
+            }
+            return;
+        }
+        if (event->wd < 0 || (size_t) event->wd >= tree->watches_cap) {
+            continue;
+        }
+        uint32_t dir = tree->watches[event->wd];
+        if (event->mask & IN_IGNORED) {
+            tree->watches[event->wd] = NO_NODE;
+            if (dir != NO_NODE && tree->nodes[dir].wd == event->wd) {
+                tree->nodes[dir].wd = -1;
+            }
+            continue;
+        }
+        if (dir != NO_NODE && (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) {
+            /* Usually the parent's event has removed the directory already;
+             * not when it is the root, or its parent isn't watched. */
+            if (dir == tree->root) {
+                fprintf(stderr, "%s was moved or deleted; no longer answering for it\n",
+                        tree->root_path);
+                node_free(tree, dir);
+                tree->root = NO_NODE;
+                return;
+            }
+            remove_child(tree, tree->nodes[dir].parent, dir);
+            continue;
+        }
+        if (dir == NO_NODE || event->len == 0) {
+            continue;
+        }
+
+        uint32_t child = find_child(tree, dir, event->name);
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            if (child != NO_NODE) {
+                remove_child(tree, dir, child);
+            }
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            if (child != NO_NODE) {
+                // replaced by a rename; the new entry may be of another type
+                remove_child(tree, dir, child);
+            }
+            char path[PATH_MAX];
+            if (node_path(tree, dir, path) == -1) {
+                continue;
+            }
+            unsigned char type = DT_DIR;
+            if ((event->mask & IN_ISDIR) == 0) {
+                // only regular files are reported, so symlinks etc. are skipped
+                struct stat st;
+                int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                int rc = dir_fd == -1 ? -1
+                    : fstatat(dir_fd, event->name, &st, AT_SYMLINK_NOFOLLOW);
+                if (dir_fd != -1) {
+                    close(dir_fd);
+                }
+                if (rc == -1 || !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                type = DT_REG;
+            }
+            child = node_alloc(tree, event->name, strlen(event->name), type, dir);
+            if (child == NO_NODE) {
+                perror("malloc");
+                continue;
+            }
+            if (type == DT_DIR && node_path(tree, child, path) == 0) {
+                // a directory moved in (or filled quickly) has contents already
+                scan_dir(tree, child, path);
+            }
+        }
+    }
+}
+
+/**
+ * Finds the node for an absolute path beneath the indexed root.
+ */
+static uint32_t lookup_path(struct tree *tree, char *path)
+{
+    size_t root_len = strlen(tree->root_path);
+    if (tree->root == NO_NODE || strncmp(path, tree->root_path, root_len) != 0
+            || (path[root_len] != '/' && path[root_len] != '\0' && root_len != 1)) {
+        return NO_NODE;
+    }
+    uint32_t id = tree->root;
+    char *saveptr = NULL;
+    for (char *part = strtok_r(path + root_len, "/", &saveptr);
+            part != NULL && id != NO_NODE;
+            part = strtok_r(NULL, "/", &saveptr)) {
+        id = find_child(tree, id, part);
+        if (id != NO_NODE && tree->nodes[id].type != DT_DIR) {
+            return NO_NODE;
+        }
+    }
+    return id;
+}
+
+/**
+ * Streams the matches beneath 'dir' to a client, counting them in 'sent'.
+ * 'rel' holds the path of 'dir' relative to the query root.
+ */
+static void query_dir(struct tree *tree, uint32_t dir, const struct search_opts *filter,
+        char *rel, size_t rel_len, int depth, struct sink *out, uint64_t *sent)
+{
+    if (depth == filter->max_depth) {
+        return;
+    }
+    for (uint32_t id = tree->nodes[dir].first_child; id != NO_NODE && !out->failed;
+            id = tree->nodes[id].next_sibling) {
+        struct node *node = &tree->nodes[id];
+        size_t name_len = strlen(node->name);
+        size_t len = rel_len == 0 ? name_len : rel_len + 1 + name_len;
+        if (len >= PATH_MAX) {
+            continue;
+        }
+        if (rel_len > 0) {
+            rel[rel_len] = '/';
+        }
+        memcpy(rel + len - name_len, node->name, name_len + 1);
+
+        if (search_match(filter, node->name, node->type)) {
+            struct daemon_record record = {
+                .path_len = len,
+                .name_len = name_len,
+                .depth = depth,
+                .type = node->type,
+            };
+            char *dest = sink_reserve(out, sizeof(record) + len);
+            if (dest != NULL) {
+                memcpy(dest, &record, sizeof(record));
+                memcpy(dest + sizeof(record), rel, len);
+                sink_commit(out, sizeof(record) + len);
+                ++*sent;
+            }
+        }
+        if (node->type == DT_DIR) {
+            query_dir(tree, id, filter, rel, len, depth + 1, out, sent);
+        }
+        rel[rel_len] = '\0';
+    }
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Writes all of 'buf' to a socket. A peer that has hung up is reported as an
+ * error rather than with SIGPIPE.
+ */
+static int write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, (const char *) buf + done, len - done, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Sends the first 'len' bytes of a file to a socket.
+ */
+static int send_file(int fd, int file_fd, size_t len)
+{
+    off_t offset = 0;
+    while ((size_t) offset < len) {
+        ssize_t n = sendfile(fd, file_fd, &offset, len - offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void serve_client(struct server *server, int fd)
+{
+    struct daemon_request req;
+    if (read_full(fd, &req, sizeof(req)) == -1 || req.magic != DAEMON_MAGIC
+            || req.root_len >= PATH_MAX || req.pattern_len >= PATH_MAX) {
+        return;
+    }
+    char root[PATH_MAX];
+    char pattern[PATH_MAX];
+    if (read_full(fd, root, req.root_len) == -1
+            || read_full(fd, pattern, req.pattern_len) == -1) {
+        return;
+    }
+    root[req.root_len] = '\0';
+    pattern[req.pattern_len] = '\0';
+
+    // the tree is filtered exactly as the search library would filter it
+    struct search_opts filter;
+    search_opts_init(&filter);
+    filter.max_depth = req.max_depth;
+    filter.pattern = pattern;
+    filter.exact_match = req.exact_match;
+    filter.ignore_case = req.ignore_case;
+    filter.unicode_fold = req.unicode_fold;
+    filter.show_dirs = req.show_dirs;
+    filter.show_files = req.show_files;
+    filter.show_hidden = req.show_hidden;
+
+    /* The reply is written to a temporary file and sent once the tree is
+     * unlocked, so a client that reads slowly doesn't hold up inotify events. */
+    FILE *reply = tmpfile();
+    if (reply == NULL) {
+        perror("tmpfile");
+        return;
+    }
+    struct sink out;
+    if (sink_init(&out, fileno(reply), SINK_BUFFER_SIZE) == -1) {
+        fclose(reply);
+        return;
+    }
+    pthread_rwlock_rdlock(&server->tree_lock);
+    uint32_t dir = lookup_path(&server->tree, root);
+    struct daemon_response response = { dir == NO_NODE ? ENOENT : 0 };
+    char *dest = sink_reserve(&out, sizeof(response));
+    if (dest != NULL) {
+        memcpy(dest, &response, sizeof(response));
+        sink_commit(&out, sizeof(response));
+    }
+    if (dir != NO_NODE) {
+        char rel[PATH_MAX] = "";
+        uint64_t sent = 0;
+        query_dir(&server->tree, dir, &filter, rel, 0, 0, &out, &sent);
+
+        struct daemon_record end = { .type = DAEMON_END };
+        struct daemon_trailer trailer = { sent };
+        dest = sink_reserve(&out, sizeof(end) + sizeof(trailer));
+        if (dest != NULL) {
+            memcpy(dest, &end, sizeof(end));
+            memcpy(dest + sizeof(end), &trailer, sizeof(trailer));
+            sink_commit(&out, sizeof(end) + sizeof(trailer));
+        }
+    }
+    pthread_rwlock_unlock(&server->tree_lock);
+
+    if (sink_close(&out) == 0) {
+        send_file(fd, fileno(reply), out.written);
+    }
+    fclose(reply);
+}
+
+static void *client_main(void *arg)
+{
+    struct client *client = arg;
+    struct server *server = client->server;
+    serve_client(server, server->clients[client->slot]);
+
+    pthread_mutex_lock(&server->lock);
+    close(server->clients[client->slot]);
+    server->clients[client->slot] = -1;
+    if (--server->active == 0) {
+        pthread_cond_signal(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(client);
+    return NULL;
+}
+
+/**
+ * Accepts a connection and starts a thread to serve it.
+ */
+static void accept_client(struct server *server, int listen_fd)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct timeval request_timeout = { .tv_sec = REQUEST_TIMEOUT };
+    struct timeval reply_timeout = { .tv_sec = REPLY_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &request_timeout, sizeof(request_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &reply_timeout, sizeof(reply_timeout));
+
+    pthread_mutex_lock(&server->lock);
+    size_t slot = 0;
+    while (slot < MAX_CLIENTS && server->clients[slot] != -1) {
+        ++slot;
+    }
+    if (slot == MAX_CLIENTS) {
+        pthread_mutex_unlock(&server->lock);
+        LOGP("Too many clients; turning one away\n");
+        close(fd);
+        return;
+    }
+    server->clients[slot] = fd;
+    ++server->active;
+    pthread_mutex_unlock(&server->lock);
+
+    struct client *client = malloc(sizeof(struct client));
+    if (client != NULL) {
+        client->server = server;
+        client->slot = slot;
+        // signals are left to the main thread, so they always interrupt its poll()
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, client_main, client);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rc == 0) {
+            pthread_detach(thread);
+            return;
+        }
+        free(client);
+    }
+    perror("pthread_create");
+    pthread_mutex_lock(&server->lock);
+    server->clients[slot] = -1;
+    --server->active;
+    pthread_mutex_unlock(&server->lock);
+    close(fd);
+}
+
+int daemon_serve(const char *socket_path, const char *root)
+{
+    struct server server = { 0 };
+    struct tree *tree = &server.tree;
+    tree->free_list = NO_NODE;
+    tree->root_path = realpath(root, NULL);
+    if (tree->root_path == NULL) {
+        perror("realpath");
+        return 1;
+    }
+    tree->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (tree->inotify_fd == -1) {
+        perror("inotify_init1");
+        return 1;
+    }
+    // queries are short, so inotify events shouldn't wait behind a stream of them
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&server.tree_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+        server.clients[i] = -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    /* Clients only trust a socket in a directory nobody else can write to, so
+     * another user can't put their own daemon in its place. */
+    char dir_buf[PATH_MAX];
+    const char *dir = socket_dir(socket_path, dir_buf);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return 1;
+    }
+    if (!is_private(dir, S_IFDIR)) {
+        fprintf(stderr, "%s must be a directory of yours that only you can write to\n", dir);
+        return 1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || chmod(socket_path, 0600) == -1
+            || listen(listen_fd, 16) == -1) {
+        perror("bind");
+        return 1;
+    }
+
+    struct sigaction sa = { .sa_handler = handle_stop };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // clients that hang up early shouldn't take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (build_tree(tree) == -1) {
+        perror("malloc");
+        unlink(socket_path);
+        return 1;
+    }
+    fprintf(stderr, "Serving %s on %s\n", tree->root_path, socket_path);
+
+    while (!stopping) {
+        struct pollfd fds[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = tree->inotify_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        // apply changes first so queries see the latest state
+        if (fds[1].revents & POLLIN) {
+            pthread_rwlock_wrlock(&server.tree_lock);
+            apply_events(tree);
+            pthread_rwlock_unlock(&server.tree_lock);
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_client(&server, listen_fd);
+        }
+    }
+
+    unlink(socket_path);
+    close(listen_fd);
+    // hang up on the clients still being served and wait for their threads
+    pthread_mutex_lock(&server.lock);
+    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+        if (server.clients[i] != -1) {
+            shutdown(server.clients[i], SHUT_RDWR);
+        }
+    }
+    while (server.active > 0) {
+        pthread_cond_wait(&server.idle, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    close(tree->inotify_fd);
+    if (tree->root != NO_NODE) {
+        node_free(tree, tree->root);
+    }
+    free(tree->nodes);
+    free(tree->watches);
+    free(tree->root_path);
+    pthread_rwlock_destroy(&server.tree_lock);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.idle);
+    return 0;
+}
+
+
+/**
+ * Connects to the daemon, provided it can be trusted: the socket and its
+ * directory must be private to this user, and so must the process listening.
+ * Otherwise anyone could answer with paths of their choosing, which --exec and
+ * friends would then act on.
+ *
+ * @return the connected socket, or -1.
+ */
+static int connect_daemon(const char *socket_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    char dir[PATH_MAX];
+    if (!is_private(socket_dir(socket_path, dir), S_IFDIR)
+            || !is_private(socket_path, S_IFSOCK)) {
+        if (errno != ENOENT) {
+            LOG("Not using %s: it or its directory isn't private to this user\n",
+                    socket_path);
+        }
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (cred.uid != getuid()) {
+        LOG("Not using %s: the daemon belongs to uid %u\n", socket_path,
+                (unsigned) cred.uid);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends a query to the daemon and reads back the status.
+ *
+ * @return the connected socket, or -1 if the daemon can't answer.
+ */
+static int send_query(const char *socket_path, const char *root,
+        const struct search_opts *opts)
+{
+    char *resolved = realpath(root, NULL);
+    if (resolved == NULL) {
+        return -1;
+    }
+    int fd = connect_daemon(socket_path);
+    if (fd == -1) {
+        free(resolved);
+        return -1;
+    }
+
+    struct daemon_request req = {
+        .magic = DAEMON_MAGIC,
+        .max_depth = opts->max_depth,
+        .exact_match = opts->exact_match,
+        .show_dirs = opts->show_dirs,
+        .show_files = opts->show_files,
+        .show_hidden = opts->show_hidden,
+        .ignore_case = opts->ignore_case,
+        .unicode_fold = opts->unicode_fold,
+        .root_len = strlen(resolved),
+        .pattern_len = strlen(opts->pattern),
+    };
+    struct daemon_response response;
+    bool ok = write_full(fd, &req, sizeof(req)) == 0
+        && write_full(fd, resolved, req.root_len) == 0
+        && write_full(fd, opts->pattern, req.pattern_len) == 0
+        && read_full(fd, &response, sizeof(response)) == 0
+        && response.status == 0;
+    free(resolved);
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int daemon_query(const char *socket_path, const char *root,
+        const struct search_opts *opts, search_callback callback, void *ctx)
+{
+    int fd = send_query(socket_path, root, opts);
+    if (fd == -1) {
+        return -1;
+    }
+    LOG("Answering from the daemon at %s\n", socket_path);
+
+    /* Entries are rebuilt with the caller's spelling of the root, exactly as
+     * the search library would have reported them. */
+    struct search_entry entries[SEARCH_BATCH_SIZE];
+    size_t count = 0;
+    size_t root_len = strlen(root);
+    size_t arena_cap = 64 * 1024 + PATH_MAX * 2;
+    char *arena = malloc(arena_cap);
+    size_t arena_len = 0;
+    if (arena == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    struct daemon_record record;
+    uint64_t received = 0;
+    bool delivered = false;
+    bool complete = false;
+    int rc = 0;
+    while (rc == 0 && read_full(fd, &record, sizeof(record)) == 0) {
+        if (record.type == DAEMON_END) {
+            struct daemon_trailer trailer;
+            complete = read_full(fd, &trailer, sizeof(trailer)) == 0
+                && trailer.count == received;
+            break;
+        }
+        if (record.path_len >= PATH_MAX || record.name_len > record.path_len) {
+            break;
+        }
+        ++received;
+        if (count == SEARCH_BATCH_SIZE || arena_len + root_len + record.path_len + 2 > arena_cap) {
+            rc = callback(ctx, entries, count);
+            delivered = true;
+            count = 0;
+            arena_len = 0;
+        }
+        char *path = arena + arena_len;
+        memcpy(path, root, root_len);
+        path[root_len] = '/';
+        if (read_full(fd, path + root_len + 1, record.path_len) == -1) {
+            break;
+        }
+        size_t path_len = root_len + 1 + record.path_len;
+        path[path_len] = '\0';
+        const char *name = path + path_len - record.name_len;
+        // the extension set isn't sent to the daemon, so it is applied here
+        if (opts->extensions != NULL && record.type == DT_REG
+                && !ext_set_match(opts->extensions, name, record.name_len)) {
+            continue;
+        }
+        arena_len += path_len + 1;
+
+        struct search_entry *entry = &entries[count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = path;
+        entry->path_len = path_len;
+        entry->name = name;
+        entry->name_len = record.name_len;
+        entry->type = record.type;
+        entry->depth = record.depth;
+    }
+    close(fd);
+    // a callback that stops the search early doesn't need the rest
+    if (rc != 0 || complete) {
+        if (rc == 0 && count > 0) {
+            callback(ctx, entries, count);
+        }
+        free(arena);
+        return 0;
+    }
+    free(arena);
+    if (!delivered) {
+        LOG("The daemon at %s broke off its answer; searching directly\n", socket_path);
+        return -1;
+    }
+    fprintf(stderr, "The daemon at %s broke off its answer; results are incomplete\n",
+            socket_path);
+    return 1;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file daemon.h
+ *
+ * Long-running indexing daemon. The daemon scans a directory tree once, keeps
+ * an in-memory copy of it current with inotify, and answers queries from
+ * search clients over a Unix domain socket. The client side lets the command
+ * line tool use a running daemon transparently.
+ */
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "search.h"
+
+/**
+ * Identifies the protocol; changed whenever the request or the reply changes,
+ * so a client and daemon of different versions refuse each other (and the
+ * client searches directly) instead of misreading the request.
+ */
+#define DAEMON_MAGIC 0x53524333 // "SRC3"
+
+/**
+ * A query sent by a client, followed by 'root_len' bytes of the (absolute,
+ * resolved) directory to search and 'pattern_len' bytes of search pattern.
+ */
+struct daemon_request {
+    uint32_t magic;
+    int32_t max_depth;
+    uint8_t exact_match;
+    uint8_t show_dirs;
+    uint8_t show_files;
+    uint8_t show_hidden;
+    uint8_t ignore_case;
+    uint8_t unicode_fold;
+    uint8_t reserved[2];
+    uint32_t root_len;
+    uint32_t pattern_len;
+};
+
+/**
+ * The daemon answers a request with a status (0 or an errno value). On
+ * success, a record per match follows, each followed by 'path_len' bytes of
+ * path relative to the requested root. A record of type DAEMON_END with no
+ * path and then a struct daemon_trailer end the reply, so a client can tell a
+ * complete answer from one cut short.
+ */
+struct daemon_response {
+    int32_t status;
+};
+
+struct daemon_record {
+    uint32_t path_len;
+    uint32_t name_len;
+    int32_t depth;
+    uint8_t type;       // d_type of the match, or DAEMON_END
+    uint8_t reserved[3];
+};
+
+#define DAEMON_END 0xff
+
+struct daemon_trailer {
+    uint64_t count;     // matches sent before the end record
+};
+
+/**
+ * Retrieves the default socket path: $XDG_RUNTIME_DIR/search.sock if that
+ * variable is set, or /tmp/search-UID/search.sock otherwise. Clients only use
+ * a socket that belongs to them in a directory only they can write to.
+ */
+void daemon_default_socket(char *buf, size_t len);
+
+/**
+ * Indexes 'root' and serves queries on 'socket_path' until interrupted.
+ *
+ * @return 0 on a clean shutdown, 1 on error.
+ */
+int daemon_serve(const char *socket_path, const char *root);
+
+/**
+ * Asks a running daemon to search 'root', delivering matches to 'callback' in
+ * batches just like search_run(). Entries carry paths, names, types and depths.
+ *
+ * @return 0 if the daemon answered the query, 1 if its answer broke off after
+ * some matches were delivered (an error has been printed), or -1 if no daemon
+ * is running or it cannot answer for 'root' (the caller should search directly
+ * instead).
+ */
+int daemon_query(const char *socket_path, const char *root,
+        const struct search_opts *opts, search_callback callback, void *ctx);
+
+#endif
@@ -0,0 +1,517 @@
+/**
+ * @file dircache.c
+ *
+ * Implementation of the listing cache declared in dircache.h. Opening the
+ * cache maps the file and indexes its records in an open-addressing table
+ * keyed by (dev, ino); a later record for the same directory replaces the
+ * earlier one. New listings are serialized into a buffer in their on-disk
+ * form as the search stores them, and written out by dircache_close().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "logger.h"
+
+/**
+ * Smallest file worth compacting. Below this, rewriting it costs more than the
+ * superseded records do.
+ */
+#define COMPACT_MIN_BYTES (1024 * 1024)
+
+/* Offset 0 is the header, so it marks free slots. Records are 8-byte aligned,
+ * so an offset of 1 can mark a record replaced by a pending one. */
+#define SUPERSEDED 1
+
+struct slot {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t offset;
+};
+
+struct dircache {
+    char *path;
+    const uint8_t *map;     // the file's complete records, or NULL if empty
+    size_t map_len;
+    struct slot *slots;
+    size_t capacity;        // always a power of two
+    size_t count;
+    uint64_t live_bytes;    // bytes of records that are not superseded
+
+    pthread_mutex_t lock;   // guards the pending records
+    uint8_t *pending;
+    size_t pending_len;
+    size_t pending_cap;
+};
+
+static uint64_t hash_key(uint64_t dev, uint64_t ino)
+{
+    /* splitmix64 finalizer over both halves of the key */
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * Finds the slot that holds the key, or the free slot where it would go.
+ */
+static struct slot *find_slot(struct slot *slots, size_t capacity, uint64_t dev, uint64_t ino)
+{
+    size_t i = hash_key(dev, ino) & (capacity - 1);
+    while (slots[i].offset != 0 && (slots[i].dev != dev || slots[i].ino != ino)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static int grow_table(struct dircache *cache)
+{
+    size_t capacity = cache->capacity == 0 ? 1024 : cache->capacity * 2;
+    struct slot *slots = calloc(capacity, sizeof(struct slot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        if (cache->slots[i].offset != 0) {
+            *find_slot(slots, capacity, cache->slots[i].dev, cache->slots[i].ino)
+                = cache->slots[i];
+        }
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Checks that a record lies within 'len' bytes of 'base' and that its entries
+ * point at NUL-terminated names inside it.
+ */
+static bool valid_record(const uint8_t *base, size_t len, uint64_t offset)
+{
+    if (offset % 8 != 0 || len - offset < sizeof(struct dircache_record)) {
+        return false;
+    }
+    const struct dircache_record *record = (const void *) (base + offset);
+    uint64_t table = sizeof(*record) + (uint64_t) record->count * sizeof(struct dircache_entry);
+    if (record->size % 8 != 0 || record->size > len - offset || table > record->size) {
+        return false;
+    }
+    const struct dircache_entry *entries = dircache_entries(record);
+    const char *names = (const char *) (entries + record->count);
+    size_t names_len = record->size - table;
+    for (uint32_t i = 0; i < record->count; ++i) {
+        if (entries[i].name_offset >= names_len
+                || memchr(names + entries[i].name_offset, '\0',
+                    names_len - entries[i].name_offset) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void unload(struct dircache *cache)
+{
+    if (cache->map != NULL) {
+        munmap((void *) cache->map, cache->map_len);
+    }
+    free(cache->slots);
+    cache->map = NULL;
+    cache->map_len = 0;
+    cache->slots = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+    cache->live_bytes = 0;
+}
+
+/**
+ * Maps the complete records of the (locked) cache file and indexes them.
+ *
+ * @return 0 on success, or -1 on error (errno is set; EINVAL if the file is
+ * not a listing cache).
+ */
+static int load(struct dircache *cache, int fd)
+{
+    unload(cache);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    struct dircache_header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != DIRCACHE_MAGIC || header.version != DIRCACHE_VERSION
+            || header.length < sizeof(header) || header.length > (uint64_t) st.st_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, header.length, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    cache->map = map;
+    cache->map_len = header.length;
+
+    uint64_t offset = sizeof(header);
+    while (offset < header.length) {
+        if (!valid_record(cache->map, cache->map_len, offset)) {
+            LOG("Ignoring corrupt listings from offset %llu of %s\n",
+                    (unsigned long long) offset, cache->path);
+            break;
+        }
+        const struct dircache_record *record = (const void *) (cache->map + offset);
+        if ((cache->count + 1) * 2 > cache->capacity && grow_table(cache) == -1) {
+            return -1;
+        }
+        struct slot *slot = find_slot(cache->slots, cache->capacity, record->dev, record->ino);
+        if (slot->offset != 0) {
+            cache->live_bytes -= ((const struct dircache_record *)
+                    (cache->map + slot->offset))->size;
+        } else {
+            cache->count++;
+        }
+        *slot = (struct slot) { record->dev, record->ino, offset };
+        cache->live_bytes += record->size;
+        offset += record->size;
+    }
+    LOG("Loaded %zu cached listings (%llu of %llu bytes live) from %s\n", cache->count,
+            (unsigned long long) cache->live_bytes, (unsigned long long) cache->map_len,
+            cache->path);
+    return 0;
+}
+
+struct dircache *dircache_open(const char *path)
+{
+    struct dircache *cache = calloc(1, sizeof(struct dircache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->path = strdup(path);
+    if (cache->path == NULL || pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache->path);
+        free(cache);
+        return NULL;
+    }
+
+    /* A missing file is an empty cache; it is created when first written. */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        return cache;
+    }
+    if (fd == -1 || flock(fd, LOCK_SH) == -1 || load(cache, fd) == -1) {
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        dircache_close(cache);
+        errno = err;
+        return NULL;
+    }
+    // the mapping keeps the file open, so closing it would not drop the lock
+    flock(fd, LOCK_UN);
+    close(fd);
+    return cache;
+}
+
+const struct dircache_record *dircache_lookup(const struct dircache *cache,
+        dev_t dev, ino_t ino, int64_t mtime_ns)
+{
+    if (cache->count == 0) {
+        return NULL;
+    }
+    const struct slot *slot = find_slot(cache->slots, cache->capacity, dev, ino);
+    if (slot->offset == 0) {
+        return NULL;
+    }
+    const struct dircache_record *record = (const void *) (cache->map + slot->offset);
+    return record->mtime_ns == mtime_ns ? record : NULL;
+}
+
+const struct dircache_entry *dircache_entries(const struct dircache_record *record)
+{
+    return (const void *) (record + 1);
+}
+
+const char *dircache_name(const struct dircache_record *record,
+        const struct dircache_entry *entry)
+{
+    return (const char *) (dircache_entries(record) + record->count) + entry->name_offset;
+}
+
+int dircache_listing_add(struct dircache_listing *listing, const char *name,
+        ino_t ino, unsigned char type)
+{
+    size_t len = strlen(name);
+    if (listing->len == listing->cap) {
+        size_t cap = listing->cap == 0 ? 64 : listing->cap * 2;
+        struct dircache_entry *entries = realloc(listing->entries,
+                cap * sizeof(struct dircache_entry));
+        if (entries == NULL) {
+            return -1;
+        }
+        listing->entries = entries;
+        listing->cap = cap;
+    }
+    if (listing->names_len + len + 1 > listing->names_cap) {
+        size_t cap = listing->names_cap == 0 ? 4096 : listing->names_cap * 2;
+        while (cap < listing->names_len + len + 1) {
+            cap *= 2;
+        }
+        char *names = realloc(listing->names, cap);
+        if (names == NULL) {
+            return -1;
+        }
+        listing->names = names;
+        listing->names_cap = cap;
+    }
+    memcpy(listing->names + listing->names_len, name, len + 1);
+    listing->entries[listing->len++] = (struct dircache_entry) {
+        .ino = ino,
+        .name_offset = listing->names_len,
+        .type = type,
+    };
+    listing->names_len += len + 1;
+    return 0;
+}
+
+void dircache_listing_free(struct dircache_listing *listing)
+{
+    free(listing->entries);
+    free(listing->names);
+    memset(listing, 0, sizeof(*listing));
+}
+
+int dircache_store(struct dircache *cache, dev_t dev, ino_t ino, int64_t mtime_ns,
+        const struct dircache_listing *listing)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec * 1000000000LL + now.tv_nsec - mtime_ns < DIRCACHE_RACY_NS) {
+        return 0;
+    }
+    size_t table = listing->len * sizeof(struct dircache_entry);
+    size_t size = (sizeof(struct dircache_record) + table + listing->names_len + 7) & ~(size_t) 7;
+    if (size > UINT32_MAX) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->pending_len + size > cache->pending_cap) {
+        size_t cap = cache->pending_cap == 0 ? 64 * 1024 : cache->pending_cap * 2;
+        while (cap < cache->pending_len + size) {
+            cap *= 2;
+        }
+        uint8_t *pending = realloc(cache->pending, cap);
+        if (pending == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+        cache->pending = pending;
+        cache->pending_cap = cap;
+    }
+    uint8_t *dest = cache->pending + cache->pending_len;
+    struct dircache_record record = {
+        .dev = dev,
+        .ino = ino,
+        .mtime_ns = mtime_ns,
+        .count = listing->len,
+        .size = size,
+    };
+    memcpy(dest, &record, sizeof(record));
+    memcpy(dest + sizeof(record), listing->entries, table);
+    memcpy(dest + sizeof(record) + table, listing->names, listing->names_len);
+    memset(dest + sizeof(record) + table + listing->names_len, 0,
+            size - sizeof(record) - table - listing->names_len);
+    cache->pending_len += size;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/**
+ * Marks the slots of mapped records that pending records replace, so they are
+ * left out of a compacted file.
+ *
+ * @return the bytes of mapped records that are still live.
+ */
+static uint64_t mark_superseded(struct dircache *cache)
+{
+    uint64_t live = cache->live_bytes;
+    for (size_t p = 0; p < cache->pending_len; ) {
+        const struct dircache_record *record = (const void *) (cache->pending + p);
+        p += record->size;
+        if (cache->count == 0) {
+            continue;
+        }
+        struct slot *slot = find_slot(cache->slots, cache->capacity, record->dev, record->ino);
+        if (slot->offset != 0 && slot->offset != SUPERSEDED) {
+            live -= ((const struct dircache_record *) (cache->map + slot->offset))->size;
+            slot->offset = SUPERSEDED;
+        }
+    }
+    return live;
+}
+
+/**
+ * Writes the live records and the pending ones to a new file and renames it
+ * over the cache. The caller holds the lock on the old file, so no other
+ * writer can be compacting at the same time.
+ */
+static int compact(struct dircache *cache)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+
+    /* Live records keep their order, so directories stay near their parents. */
+    struct dircache_header header = { DIRCACHE_MAGIC, DIRCACHE_VERSION, sizeof(header) };
+    fwrite(&header, sizeof(header), 1, out);
+    for (uint64_t offset = sizeof(header); offset < cache->map_len; ) {
+        if (!valid_record(cache->map, cache->map_len, offset)) {
+            break;
+        }
+        const struct dircache_record *record = (const void *) (cache->map + offset);
+        if (find_slot(cache->slots, cache->capacity, record->dev, record->ino)->offset
+                == offset) {
+            fwrite(record, record->size, 1, out);
+            header.length += record->size;
+        }
+        offset += record->size;
+    }
+    fwrite(cache->pending, 1, cache->pending_len, out);
+    header.length += cache->pending_len;
+
+    LOG("Compacting %s from %llu to %llu bytes\n", cache->path,
+            (unsigned long long) (cache->map_len + cache->pending_len),
+            (unsigned long long) header.length);
+    if (fseek(out, 0, SEEK_SET) == -1 || fwrite(&header, sizeof(header), 1, out) != 1
+            || ferror(out)) {
+        int err = errno;
+        fclose(out);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    if (fclose(out) != 0 || rename(tmp, cache->path) == -1) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends the pending records and then extends the header's length over them,
+ * so the new records only become visible once they are complete.
+ */
+static int append(struct dircache *cache, int fd)
+{
+    struct dircache_header header = { DIRCACHE_MAGIC, DIRCACHE_VERSION, sizeof(header) };
+    if (cache->map != NULL) {
+        header.length = cache->map_len;
+    }
+    size_t written = 0;
+    while (written < cache->pending_len) {
+        ssize_t n = pwrite(fd, cache->pending + written, cache->pending_len - written,
+                header.length + written);
+        if (n == -1) {
+            return -1;
+        }
+        written += n;
+    }
+    header.length += cache->pending_len;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the pending records to the cache file, compacting it if most of it
+ * would be superseded records.
+ */
+static int flush(struct dircache *cache)
+{
+    while (true) {
+        int fd = open(cache->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return -1;
+        }
+        struct stat st, path_st;
+        if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        // the file we locked may have been compacted and replaced meanwhile
+        if (stat(cache->path, &path_st) == -1 || path_st.st_ino != st.st_ino
+                || path_st.st_dev != st.st_dev) {
+            close(fd);
+            continue;
+        }
+
+        /* Other searches may have written since we loaded the file. */
+        int rc = 0;
+        if (st.st_size != 0 && (cache->map == NULL || (uint64_t) st.st_size != cache->map_len)) {
+            rc = load(cache, fd);
+        }
+        if (rc == 0) {
+            uint64_t live = mark_superseded(cache) + cache->pending_len;
+            uint64_t total = cache->map_len + cache->pending_len;
+            if (total >= COMPACT_MIN_BYTES && live < total / 2) {
+                rc = compact(cache);
+            } else {
+                rc = append(cache, fd);
+            }
+        }
+        int err = errno;
+        flock(fd, LOCK_UN);
+        close(fd);
+        errno = err;
+        return rc;
+    }
+}
+
+int dircache_close(struct dircache *cache)
+{
+    if (cache == NULL) {
+        return 0;
+    }
+    int rc = 0;
+    if (cache->pending_len > 0) {
+        rc = flush(cache);
+    }
+    int err = errno;
+    unload(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->pending);
+    free(cache->path);
+    free(cache);
+    errno = err;
+    return rc;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file dircache.h
+ *
+ * A persistent cache of directory listings for repeated searches of the same
+ * tree. Listings (names, types and inode numbers) are keyed by the directory's
+ * device and inode and stamped with its mtime: a directory whose mtime hasn't
+ * changed still has the same entries, so the search replays the cached listing
+ * instead of reading the directory again. On network file systems this turns a
+ * series of getdents() round trips into a single fstat() per directory.
+ *
+ * The file is an append-only log of listings behind a small header. It is
+ * mapped read-only when the cache is opened; listings read during the search
+ * are appended when it is closed, under an exclusive flock(). Appends never
+ * touch bytes that other processes may have mapped, and the header's length
+ * only covers complete listings, so readers never see a partial one. Once
+ * superseded listings take up most of the file, the writer compacts it into a
+ * new file and renames that over the old one.
+ *
+ * Example Usage:
+ *
+ *     opts.cache = dircache_open("listings.cache");
+ *     search_run(root, &opts, callback, ctx);
+ *     dircache_close(opts.cache);
+ */
+
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "search.h"
+
+#define DIRCACHE_MAGIC 0x48435244 // "DRCH"
+#define DIRCACHE_VERSION 1
+
+/**
+ * Listings of directories modified less than this many nanoseconds before
+ * they were read are not cached: a change made within the same timestamp tick
+ * would leave the mtime as it was. Two seconds covers file systems with coarse
+ * timestamps.
+ */
+#define DIRCACHE_RACY_NS (2 * 1000000000LL)
+
+struct dircache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t length;        // bytes of complete records, including the header
+};
+
+/**
+ * A listing: this header, 'count' entries in directory order, and then the
+ * entries' NUL-terminated names. Records are 8-byte aligned; 'size' covers the
+ * whole record, padding included.
+ */
+struct dircache_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint32_t count;
+    uint32_t size;
+};
+
+struct dircache_entry {
+    uint64_t ino;
+    uint32_t name_offset;   // from the end of the entry table
+    uint8_t type;           // d_type, resolved if the file system left it unknown
+    uint8_t reserved[3];
+};
+
+/**
+ * A listing being read from a directory, to be stored once it is complete.
+ */
+struct dircache_listing {
+    struct dircache_entry *entries;
+    size_t len;
+    size_t cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+};
+
+struct dircache;
+
+/**
+ * Opens the cache in 'path'. A missing file is an empty cache; it is created
+ * when listings are first written to it.
+ *
+ * @return the cache, or NULL on error (errno is set; EINVAL if the file is not
+ * a listing cache).
+ */
+SEARCH_API struct dircache *dircache_open(const char *path);
+
+/**
+ * Writes the listings stored since the cache was opened and frees it. The
+ * cache must not be in use by any search.
+ *
+ * @return 0 on success, or -1 if the listings could not be written (errno is
+ * set). The cache is freed either way.
+ */
+SEARCH_API int dircache_close(struct dircache *cache);
+
+/**
+ * Finds the listing of a directory, if it is cached with the given mtime.
+ * Safe to call from several searches at once.
+ *
+ * @return the listing, or NULL.
+ */
+const struct dircache_record *dircache_lookup(const struct dircache *cache,
+        dev_t dev, ino_t ino, int64_t mtime_ns);
+
+/**
+ * Retrieves a listing's entries and the name of one of them.
+ */
+const struct dircache_entry *dircache_entries(const struct dircache_record *record);
+const char *dircache_name(const struct dircache_record *record,
+        const struct dircache_entry *entry);
+
+/**
+ * Adds an entry to a listing being read.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int dircache_listing_add(struct dircache_listing *listing, const char *name,
+        ino_t ino, unsigned char type);
+
+void dircache_listing_free(struct dircache_listing *listing);
+
+/**
+ * Stores a complete listing, to be written when the cache is closed. Listings
+ * of recently modified directories are ignored (see DIRCACHE_RACY_NS). Safe
+ * to call from several searches at once.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int dircache_store(struct dircache *cache, dev_t dev, ino_t ino, int64_t mtime_ns,
+        const struct dircache_listing *listing);
+
+#endif
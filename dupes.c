@@ -0,0 +1,292 @@
+/**
+ * @file dupes.c
+ *
+ * Implementation of the duplicate finder declared in dupes.h. After each
+ * stage, the files are sorted by (size, hash) and only runs of two or more
+ * files with the same key are kept, so every stage works on a shorter list.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dupes.h"
+#include "hash.h"
+#include "logger.h"
+
+struct dupe_file {
+    uint64_t size;
+    uint64_t hash;      // of the latest stage
+    size_t path;        // offset of the path in the arena
+    size_t seq;         // order in which the file was added
+    bool failed;        // could not be read; dropped after the stage
+};
+
+struct dupes {
+    struct dupe_file *files;
+    size_t len;
+    size_t cap;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+
+    char **buffers;     // a read buffer for each pool thread, while hashing
+};
+
+struct dupes *dupes_create(void)
+{
+    return calloc(1, sizeof(struct dupes));
+}
+
+int dupes_add(struct dupes *dupes, const char *path, size_t path_len, uint64_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    if (dupes->len == dupes->cap) {
+        size_t cap = dupes->cap == 0 ? 1024 : dupes->cap * 2;
+        struct dupe_file *files = realloc(dupes->files, cap * sizeof(struct dupe_file));
+        if (files == NULL) {
+            return -1;
+        }
+        dupes->files = files;
+        dupes->cap = cap;
+    }
+    if (dupes->arena_len + path_len + 1 > dupes->arena_cap) {
+        size_t cap = dupes->arena_cap == 0 ? 64 * 1024 : dupes->arena_cap * 2;
+        while (cap < dupes->arena_len + path_len + 1) {
+            cap *= 2;
+        }
+        char *arena = realloc(dupes->arena, cap);
+        if (arena == NULL) {
+            return -1;
+        }
+        dupes->arena = arena;
+        dupes->arena_cap = cap;
+    }
+    memcpy(dupes->arena + dupes->arena_len, path, path_len + 1);
+    dupes->files[dupes->len] = (struct dupe_file) {
+        .size = size,
+        .path = dupes->arena_len,
+        .seq = dupes->len,
+    };
+    dupes->len++;
+    dupes->arena_len += path_len + 1;
+    return 0;
+}
+
+/**
+ * Orders files by size (largest first), then hash, then the order they were
+ * added in.
+ */
+static int compare_files(const void *a, const void *b)
+{
+    const struct dupe_file *fa = a;
+    const struct dupe_file *fb = b;
+    if (fa->size != fb->size) {
+        return fa->size > fb->size ? -1 : 1;
+    }
+    if (fa->hash != fb->hash) {
+        return fa->hash < fb->hash ? -1 : 1;
+    }
+    return fa->seq < fb->seq ? -1 : fa->seq > fb->seq;
+}
+
+static bool same_key(const struct dupe_file *a, const struct dupe_file *b)
+{
+    return a->size == b->size && a->hash == b->hash;
+}
+
+/**
+ * Drops unreadable files and files whose (size, hash) is unique.
+ */
+static void keep_groups(struct dupes *dupes)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < dupes->len; ++i) {
+        if (!dupes->files[i].failed) {
+            dupes->files[kept++] = dupes->files[i];
+        }
+    }
+    qsort(dupes->files, kept, sizeof(struct dupe_file), compare_files);
+
+    size_t len = 0;
+    for (size_t i = 0; i < kept; ) {
+        size_t j = i + 1;
+        while (j < kept && same_key(&dupes->files[i], &dupes->files[j])) {
+            j++;
+        }
+        if (j - i >= 2) {
+            memmove(&dupes->files[len], &dupes->files[i], (j - i) * sizeof(struct dupe_file));
+            len += j - i;
+        }
+        i = j;
+    }
+    dupes->len = len;
+}
+
+/**
+ * Reads up to 'len' bytes at 'offset', stopping early only at the end of the
+ * file.
+ *
+ * @return the number of bytes read, or -1 on error.
+ */
+static ssize_t read_at(int fd, char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Hashes the first and last DUPES_EDGE bytes of a file. Runs on the pool.
+ */
+static void hash_edges(void *ctx, size_t worker, size_t index)
+{
+    struct dupes *dupes = ctx;
+    struct dupe_file *file = &dupes->files[index];
+    const char *path = dupes->arena + file->path;
+    char *buf = dupes->buffers[worker];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t head = -1, tail = 0;
+    if (fd != -1) {
+        head = read_at(fd, buf, file->size < DUPES_EDGE ? file->size : DUPES_EDGE, 0);
+        if (head != -1 && file->size > DUPES_EDGE) {
+            // the tail starts after the head, so small files are read only once
+            uint64_t start = file->size - DUPES_EDGE > DUPES_EDGE
+                ? file->size - DUPES_EDGE : DUPES_EDGE;
+            tail = read_at(fd, buf + head, file->size - start, start);
+        }
+    }
+    if (fd == -1 || head == -1 || tail == -1) {
+        perror(path);
+        file->failed = true;
+    } else {
+        struct xxh64_state state;
+        xxh64_init(&state, 0);
+        xxh64_update(&state, buf, head + tail);
+        file->hash = xxh64_digest(&state);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Hashes a whole file. Runs on the pool.
+ */
+static void hash_contents(void *ctx, size_t worker, size_t index)
+{
+    struct dupes *dupes = ctx;
+    struct dupe_file *file = &dupes->files[index];
+    if (file->size <= 2 * DUPES_EDGE) {
+        // the edges already covered all of it
+        return;
+    }
+    const char *path = dupes->arena + file->path;
+    char *buf = dupes->buffers[worker];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(path);
+        file->failed = true;
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct xxh64_state state;
+    xxh64_init(&state, 0);
+    ssize_t n;
+    while ((n = read(fd, buf, DUPES_READ_SIZE)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror(path);
+            file->failed = true;
+            break;
+        }
+        xxh64_update(&state, buf, n);
+    }
+    file->hash = xxh64_digest(&state);
+    close(fd);
+}
+
+int dupes_find(struct dupes *dupes, struct pool *pool, dupes_fn fn, void *ctx)
+{
+    size_t threads = pool_size(pool);
+    dupes->buffers = calloc(threads, sizeof(char *));
+    if (dupes->buffers == NULL) {
+        return -1;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < threads; ++i) {
+        // page-aligned, so reads go straight into whole pages
+        if (posix_memalign((void **) &dupes->buffers[i], 4096, DUPES_READ_SIZE) != 0) {
+            dupes->buffers[i] = NULL;
+            errno = ENOMEM;
+            rc = -1;
+        }
+    }
+
+    if (rc == 0) {
+        size_t total = dupes->len;
+        keep_groups(dupes);
+        size_t same_size = dupes->len;
+        pool_run(pool, dupes->len, hash_edges, dupes);
+        keep_groups(dupes);
+        size_t same_edges = dupes->len;
+        pool_run(pool, dupes->len, hash_contents, dupes);
+        keep_groups(dupes);
+        LOG("Duplicate candidates: %zu files, %zu by size, %zu by edges, %zu by contents\n",
+                total, same_size, same_edges, dupes->len);
+    }
+
+    const char **paths = rc == 0 ? malloc(dupes->len * sizeof(char *) + 1) : NULL;
+    if (rc == 0 && paths == NULL) {
+        rc = -1;
+    }
+    for (size_t i = 0; rc == 0 && i < dupes->len; ) {
+        size_t count = 0;
+        size_t j = i;
+        for (; j < dupes->len && same_key(&dupes->files[i], &dupes->files[j]); ++j) {
+            paths[count++] = dupes->arena + dupes->files[j].path;
+        }
+        fn(ctx, dupes->files[i].size, paths, count);
+        i = j;
+    }
+    free(paths);
+
+    for (size_t i = 0; i < threads; ++i) {
+        free(dupes->buffers[i]);
+    }
+    free(dupes->buffers);
+    dupes->buffers = NULL;
+    return rc;
+}
+
+void dupes_destroy(struct dupes *dupes)
+{
+    if (dupes == NULL) {
+        return;
+    }
+    free(dupes->files);
+    free(dupes->arena);
+    free(dupes);
+}
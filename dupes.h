@@ -0,0 +1,65 @@
+/**
+ * @file dupes.h
+ *
+ * Finding groups of identical files for --duplicates. Files are collected with
+ * their sizes during the search, and then narrowed down in stages so that
+ * most files are never read:
+ *
+ * 1. Only files that share their size with another file can have duplicates.
+ * 2. Of those, files whose first and last DUPES_EDGE bytes hash the same as
+ *    another file of the same size remain.
+ * 3. The remaining files are hashed in full (XXH64), and files of the same
+ *    size with the same hash are reported as a group.
+ *
+ * The hashing stages run on a worker pool, with large aligned reads.
+ */
+
+#ifndef _DUPES_H_
+#define _DUPES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+/**
+ * Bytes hashed at each end of a file in the partial-hash stage. Files of up to
+ * twice this size are read in full by that stage already.
+ */
+#define DUPES_EDGE 4096
+
+/**
+ * Size of each thread's read buffer for full hashes.
+ */
+#define DUPES_READ_SIZE (1024 * 1024)
+
+struct dupes;
+
+/**
+ * Receives a group of identical files, in the order they were added.
+ */
+typedef void (*dupes_fn)(void *ctx, uint64_t size, const char *const *paths, size_t count);
+
+/**
+ * @return a new, empty set of files, or NULL on allocation failure.
+ */
+struct dupes *dupes_create(void);
+
+/**
+ * Adds a file. Empty files are ignored.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int dupes_add(struct dupes *dupes, const char *path, size_t path_len, uint64_t size);
+
+/**
+ * Finds the groups of identical files and passes them to 'fn', largest files
+ * first. Files that can't be read are reported to stderr and left out.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int dupes_find(struct dupes *dupes, struct pool *pool, dupes_fn fn, void *ctx);
+
+void dupes_destroy(struct dupes *dupes);
+
+#endif
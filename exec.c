@@ -0,0 +1,239 @@
+/**
+ * @file exec.c
+ *
+ * Implementation of the command runner declared in exec.h. A batch's paths
+ * are copied into an arena sized to the argument limit, so a full batch never
+ * needs to grow it; the arena is reused once the batch's command has started,
+ * since posix_spawnp() returns only after the arguments have been copied into
+ * the new process.
+ */
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "exec.h"
+#include "logger.h"
+
+extern char **environ;
+
+/**
+ * Room left for the kernel's own bookkeeping when packing a batch, as xargs(1)
+ * does.
+ */
+#define EXEC_HEADROOM 2048
+
+struct exec_runner {
+    char *const *command;   // the command as given, "{}" words included
+    size_t command_len;
+    bool batch;
+    bool failed;            // a command failed or could not be started
+
+    pid_t *running;         // commands that haven't been waited for yet
+    size_t running_len;
+    size_t max_running;
+
+    char **args;            // the next argv to run, NULL-terminated
+    size_t args_len;        // words in 'args' (the fixed words, then paths)
+    size_t args_cap;
+    size_t fixed_len;       // words of the command before the batch's paths
+
+    char *arena;            // the batch's paths
+    size_t arena_len;
+    size_t arg_bytes;       // argv size of the current batch, pointers included
+    size_t arg_limit;       // largest argv size allowed for a batch
+    size_t batches;
+};
+
+/**
+ * Works out how much of ARG_MAX is left for a command's arguments once the
+ * environment, which shares the same space, is accounted for.
+ */
+static size_t arg_limit(void)
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0 || arg_max > EXEC_ARGS_MAX) {
+        arg_max = EXEC_ARGS_MAX;
+    }
+    size_t env = 0;
+    for (char **var = environ; *var != NULL; ++var) {
+        env += strlen(*var) + 1 + sizeof(char *);
+    }
+    if ((size_t) arg_max < env + EXEC_HEADROOM) {
+        return 0;
+    }
+    return arg_max - env - EXEC_HEADROOM;
+}
+
+struct exec_runner *exec_create(char *const argv[], size_t argc, bool batch, int jobs)
+{
+    if (argc == 0 || (batch && strcmp(argv[argc - 1], "{}") != 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct exec_runner *runner = calloc(1, sizeof(struct exec_runner));
+    if (runner == NULL) {
+        return NULL;
+    }
+    runner->command = argv;
+    runner->command_len = argc;
+    runner->batch = batch;
+    runner->max_running = jobs > 0 ? jobs : 1;
+    runner->running = calloc(runner->max_running, sizeof(pid_t));
+    runner->args_cap = argc + 1;
+    runner->args = calloc(runner->args_cap, sizeof(char *));
+    if (runner->running == NULL || runner->args == NULL) {
+        exec_destroy(runner);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (batch) {
+        runner->fixed_len = argc - 1;
+        runner->arg_bytes = sizeof(char *); // the terminating NULL
+        for (size_t i = 0; i < runner->fixed_len; ++i) {
+            runner->args[i] = argv[i];
+            runner->arg_bytes += strlen(argv[i]) + 1 + sizeof(char *);
+        }
+        runner->args_len = runner->fixed_len;
+        runner->arg_limit = arg_limit();
+        runner->arena = malloc(runner->arg_limit);
+        if (runner->arena == NULL) {
+            exec_destroy(runner);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return runner;
+}
+
+/**
+ * Waits for one of the running commands to finish.
+ */
+static void reap(struct exec_runner *runner)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (pid == -1) {
+        // nothing left to wait for, whatever the table says
+        runner->running_len = 0;
+        return;
+    }
+    for (size_t i = 0; i < runner->running_len; ++i) {
+        if (runner->running[i] == pid) {
+            runner->running[i] = runner->running[--runner->running_len];
+            break;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        runner->failed = true;
+    }
+}
+
+/**
+ * Starts the command in 'args', once there is a free slot for it.
+ */
+static void launch(struct exec_runner *runner, char **args)
+{
+    while (runner->running_len >= runner->max_running) {
+        reap(runner);
+    }
+    pid_t pid;
+    int rc = posix_spawnp(&pid, args[0], NULL, NULL, args, environ);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(rc));
+        runner->failed = true;
+        return;
+    }
+    runner->running[runner->running_len++] = pid;
+}
+
+/**
+ * Runs the current batch and starts a new, empty one.
+ */
+static void run_batch(struct exec_runner *runner)
+{
+    runner->args[runner->args_len] = NULL;
+    launch(runner, runner->args);
+    runner->batches++;
+
+    runner->args_len = runner->fixed_len;
+    runner->arena_len = 0;
+    runner->arg_bytes = sizeof(char *);
+    for (size_t i = 0; i < runner->fixed_len; ++i) {
+        runner->arg_bytes += strlen(runner->args[i]) + 1 + sizeof(char *);
+    }
+}
+
+int exec_add(struct exec_runner *runner, const char *path, size_t path_len)
+{
+    if (!runner->batch) {
+        for (size_t i = 0; i < runner->command_len; ++i) {
+            const char *word = runner->command[i];
+            runner->args[i] = (char *) (strcmp(word, "{}") == 0 ? path : word);
+        }
+        runner->args[runner->command_len] = NULL;
+        launch(runner, runner->args);
+        return 0;
+    }
+
+    size_t cost = path_len + 1 + sizeof(char *);
+    if (runner->args_len > runner->fixed_len
+            && runner->arg_bytes + cost > runner->arg_limit) {
+        run_batch(runner);
+    }
+    if (runner->arg_bytes + cost > runner->arg_limit) {
+        // too long to run even on its own
+        fprintf(stderr, "%s: %s\n", path, strerror(E2BIG));
+        runner->failed = true;
+        return 0;
+    }
+    if (runner->args_len + 1 >= runner->args_cap) {
+        size_t cap = runner->args_cap * 2;
+        char **args = realloc(runner->args, cap * sizeof(char *));
+        if (args == NULL) {
+            return -1;
+        }
+        runner->args = args;
+        runner->args_cap = cap;
+    }
+    char *copy = runner->arena + runner->arena_len;
+    memcpy(copy, path, path_len + 1);
+    runner->arena_len += path_len + 1;
+    runner->arg_bytes += cost;
+    runner->args[runner->args_len++] = copy;
+    return 0;
+}
+
+int exec_finish(struct exec_runner *runner)
+{
+    if (runner->batch && runner->args_len > runner->fixed_len) {
+        run_batch(runner);
+    }
+    while (runner->running_len > 0) {
+        reap(runner);
+    }
+    if (runner->batch) {
+        LOG("Ran %zu batches of at most %zu argument bytes\n",
+                runner->batches, runner->arg_limit);
+    }
+    return runner->failed ? 1 : 0;
+}
+
+void exec_destroy(struct exec_runner *runner)
+{
+    if (runner == NULL) {
+        return;
+    }
+    free(runner->running);
+    free(runner->args);
+    free(runner->arena);
+    free(runner);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file exec.h
+ *
+ * Running a command on matches for --exec and --exec-batch, as find(1) does.
+ * Commands are started with posix_spawnp() as soon as their arguments are
+ * known, and up to a fixed number of them run at once while the search goes
+ * on. Paths are passed as arguments as they are, so names containing spaces
+ * or newlines arrive intact.
+ *
+ * With --exec, the command runs once per path, with every argument that is
+ * exactly "{}" replaced by the path. With --exec-batch, paths are appended to
+ * the command (in place of a final "{}") until the arguments and environment
+ * would no longer fit within ARG_MAX, and each full batch runs as one command.
+ *
+ * Example Usage:
+ *
+ *     struct exec_runner *runner = exec_create(argv, argc, true, jobs);
+ *     exec_add(runner, path, path_len);   // for each match
+ *     int failed = exec_finish(runner);
+ *     exec_destroy(runner);
+ */
+
+#ifndef _EXEC_H_
+#define _EXEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Upper bound on the argument bytes of one --exec-batch command, even where
+ * ARG_MAX allows more. Can be overridden at compile time.
+ */
+#ifndef EXEC_ARGS_MAX
+#define EXEC_ARGS_MAX (2 * 1024 * 1024)
+#endif
+
+struct exec_runner;
+
+/**
+ * Prepares to run the command 'argv' (of 'argc' words, which must outlive the
+ * runner). In batch mode, the last word must be "{}". At most 'jobs' commands
+ * run at a time.
+ *
+ * @return the runner, or NULL on error (errno is EINVAL for a batch command
+ * that doesn't end in "{}", or ENOMEM).
+ */
+struct exec_runner *exec_create(char *const argv[], size_t argc, bool batch, int jobs);
+
+/**
+ * Runs the command on a path, or adds the path to the current batch (which is
+ * started first if the path doesn't fit). Waits for a running command to
+ * finish if 'jobs' are running already.
+ *
+ * @return 0 on success, or -1 on allocation failure. Commands that can't be
+ * started are reported to stderr and counted as failed.
+ */
+int exec_add(struct exec_runner *runner, const char *path, size_t path_len);
+
+/**
+ * Runs the last, partial batch and waits for every command to finish.
+ *
+ * @return 0 if every command exited with status 0, or 1 otherwise.
+ */
+int exec_finish(struct exec_runner *runner);
+
+void exec_destroy(struct exec_runner *runner);
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file ext_set.c
+ *
+ * Implementation of the extension sets declared in ext_set.h.
+ */
+
+#define _GNU_SOURCE // memrchr()
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext_set.h"
+
+struct ext_slot {
+    uint32_t hash;
+    uint32_t offset;  // of the extension in the set's 'names'
+    uint32_t len;     // 0 for an empty slot
+};
+
+struct ext_set {
+    struct ext_slot *slots;
+    size_t mask;      // slot count - 1; the count is a power of two
+    char *names;      // the extensions, NUL-separated (folded with ignore_case)
+    size_t min_len;
+    size_t max_len;
+    int max_dots;     // most dots within any one extension
+    bool ignore_case;
+};
+
+static char fold(const struct ext_set *set, char c)
+{
+    return set->ignore_case && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* FNV-1a, over the folded bytes */
+static uint32_t hash_ext(const struct ext_set *set, const char *ext, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) fold(set, ext[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Finds the slot that holds the extension, or the empty slot where it would
+ * go.
+ */
+static struct ext_slot *probe(const struct ext_set *set, const char *ext, size_t len)
+{
+    uint32_t hash = hash_ext(set, ext, len);
+    size_t i = hash & set->mask;
+    while (set->slots[i].len != 0) {
+        struct ext_slot *slot = &set->slots[i];
+        if (slot->hash == hash && slot->len == len) {
+            const char *stored = set->names + slot->offset;
+            size_t j = 0;
+            while (j < len && stored[j] == fold(set, ext[j])) {
+                j++;
+            }
+            if (j == len) {
+                break;
+            }
+        }
+        i = (i + 1) & set->mask;
+    }
+    return &set->slots[i];
+}
+
+struct ext_set *ext_set_create(const char *list, bool ignore_case)
+{
+    struct ext_set *set = calloc(1, sizeof(struct ext_set));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->ignore_case = ignore_case;
+    set->min_len = SIZE_MAX;
+
+    size_t count = 1;
+    for (const char *c = list; *c != '\0'; ++c) {
+        count += *c == ',';
+    }
+    // at most half full, so probe sequences stay short
+    size_t capacity = 8;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    set->mask = capacity - 1;
+    set->slots = calloc(capacity, sizeof(struct ext_slot));
+    set->names = strdup(list);
+    if (set->slots == NULL || set->names == NULL) {
+        goto fail;
+    }
+
+    /* The extensions are split in place: each one's comma becomes its NUL,
+     * and a leading '.' is skipped. */
+    char *ext = set->names;
+    while (true) {
+        char *comma = strchr(ext, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+        }
+        if (*ext == '.') {
+            ext++;
+        }
+        size_t len = strlen(ext);
+        if (len == 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+        int dots = 0;
+        for (size_t i = 0; i < len; ++i) {
+            ext[i] = fold(set, ext[i]);
+            dots += ext[i] == '.';
+        }
+        struct ext_slot *slot = probe(set, ext, len);
+        if (slot->len == 0) {
+            slot->hash = hash_ext(set, ext, len);
+            slot->offset = ext - set->names;
+            slot->len = len;
+        }
+        set->min_len = len < set->min_len ? len : set->min_len;
+        set->max_len = len > set->max_len ? len : set->max_len;
+        set->max_dots = dots > set->max_dots ? dots : set->max_dots;
+        if (comma == NULL) {
+            break;
+        }
+        ext = comma + 1;
+    }
+    return set;
+
+fail:
+    ext_set_free(set);
+    return NULL;
+}
+
+bool ext_set_match(const struct ext_set *set, const char *name, size_t len)
+{
+    const char *end = name + len;
+    const char *dot = end;
+    for (int dots = 0; dots <= set->max_dots; ++dots) {
+        dot = memrchr(name, '.', dot - name);
+        if (dot == NULL || dot == name) {
+            return false;
+        }
+        size_t ext_len = end - dot - 1;
+        if (ext_len > set->max_len) {
+            // starting from an earlier dot only makes it longer
+            return false;
+        }
+        if (ext_len >= set->min_len && probe(set, dot + 1, ext_len)->len != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ext_set_free(struct ext_set *set)
+{
+    if (set == NULL) {
+        return;
+    }
+    free(set->slots);
+    free(set->names);
+    free(set);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file ext_set.h
+ *
+ * A set of file name extensions, for searches that take any of many kinds of
+ * file (say, every image and video format). The extensions are hashed into a
+ * small open-addressing table once, when the set is created, so checking a
+ * name costs one memrchr() for its last '.' and one table lookup, however
+ * many extensions there are.
+ *
+ * Extensions with dots of their own ("tar.gz") are allowed; names are then
+ * also checked from their earlier dots, up to as many as the longest such
+ * extension has.
+ *
+ * Example Usage:
+ *
+ *     opts.extensions = ext_set_create("jpg,png,mp4", false);
+ *     search_run(root, &opts, callback, ctx);
+ *     ext_set_free(opts.extensions);
+ */
+
+#ifndef _EXT_SET_H_
+#define _EXT_SET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "search.h"
+
+struct ext_set;
+
+/**
+ * Builds a set from a comma-separated list of extensions, each with or
+ * without its leading '.'. With 'ignore_case', ASCII letters match either
+ * case.
+ *
+ * @return the set, or NULL on error (errno is set; EINVAL if the list is
+ * empty or holds an empty extension).
+ */
+SEARCH_API struct ext_set *ext_set_create(const char *list, bool ignore_case);
+
+/**
+ * Checks whether a name ends in one of the set's extensions. A leading '.'
+ * doesn't start an extension, so ".jpg" has none.
+ */
+SEARCH_API bool ext_set_match(const struct ext_set *set, const char *name, size_t len);
+
+SEARCH_API void ext_set_free(struct ext_set *set);
+
+#endif
@@ -0,0 +1,236 @@
+/**
+ * @file fuzzy.c
+ *
+ * Implementation of the fuzzy matching declared in fuzzy.h. The score is the
+ * best over all the ways the pattern can be matched, found with a dynamic
+ * program over (pattern character, name position), one row per pattern
+ * character. Gaps are tracked with a running maximum, so each row costs
+ * O(name length).
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fuzzy.h"
+
+/* Scoring constants, as in fzf */
+#define SCORE_MATCH         16
+#define SCORE_GAP_START     (-3)
+#define SCORE_GAP_EXTENSION (-1)
+#define BONUS_BOUNDARY      (SCORE_MATCH / 2)
+#define BONUS_NON_WORD      (SCORE_MATCH / 2)
+#define BONUS_CAMEL         (BONUS_BOUNDARY + SCORE_GAP_EXTENSION)
+#define BONUS_CONSECUTIVE   (-(SCORE_GAP_START + SCORE_GAP_EXTENSION))
+#define BONUS_FIRST_CHAR    2
+
+/**
+ * Marks a position that can't be part of a match. Far enough from INT_MIN
+ * that adding penalties can't overflow.
+ */
+#define NO_SCORE (INT_MIN / 2)
+
+enum char_class {
+    CLASS_NON_WORD,
+    CLASS_LOWER,
+    CLASS_UPPER,
+    CLASS_DIGIT,
+};
+
+static bool is_upper(char c)
+{
+    return c >= 'A' && c <= 'Z';
+}
+
+static bool is_letter(char c)
+{
+    return is_upper(c) || (c >= 'a' && c <= 'z');
+}
+
+static char fold(char c)
+{
+    return is_upper(c) ? c | 0x20 : c;
+}
+
+static enum char_class classify(char c)
+{
+    if (c >= 'a' && c <= 'z') {
+        return CLASS_LOWER;
+    }
+    if (is_upper(c)) {
+        return CLASS_UPPER;
+    }
+    if (c >= '0' && c <= '9') {
+        return CLASS_DIGIT;
+    }
+    // '/', '_', '-', '.', spaces and everything outside ASCII
+    return CLASS_NON_WORD;
+}
+
+/**
+ * Bonus for matching a character of class 'cls' that follows one of class
+ * 'prev'.
+ */
+static int bonus_for(enum char_class prev, enum char_class cls)
+{
+    if (cls == CLASS_NON_WORD) {
+        return BONUS_NON_WORD;
+    }
+    if (prev == CLASS_NON_WORD) {
+        return BONUS_BOUNDARY;
+    }
+    if ((prev == CLASS_LOWER && cls == CLASS_UPPER)
+            || (prev != CLASS_DIGIT && cls == CLASS_DIGIT)) {
+        return BONUS_CAMEL;
+    }
+    return 0;
+}
+
+int fuzzy_init(struct fuzzy_query *query, const char *pattern)
+{
+    query->len = strlen(pattern);
+    query->pattern = malloc(query->len + 1);
+    if (query->pattern == NULL) {
+        return -1;
+    }
+    query->case_sensitive = false;
+    for (size_t i = 0; i < query->len; ++i) {
+        query->case_sensitive |= is_upper(pattern[i]);
+    }
+    for (size_t i = 0; i <= query->len; ++i) {
+        query->pattern[i] = query->case_sensitive ? pattern[i] : fold(pattern[i]);
+    }
+    return 0;
+}
+
+/**
+ * Finds the first occurrence of 'c' in 'str'. With 'fold_case', 'c' must be a
+ * lowercase letter and its uppercase form is found too: setting bit 0x20 of a
+ * byte turns only those two letters into 'c'.
+ */
+static const char *find_char(const char *str, size_t len, char c, bool fold_case)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i target = _mm_set1_epi8(c);
+    const __m128i case_bit = _mm_set1_epi8(fold_case ? 0x20 : 0);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_or_si128(_mm_loadu_si128((const __m128i *) (str + i)), case_bit);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+        if (mask != 0) {
+            return str + i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        if ((fold_case ? str[i] | 0x20 : str[i]) == c) {
+            return str + i;
+        }
+    }
+    return NULL;
+}
+
+bool fuzzy_prefilter(const struct fuzzy_query *query, const char *name, size_t len)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < query->len; ++i) {
+        char c = query->pattern[i];
+        bool fold_case = !query->case_sensitive && is_letter(c);
+        const char *found = find_char(name + pos, len - pos, c, fold_case);
+        if (found == NULL) {
+            return false;
+        }
+        pos = found - name + 1;
+    }
+    return true;
+}
+
+static int max(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+int fuzzy_score(const struct fuzzy_query *query, const char *name, size_t len)
+{
+    if (len > FUZZY_NAME_MAX || query->len > len) {
+        return -1;
+    }
+    if (query->len == 0) {
+        return 0;
+    }
+
+    /* Row i holds, for every position j, the best score of matching the first
+     * i + 1 pattern characters with the last one at j, and the bonus of the
+     * run of consecutive matches ending there. */
+    int bonus[FUZZY_NAME_MAX];
+    int score_rows[2][FUZZY_NAME_MAX];
+    int run_rows[2][FUZZY_NAME_MAX];
+    enum char_class prev = CLASS_NON_WORD;
+    for (size_t j = 0; j < len; ++j) {
+        enum char_class cls = classify(name[j]);
+        bonus[j] = bonus_for(prev, cls);
+        prev = cls;
+    }
+
+    int *scores = score_rows[0];
+    int *runs = run_rows[0];
+    char first = query->pattern[0];
+    for (size_t j = 0; j < len; ++j) {
+        char c = query->case_sensitive ? name[j] : fold(name[j]);
+        scores[j] = c == first ? SCORE_MATCH + bonus[j] * BONUS_FIRST_CHAR : NO_SCORE;
+        runs[j] = bonus[j];
+    }
+
+    for (size_t i = 1; i < query->len; ++i) {
+        const int *prev_scores = score_rows[(i - 1) % 2];
+        const int *prev_runs = run_rows[(i - 1) % 2];
+        scores = score_rows[i % 2];
+        runs = run_rows[i % 2];
+        char want = query->pattern[i];
+        // best score so far of leaving a gap before position j
+        int gap = NO_SCORE;
+        scores[0] = NO_SCORE;
+        runs[0] = 0;
+        for (size_t j = 1; j < len; ++j) {
+            if (j >= 2) {
+                gap = max(gap + SCORE_GAP_EXTENSION, prev_scores[j - 2] + SCORE_GAP_START);
+            }
+            char c = query->case_sensitive ? name[j] : fold(name[j]);
+            if (c != want) {
+                scores[j] = NO_SCORE;
+                continue;
+            }
+            // a consecutive match keeps the bonus of the run it extends
+            int run = max(max(prev_runs[j - 1], bonus[j]), BONUS_CONSECUTIVE);
+            int consecutive = prev_scores[j - 1] + SCORE_MATCH + run;
+            int after_gap = gap + SCORE_MATCH + bonus[j];
+            if (consecutive >= after_gap) {
+                scores[j] = consecutive;
+                runs[j] = run;
+            } else {
+                scores[j] = after_gap;
+                runs[j] = bonus[j];
+            }
+        }
+    }
+
+    int best = NO_SCORE;
+    for (size_t j = 0; j < len; ++j) {
+        best = max(best, scores[j]);
+    }
+    if (best <= NO_SCORE / 2) {
+        return -1;
+    }
+    // long gaps can push a weak match below zero
+    return max(best, 0);
+}
+
+void fuzzy_destroy(struct fuzzy_query *query)
+{
+    free(query->pattern);
+    query->pattern = NULL;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file fuzzy.h
+ *
+ * Fuzzy name matching for --fuzzy, in the style of fzf: a name matches if it
+ * contains the characters of the pattern in order, and matches are scored so
+ * that the ones a person most likely meant come first. Consecutive characters
+ * and characters at the start of a word (after '/', '_', '-', '.', a space, or
+ * at a lower-to-upper case change) score higher; gaps cost a little, and the
+ * first character counts double.
+ *
+ * Matching is case-insensitive unless the pattern contains an uppercase
+ * letter ("smart case"). Only ASCII letters are folded.
+ *
+ * Most names don't contain the pattern's characters at all, so every name is
+ * first checked with a cheap in-order scan (16 bytes at a time with SSE2), and
+ * only names that pass are scored.
+ */
+
+#ifndef _FUZZY_H_
+#define _FUZZY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Longest name that is scored. Longer names can't exist on Linux (NAME_MAX is
+ * 255) and are never matched.
+ */
+#define FUZZY_NAME_MAX 1024
+
+struct fuzzy_query {
+    char *pattern;          // folded to lowercase unless case_sensitive
+    size_t len;
+    bool case_sensitive;
+};
+
+/**
+ * Prepares a query for 'pattern'.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int fuzzy_init(struct fuzzy_query *query, const char *pattern);
+
+/**
+ * Checks whether a name contains the pattern's characters in order.
+ */
+bool fuzzy_prefilter(const struct fuzzy_query *query, const char *name, size_t len);
+
+/**
+ * Scores a name against the pattern, finding the best-scoring way to match
+ * the pattern's characters.
+ *
+ * @return the score (higher is better), or -1 if the name doesn't match.
+ */
+int fuzzy_score(const struct fuzzy_query *query, const char *name, size_t len);
+
+void fuzzy_destroy(struct fuzzy_query *query);
+
+#endif
@@ -0,0 +1,387 @@
+/**
+ * @file hash.c
+ *
+ * Implementation of the hashes declared in hash.h. XXH64 follows the
+ * reference specification: four lanes consume 32-byte stripes, and the
+ * remaining bytes are mixed in when the digest is taken. SHA-256 follows FIPS
+ * 180-4; its compression function comes in a portable version and one built
+ * on the SHA-NI instructions, picked at run time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#endif
+
+#include "hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= xxh64_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void xxh64_init(struct xxh64_state *state, uint64_t seed)
+{
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+    state->total_len = 0;
+    state->seed = seed;
+    state->buf_len = 0;
+}
+
+static void consume_stripes(uint64_t *acc, const uint8_t *p, size_t stripes)
+{
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (size_t i = 0; i < stripes; ++i, p += 32) {
+        a0 = xxh64_round(a0, read64(p));
+        a1 = xxh64_round(a1, read64(p + 8));
+        a2 = xxh64_round(a2, read64(p + 16));
+        a3 = xxh64_round(a3, read64(p + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+}
+
+void xxh64_update(struct xxh64_state *state, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    state->total_len += len;
+
+    if (state->buf_len > 0) {
+        size_t take = 32 - state->buf_len < len ? 32 - state->buf_len : len;
+        memcpy(state->buf + state->buf_len, p, take);
+        state->buf_len += take;
+        p += take;
+        len -= take;
+        if (state->buf_len < 32) {
+            return;
+        }
+        consume_stripes(state->acc, state->buf, 1);
+        state->buf_len = 0;
+    }
+    consume_stripes(state->acc, p, len / 32);
+    p += len / 32 * 32;
+    len %= 32;
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *state)
+{
+    uint64_t h;
+    if (state->total_len >= 32) {
+        const uint64_t *acc = state->acc;
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            h = xxh64_merge(h, acc[i]);
+        }
+    } else {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->total_len;
+
+    const uint8_t *p = state->buf;
+    size_t len = state->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (len >= 4) {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+typedef void (*sha256_blocks_fn)(uint32_t h[8], const uint8_t *p, size_t blocks);
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void sha256_blocks_generic(uint32_t h[8], const uint8_t *p, size_t blocks)
+{
+    for (; blocks > 0; --blocks, p += 64) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = load_be32(p + 4 * t);
+        }
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = rotr32(w[t - 15], 7) ^ rotr32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotr32(w[t - 2], 17) ^ rotr32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25))
+                + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += k;
+    }
+}
+
+#ifdef HAVE_SHA_NI
+/**
+ * The SHA-NI compression function. The state is kept as two vectors, ABEF and
+ * CDGH, which is the layout sha256rnds2 works on; each sha256rnds2 does two
+ * rounds, and sha256msg1/sha256msg2 extend the message schedule four words at
+ * a time.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t h[8], const uint8_t *p, size_t blocks)
+{
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);            // CDGH
+
+    for (; blocks > 0; --blocks, p += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 16; ++i) {
+            __m128i words;
+            if (i < 4) {
+                words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), byteswap);
+            } else {
+                words = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                words = _mm_add_epi32(words, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                words = _mm_sha256msg2_epu32(words, w[(i + 3) % 4]);
+            }
+            w[i % 4] = words;
+            __m128i msg = _mm_add_epi32(words, _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);               // DCHG
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(tmp, state1, 0xf0));   // DCBA
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(state1, tmp, 8));      // HGFE
+}
+
+static bool have_sha_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+            || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return false;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+#endif
+
+/**
+ * Picks the compression function on first use.
+ */
+static sha256_blocks_fn sha256_blocks(void)
+{
+    static sha256_blocks_fn blocks;
+    sha256_blocks_fn fn = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    if (fn == NULL) {
+        fn = sha256_blocks_generic;
+#ifdef HAVE_SHA_NI
+        if (have_sha_ni()) {
+            fn = sha256_blocks_shani;
+        }
+#endif
+        __atomic_store_n(&blocks, fn, __ATOMIC_RELAXED);
+    }
+    return fn;
+}
+
+void sha256_init(struct sha256_state *state)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(state->h, initial, sizeof(initial));
+    state->total_len = 0;
+    state->buf_len = 0;
+}
+
+void sha256_update(struct sha256_state *state, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    sha256_blocks_fn blocks = sha256_blocks();
+    state->total_len += len;
+
+    if (state->buf_len > 0) {
+        size_t take = 64 - state->buf_len < len ? 64 - state->buf_len : len;
+        memcpy(state->buf + state->buf_len, p, take);
+        state->buf_len += take;
+        p += take;
+        len -= take;
+        if (state->buf_len < 64) {
+            return;
+        }
+        blocks(state->h, state->buf, 1);
+        state->buf_len = 0;
+    }
+    blocks(state->h, p, len / 64);
+    p += len / 64 * 64;
+    len %= 64;
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+void sha256_final(struct sha256_state *state, uint8_t out[32])
+{
+    uint64_t bits = state->total_len * 8;
+    uint8_t pad[72] = { 0x80 };
+    // pad to 56 bytes past a block boundary, then append the length
+    size_t pad_len = (state->buf_len < 56 ? 56 : 120) - state->buf_len;
+    for (int i = 0; i < 8; ++i) {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(state, pad, pad_len + 8);
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = state->h[i] >> 24;
+        out[4 * i + 1] = state->h[i] >> 16;
+        out[4 * i + 2] = state->h[i] >> 8;
+        out[4 * i + 3] = state->h[i];
+    }
+}
+
+int hash_file(const char *path, enum hash_type type, char *buffer, char hex[HASH_HEX_MAX])
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct sha256_state sha;
+    struct xxh64_state xxh;
+    if (type == HASH_SHA256) {
+        sha256_init(&sha);
+    } else {
+        xxh64_init(&xxh, 0);
+    }
+    ssize_t n;
+    while ((n = read(fd, buffer, HASH_READ_SIZE)) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if (type == HASH_SHA256) {
+            sha256_update(&sha, buffer, n);
+        } else {
+            xxh64_update(&xxh, buffer, n);
+        }
+    }
+    close(fd);
+
+    if (type == HASH_SHA256) {
+        uint8_t digest[32];
+        sha256_final(&sha, digest);
+        for (int i = 0; i < 32; ++i) {
+            snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+        }
+    } else {
+        snprintf(hex, HASH_HEX_MAX, "%016llx", (unsigned long long) xxh64_digest(&xxh));
+    }
+    return 0;
+}
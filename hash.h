@@ -0,0 +1,82 @@
+/**
+ * @file hash.h
+ *
+ * Content hashes. XXH64 is a fast non-cryptographic 64-bit hash, used where
+ * files only need to be told apart (e.g., finding duplicates); SHA-256 is for
+ * checksums that have to hold up against tampering. SHA-256 uses the SHA
+ * extensions (SHA-NI) when the CPU has them. Hashes are fed incrementally, so
+ * files can be hashed in chunks of any size.
+ *
+ * Example Usage:
+ *
+ *     struct xxh64_state state;
+ *     xxh64_init(&state, 0);
+ *     while ((n = read(fd, buf, sizeof(buf))) > 0) {
+ *         xxh64_update(&state, buf, n);
+ *     }
+ *     uint64_t hash = xxh64_digest(&state);
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct xxh64_state {
+    uint64_t acc[4];        // lane accumulators
+    uint64_t total_len;
+    uint64_t seed;
+    uint8_t buf[32];        // input not yet making up a full stripe
+    size_t buf_len;
+};
+
+void xxh64_init(struct xxh64_state *state, uint64_t seed);
+void xxh64_update(struct xxh64_state *state, const void *data, size_t len);
+
+/**
+ * Retrieves the hash of everything passed in so far. The state can still be
+ * updated afterward.
+ */
+uint64_t xxh64_digest(const struct xxh64_state *state);
+
+struct sha256_state {
+    uint32_t h[8];
+    uint64_t total_len;
+    uint8_t buf[64];        // input not yet making up a full block
+    size_t buf_len;
+};
+
+void sha256_init(struct sha256_state *state);
+void sha256_update(struct sha256_state *state, const void *data, size_t len);
+
+/**
+ * Finishes the hash and writes the 32-byte digest to 'out'.
+ */
+void sha256_final(struct sha256_state *state, uint8_t out[32]);
+
+enum hash_type {
+    HASH_SHA256,
+    HASH_XXH64,
+};
+
+/**
+ * Longest hex digest produced by hash_file(), including the NUL.
+ */
+#define HASH_HEX_MAX 65
+
+/**
+ * Size of the read buffer hash_file() needs.
+ */
+#define HASH_READ_SIZE (1024 * 1024)
+
+/**
+ * Hashes a file's contents, reading it sequentially through 'buffer' (which
+ * must hold HASH_READ_SIZE bytes), and writes the digest to 'hex' as
+ * lowercase hex, in the form sha256sum(1) and xxhsum(1) print.
+ *
+ * @return 0 on success, or -1 if the file could not be read (errno is set).
+ */
+int hash_file(const char *path, enum hash_type type, char *buffer, char hex[HASH_HEX_MAX]);
+
+#endif
@@ -0,0 +1,1371 @@
+/**
+ * @file index.c
+ *
+ * Implementation of the persistent file name index declared in index.h.
+ *
+ * The tree is split into shards (subtrees) that worker threads search in
+ * parallel. Each worker buffers the paths it finds and spills them as sorted
+ * runs, and the runs are merged into the final entry table. Sorting the paths
+ * component by component keeps the table in depth-first order, so every
+ * directory is still followed by its descendants. The merged table goes
+ * straight to temporary files, so traversal and sorting only ever hold one
+ * run buffer per worker in memory.
+ *
+ * Posting lists are built with a counting sort over the whole trigram space:
+ * one pass counts how many names contain each trigram, and a second pass
+ * drops every entry number into its trigram's slot. Entries are visited in
+ * order, so each list comes out sorted and only needs to be delta encoded.
+ *
+ * Suffix arrays are built with SA-IS (Nong, Zhang and Chan, "Two Efficient
+ * Algorithms for Linear Time Suffix Array Construction"), which sorts the
+ * suffixes in time and extra space linear in the length of the text.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "logger.h"
+#include "runs.h"
+
+#define TRIGRAM_SPACE (1 << 24)
+
+#define EMPTY UINT32_MAX
+
+struct index {
+    const uint8_t *base;
+    size_t size;
+    const struct index_header *header;
+    const struct index_entry *entries;
+    const struct index_trigram *trigrams;
+    const uint8_t *postings;
+    const char *text;
+    const uint32_t *suffixes;
+    const uint32_t *names;
+    const char *paths;
+    const char *root;
+};
+
+/**
+ * A subtree searched by one worker, relative to the root ("" for the root).
+ */
+struct shard {
+    char *rel;
+};
+
+/**
+ * State shared by the threads of a build.
+ */
+struct build {
+    const char *root;
+    size_t root_len;        // length of the root as passed to search_run()
+    struct shard *shards;
+    size_t shard_count;
+    size_t shard_cap;
+    size_t next_shard;      // the next shard to search
+    int err;                // errno of the first failure, or 0
+    pthread_mutex_t lock;   // protects next_shard and err
+    unsigned int flags;     // extra SEARCH_* flags for every shard's search
+};
+
+struct worker {
+    pthread_t thread;
+    struct build *build;
+    struct run_buffer runs;
+    bool split;             // also turn every directory found into a shard
+    int err;
+    struct search_stats stats; // totals of the worker's searches
+};
+
+/**
+ * The merged entry table, written to temporary files and then mapped back in
+ * to build the name index.
+ */
+struct builder {
+    FILE *entries_file;
+    FILE *paths_file;
+    struct index_entry *entries;
+    uint32_t len;
+    char *paths;
+    size_t paths_len;
+
+    /* INDEX_TRIGRAMS */
+    struct index_trigram *table;
+    uint32_t table_len;
+    uint8_t *postings;
+    size_t postings_len;
+
+    /* INDEX_SUFFIX_ARRAY */
+    char *text;
+    size_t text_len;
+    uint32_t *names;
+    uint32_t *suffixes;  // includes the sentinel suffix
+};
+
+/**
+ * Retrieves the distinct trigrams of a string, sorted. 'out' must have room
+ * for 'len' trigrams.
+ *
+ * @return the number of trigrams.
+ */
+static size_t get_trigrams(const char *str, size_t len, uint32_t *out)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    size_t n = 0;
+    for (size_t i = 0; i + 2 < len; ++i) {
+        uint32_t t = (uint32_t) s[i] << 16 | (uint32_t) s[i + 1] << 8 | s[i + 2];
+        // names are short, so an insertion sort beats qsort() here
+        size_t j = n;
+        while (j > 0 && out[j - 1] > t) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        if (j > 0 && out[j - 1] == t) {
+            memmove(&out[j], &out[j + 1], (n - j) * sizeof(uint32_t));
+            continue;
+        }
+        out[j] = t;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *write_varint(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static const uint8_t *read_varint(const uint8_t *p, uint32_t *value)
+{
+    uint32_t v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        v |= (uint32_t) (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = v | (uint32_t) *p++ << shift;
+    return p;
+}
+
+static int add_shard(struct build *b, const char *rel, size_t len)
+{
+    if (b->shard_count == b->shard_cap) {
+        size_t cap = b->shard_cap == 0 ? 64 : b->shard_cap * 2;
+        struct shard *shards = realloc(b->shards, cap * sizeof(struct shard));
+        if (shards == NULL) {
+            return -1;
+        }
+        b->shards = shards;
+        b->shard_cap = cap;
+    }
+    char *copy = strndup(rel, len);
+    if (copy == NULL) {
+        return -1;
+    }
+    b->shards[b->shard_count++].rel = copy;
+    return 0;
+}
+
+/**
+ * Receives entries from search_run() and buffers their paths (relative to the
+ * root) for sorting.
+ */
+static int add_entries(void *arg, const struct search_entry *entries, size_t count)
+{
+    struct worker *w = arg;
+    struct build *b = w->build;
+    for (size_t i = 0; i < count; ++i) {
+        const char *rel = entries[i].path + b->root_len + 1;
+        size_t len = entries[i].path_len - b->root_len - 1;
+        if (run_buffer_add(&w->runs, rel, len, entries[i].type) == -1
+                || (w->split && entries[i].type == DT_DIR
+                    && add_shard(b, rel, len) == -1)) {
+            w->err = errno;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Searches a shard. With 'list_only', only the shard's own entries are read.
+ *
+ * @return 0 on success, or -1 on failure (w->err is set).
+ */
+static int search_shard(struct worker *w, const char *rel, bool list_only)
+{
+    struct build *b = w->build;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s%s", b->root, rel[0] == '\0' ? "" : "/",
+                rel) >= (int) sizeof(path)) {
+        w->err = ENAMETOOLONG;
+        return -1;
+    }
+    struct search_opts opts;
+    search_opts_init(&opts);
+    opts.show_hidden = true;
+    opts.max_depth = list_only ? 1 : -1;
+    opts.flags |= b->flags;
+    struct search_stats stats = { 0 };
+    opts.stats = &stats;
+    w->split = list_only;
+
+    int rc = search_run(path, &opts, add_entries, w);
+    search_stats_merge(&w->stats, &stats);
+    if (rc == -1) {
+        /* The root must be readable, but a subdirectory that can't be opened
+         * is only reported, as it would be by a direct search. */
+        if (rel[0] == '\0') {
+            w->err = errno;
+            return -1;
+        }
+        perror("opendir");
+    }
+    return rc == 1 ? -1 : 0;
+}
+
+static void fail(struct build *b, int err)
+{
+    pthread_mutex_lock(&b->lock);
+    if (b->err == 0) {
+        b->err = err;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct build *b = w->build;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        if (b->err != 0 || b->next_shard == b->shard_count) {
+            pthread_mutex_unlock(&b->lock);
+            break;
+        }
+        const char *rel = b->shards[b->next_shard++].rel;
+        pthread_mutex_unlock(&b->lock);
+
+        if (search_shard(w, rel, false) == -1) {
+            fail(b, w->err);
+            return NULL;
+        }
+    }
+    // whatever is left in the buffer becomes the worker's last run
+    if (run_buffer_spill(&w->runs) == -1) {
+        fail(b, errno);
+    }
+    return NULL;
+}
+
+/**
+ * Searches the tree on 'jobs' threads, leaving sorted runs in the workers'
+ * buffers.
+ *
+ * @return 0 on success, or -1 on failure (errno is set).
+ */
+static int search_shards(struct build *b, struct worker *workers, int jobs)
+{
+    /* Split the tree breadth-first on this thread until there are enough
+     * shards to keep every worker busy. */
+    size_t target = jobs > 1 ? (size_t) jobs * 8 : 1;
+    if (add_shard(b, "", 0) == -1) {
+        return -1;
+    }
+    while (b->next_shard < b->shard_count && b->shard_count - b->next_shard < target) {
+        const char *rel = b->shards[b->next_shard++].rel;
+        if (search_shard(&workers[0], rel, true) == -1) {
+            errno = workers[0].err;
+            return -1;
+        }
+    }
+    LOG("Searching %zu shards on %d threads\n", b->shard_count - b->next_shard, jobs);
+
+    int started = 1;
+    for (; started < jobs; ++started) {
+        if (pthread_create(&workers[started].thread, NULL, worker_main,
+                    &workers[started]) != 0) {
+            break;
+        }
+    }
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (b->err != 0) {
+        errno = b->err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receives the merged paths in order and appends them to the entry table.
+ */
+static int add_entry(void *arg, const char *path, size_t len, unsigned char type)
+{
+    struct builder *b = arg;
+    if (b->len == UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    struct index_entry e = {
+        .path_offset = b->paths_len,
+        .path_len = len,
+        .name_len = len,
+        .type = type,
+    };
+    for (size_t i = 0; i < len; ++i) {
+        if (path[i] == '/') {
+            e.depth++;
+            e.name_len = len - i - 1;
+        }
+    }
+    if (fwrite(&e, sizeof(e), 1, b->entries_file) != 1
+            || fwrite(path, 1, len + 1, b->paths_file) != len + 1) {
+        return -1;
+    }
+    b->len++;
+    b->paths_len += len + 1;
+    return 0;
+}
+
+/**
+ * Maps the merged entry table back into memory (writable, so directory ends
+ * can be filled in).
+ */
+static int map_tables(struct builder *b)
+{
+    if (fflush(b->entries_file) != 0 || fflush(b->paths_file) != 0) {
+        return -1;
+    }
+    if (b->len == 0) {
+        return 0;
+    }
+    size_t entries_size = (size_t) b->len * sizeof(struct index_entry);
+    void *entries = mmap(NULL, entries_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fileno(b->entries_file), 0);
+    if (entries == MAP_FAILED) {
+        return -1;
+    }
+    void *paths = mmap(NULL, b->paths_len, PROT_READ, MAP_SHARED,
+            fileno(b->paths_file), 0);
+    if (paths == MAP_FAILED) {
+        munmap(entries, entries_size);
+        return -1;
+    }
+    b->entries = entries;
+    b->paths = paths;
+    return 0;
+}
+
+/**
+ * Finds where each directory's descendants end. Entries are in depth-first
+ * order, so a directory ends at the first later entry that is no deeper.
+ */
+static int find_ends(struct builder *b)
+{
+    uint32_t *open = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+    for (uint32_t id = 0; id < b->len; ++id) {
+        struct index_entry *e = &b->entries[id];
+        while (depth > 0 && b->entries[open[depth - 1]].depth >= e->depth) {
+            b->entries[open[--depth]].end = id;
+        }
+        e->end = id + 1;
+        if (e->type == DT_DIR) {
+            if (depth == cap) {
+                cap = cap == 0 ? 64 : cap * 2;
+                uint32_t *grown = realloc(open, cap * sizeof(uint32_t));
+                if (grown == NULL) {
+                    free(open);
+                    return -1;
+                }
+                open = grown;
+            }
+            open[depth++] = id;
+        }
+    }
+    while (depth > 0) {
+        b->entries[open[--depth]].end = b->len;
+    }
+    free(open);
+    return 0;
+}
+
+static const char *entry_name(const char *paths, const struct index_entry *e)
+{
+    return paths + e->path_offset + e->path_len - e->name_len;
+}
+
+/**
+ * Builds the trigram table and the encoded posting lists.
+ */
+static int build_postings(struct builder *b)
+{
+    uint32_t trigrams[NAME_MAX];
+    uint32_t *starts = calloc(TRIGRAM_SPACE + 1, sizeof(uint32_t));
+    if (starts == NULL) {
+        return -1;
+    }
+
+    /* Count the names containing each trigram, then turn the counts into the
+     * position of each trigram's first slot. */
+    uint64_t total = 0;
+    for (uint32_t id = 0; id < b->len; ++id) {
+        const struct index_entry *e = &b->entries[id];
+        size_t n = get_trigrams(entry_name(b->paths, e), e->name_len, trigrams);
+        for (size_t i = 0; i < n; ++i) {
+            starts[trigrams[i] + 1]++;
+        }
+        total += n;
+    }
+    if (total > UINT32_MAX) {
+        free(starts);
+        errno = EFBIG;
+        return -1;
+    }
+    uint32_t distinct = 0;
+    for (uint32_t t = 1; t <= TRIGRAM_SPACE; ++t) {
+        distinct += starts[t] != 0;
+        starts[t] += starts[t - 1];
+    }
+
+    uint32_t *ids = malloc((total + 1) * sizeof(uint32_t));
+    struct index_trigram *table = malloc((distinct + 1) * sizeof(struct index_trigram));
+    // every delta fits in five varint bytes
+    uint8_t *postings = malloc(total * 5 + 1);
+    if (ids == NULL || table == NULL || postings == NULL) {
+        free(ids);
+        free(table);
+        free(postings);
+        free(starts);
+        return -1;
+    }
+
+    /* Afterward, starts[t] is where trigram t's slots end. */
+    for (uint32_t id = 0; id < b->len; ++id) {
+        const struct index_entry *e = &b->entries[id];
+        size_t n = get_trigrams(entry_name(b->paths, e), e->name_len, trigrams);
+        for (size_t i = 0; i < n; ++i) {
+            ids[starts[trigrams[i]]++] = id;
+        }
+    }
+
+    uint8_t *p = postings;
+    uint32_t len = 0;
+    for (uint32_t t = 0; t < TRIGRAM_SPACE; ++t) {
+        uint32_t begin = t == 0 ? 0 : starts[t - 1];
+        if (begin == starts[t]) {
+            continue;
+        }
+        struct index_trigram *entry = &table[len++];
+        entry->trigram = t;
+        entry->count = starts[t] - begin;
+        entry->offset = p - postings;
+        uint32_t prev = 0;
+        for (uint32_t i = begin; i < starts[t]; ++i) {
+            p = write_varint(p, ids[i] - prev);
+            prev = ids[i];
+        }
+    }
+    free(ids);
+    free(starts);
+
+    b->table = table;
+    b->table_len = len;
+    b->postings = postings;
+    b->postings_len = p - postings;
+    return 0;
+}
+
+/**
+ * Finds the start (or one past the end) of each character's bucket in the
+ * suffix array.
+ */
+static void get_buckets(const uint32_t *s, size_t n, uint32_t *bkt, size_t k, bool end)
+{
+    memset(bkt, 0, k * sizeof(uint32_t));
+    for (size_t i = 0; i < n; ++i) {
+        bkt[s[i]]++;
+    }
+    uint32_t sum = 0;
+    for (size_t i = 0; i < k; ++i) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+static bool is_lms(const uint8_t *stype, uint32_t i)
+{
+    return i > 0 && i != EMPTY && stype[i] && !stype[i - 1];
+}
+
+/**
+ * Sorts the L-type suffixes from the left, then the S-type suffixes from the
+ * right, starting from the LMS suffixes already placed in 'sa'.
+ */
+static void induce(const uint32_t *s, uint32_t *sa, const uint8_t *stype,
+        uint32_t *bkt, size_t n, size_t k)
+{
+    get_buckets(s, n, bkt, k, false);
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t j = sa[i];
+        if (j != EMPTY && j > 0 && !stype[j - 1]) {
+            sa[bkt[s[j - 1]]++] = j - 1;
+        }
+    }
+    get_buckets(s, n, bkt, k, true);
+    for (size_t i = n; i-- > 0;) {
+        uint32_t j = sa[i];
+        if (j != EMPTY && j > 0 && stype[j - 1]) {
+            sa[--bkt[s[j - 1]]] = j - 1;
+        }
+    }
+}
+
+/**
+ * Computes the suffix array of 's', a string of 'n' characters in [0, k)
+ * whose last character is a unique 0.
+ */
+static int sais(const uint32_t *s, uint32_t *sa, size_t n, size_t k)
+{
+    uint8_t *stype = malloc(n);
+    uint32_t *bkt = malloc(k * sizeof(uint32_t));
+    if (stype == NULL || bkt == NULL) {
+        free(stype);
+        free(bkt);
+        return -1;
+    }
+
+    /* A suffix is S-type if it is smaller than the suffix after it. */
+    stype[n - 1] = 1;
+    for (size_t i = n - 1; i-- > 0;) {
+        stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+    }
+
+    /* Sort the LMS substrings by inducing from their unsorted positions. */
+    get_buckets(s, n, bkt, k, true);
+    for (size_t i = 0; i < n; ++i) {
+        sa[i] = EMPTY;
+    }
+    for (size_t i = 1; i < n; ++i) {
+        if (is_lms(stype, i)) {
+            sa[--bkt[s[i]]] = i;
+        }
+    }
+    induce(s, sa, stype, bkt, n, k);
+
+    /* Name the sorted LMS substrings; equal substrings share a name. The
+     * names are stored at pos / 2, which can't collide because LMS positions
+     * are at least two apart. */
+    size_t n1 = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (is_lms(stype, sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (size_t i = n1; i < n; ++i) {
+        sa[i] = EMPTY;
+    }
+    uint32_t name = 0;
+    uint32_t prev = EMPTY;
+    for (size_t i = 0; i < n1; ++i) {
+        uint32_t pos = sa[i];
+        bool diff = prev == EMPTY;
+        for (size_t d = 0; !diff; ++d) {
+            if (s[pos + d] != s[prev + d] || stype[pos + d] != stype[prev + d]) {
+                diff = true;
+            } else if (d > 0 && (is_lms(stype, pos + d) || is_lms(stype, prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (size_t i = n, j = n; i-- > n1;) {
+        if (sa[i] != EMPTY) {
+            sa[--j] = sa[i];
+        }
+    }
+
+    /* Sort the LMS suffixes: directly if their names are unique, otherwise by
+     * recursing on the string of names. */
+    uint32_t *s1 = sa + n - n1;
+    if (name < n1) {
+        if (sais(s1, sa, n1, name) == -1) {
+            free(stype);
+            free(bkt);
+            return -1;
+        }
+    } else {
+        for (size_t i = 0; i < n1; ++i) {
+            sa[s1[i]] = i;
+        }
+    }
+
+    /* Put the sorted LMS suffixes at the ends of their buckets and induce the
+     * order of everything else from them. */
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        if (is_lms(stype, i)) {
+            s1[j++] = i;
+        }
+    }
+    for (size_t i = 0; i < n1; ++i) {
+        sa[i] = s1[sa[i]];
+    }
+    for (size_t i = n1; i < n; ++i) {
+        sa[i] = EMPTY;
+    }
+    get_buckets(s, n, bkt, k, true);
+    for (size_t i = n1; i-- > 0;) {
+        uint32_t j = sa[i];
+        sa[i] = EMPTY;
+        sa[--bkt[s[j]]] = j;
+    }
+    induce(s, sa, stype, bkt, n, k);
+
+    free(stype);
+    free(bkt);
+    return 0;
+}
+
+/**
+ * Builds the suffix array section: the text of all names, the position of
+ * each name in it, and the sorted suffixes of the text.
+ */
+static int build_suffixes(struct builder *b)
+{
+    uint64_t text_len = 1;
+    for (uint32_t id = 0; id < b->len; ++id) {
+        text_len += b->entries[id].name_len + 1;
+    }
+    if (text_len >= UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    /* SA-IS wants the text as integers followed by a unique, smallest
+     * sentinel, so every byte is shifted up by one. */
+    size_t n = text_len + 1;
+    b->text = malloc(text_len);
+    b->names = malloc((b->len + 1) * sizeof(uint32_t));
+    uint32_t *s = malloc(n * sizeof(uint32_t));
+    b->suffixes = malloc(n * sizeof(uint32_t));
+    if (b->text == NULL || b->names == NULL || s == NULL || b->suffixes == NULL) {
+        free(s);
+        return -1;
+    }
+    size_t pos = 0;
+    for (uint32_t id = 0; id < b->len; ++id) {
+        const struct index_entry *e = &b->entries[id];
+        b->names[id] = pos;
+        b->text[pos++] = '\0';
+        memcpy(b->text + pos, entry_name(b->paths, e), e->name_len);
+        pos += e->name_len;
+    }
+    b->text[pos] = '\0';
+    b->text_len = text_len;
+    for (size_t i = 0; i < text_len; ++i) {
+        s[i] = (unsigned char) b->text[i] + 1;
+    }
+    s[text_len] = 0;
+
+    int rc = sais(s, b->suffixes, n, 257);
+    free(s);
+    return rc;
+}
+
+/**
+ * A table written to the index file. The offset it ends up at is stored in
+ * the header.
+ */
+struct section {
+    const void *data;
+    size_t len;
+    uint64_t *offset;
+};
+
+static int write_index(const char *path, struct index_header *header,
+        const struct section *sections, size_t count)
+{
+    static const char padding[8];
+    uint64_t offset = sizeof(*header);
+    for (size_t i = 0; i < count; ++i) {
+        offset = (offset + 7) & ~(uint64_t) 7;
+        *sections[i].offset = offset;
+        offset += sections[i].len;
+    }
+    header->size = offset;
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+    bool ok = fwrite(header, sizeof(*header), 1, out) == 1;
+    offset = sizeof(*header);
+    for (size_t i = 0; i < count && ok; ++i) {
+        size_t pad = *sections[i].offset - offset;
+        ok = fwrite(padding, 1, pad, out) == pad
+            && fwrite(sections[i].data, 1, sections[i].len, out) == sections[i].len;
+        offset = *sections[i].offset + sections[i].len;
+    }
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, path) == -1) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Searches the tree and merges the workers' runs into the entry table.
+ */
+static int build_table(const char *root, int jobs, struct search_stats *stats,
+        struct builder *out)
+{
+    struct build b = {
+        .root = root,
+        .root_len = strlen(root),
+        .flags = stats != NULL ? SEARCH_TIMING : 0,
+    };
+    pthread_mutex_init(&b.lock, NULL);
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    // the buffers share the memory limit
+    size_t limit = RUN_MEM_LIMIT / jobs;
+    if (limit < 1024 * 1024) {
+        limit = 1024 * 1024;
+    }
+    struct worker *workers = calloc(jobs, sizeof(struct worker));
+    if (workers == NULL) {
+        return -1;
+    }
+    int initialized = 0;
+    int rc = -1;
+    for (; initialized < jobs; ++initialized) {
+        workers[initialized].build = &b;
+        if (run_buffer_init(&workers[initialized].runs, limit) == -1) {
+            break;
+        }
+    }
+
+    if (initialized == jobs && search_shards(&b, workers, jobs) == 0) {
+        // each thread kept its own counters; they are only added up now
+        for (int i = 0; stats != NULL && i < jobs; ++i) {
+            search_stats_merge(stats, &workers[i].stats);
+        }
+        /* Gather every worker's runs for one merge. */
+        size_t count = 0;
+        for (int i = 0; i < jobs; ++i) {
+            count += workers[i].runs.run_count;
+        }
+        FILE **runs = malloc((count + 1) * sizeof(FILE *));
+        if (runs != NULL) {
+            count = 0;
+            for (int i = 0; i < jobs; ++i) {
+                for (size_t j = 0; j < workers[i].runs.run_count; ++j) {
+                    runs[count++] = workers[i].runs.runs[j];
+                }
+            }
+            LOG("Merging %zu runs\n", count);
+            rc = runs_merge(runs, count, add_entry, out);
+            free(runs);
+        }
+    }
+
+    int err = errno;
+    for (int i = 0; i < initialized; ++i) {
+        run_buffer_destroy(&workers[i].runs);
+    }
+    free(workers);
+    for (size_t i = 0; i < b.shard_count; ++i) {
+        free(b.shards[i].rel);
+    }
+    free(b.shards);
+    pthread_mutex_destroy(&b.lock);
+    errno = err;
+    return rc;
+}
+
+int index_build(const char *root, const char *path, enum index_type type, int jobs,
+        struct search_stats *stats)
+{
+    char *resolved = realpath(root, NULL);
+    if (resolved == NULL) {
+        return -1;
+    }
+    struct builder b = {
+        .entries_file = tmpfile(),
+        .paths_file = tmpfile(),
+    };
+
+    int rc = -1;
+    if (b.entries_file != NULL && b.paths_file != NULL
+            && build_table(root, jobs, stats, &b) == 0 && map_tables(&b) == 0
+            && find_ends(&b) == 0
+            && (type == INDEX_TRIGRAMS ? build_postings(&b) : build_suffixes(&b)) == 0) {
+        struct index_header header = {
+            .magic = INDEX_MAGIC,
+            .version = INDEX_VERSION,
+            .type = type,
+            .entry_count = b.len,
+            .root_len = strlen(resolved),
+            .trigram_count = b.table_len,
+            .text_len = b.text_len,
+        };
+        struct section sections[6];
+        size_t count = 0;
+        sections[count++] = (struct section) { b.entries,
+            (size_t) b.len * sizeof(struct index_entry), &header.entries_offset };
+        if (type == INDEX_TRIGRAMS) {
+            sections[count++] = (struct section) { b.table,
+                (size_t) b.table_len * sizeof(struct index_trigram), &header.trigrams_offset };
+            sections[count++] = (struct section) { b.postings, b.postings_len,
+                &header.postings_offset };
+            LOG("Indexed %u entries, %u trigrams (%zu bytes of postings)\n",
+                    b.len, b.table_len, b.postings_len);
+        } else {
+            // the first suffix is the sentinel, which is not part of the text
+            sections[count++] = (struct section) { b.suffixes + 1,
+                b.text_len * sizeof(uint32_t), &header.suffixes_offset };
+            sections[count++] = (struct section) { b.names,
+                (size_t) b.len * sizeof(uint32_t), &header.names_offset };
+            sections[count++] = (struct section) { b.text, b.text_len, &header.text_offset };
+            LOG("Indexed %u entries, %zu suffixes\n", b.len, b.text_len);
+        }
+        sections[count++] = (struct section) { b.paths, b.paths_len, &header.paths_offset };
+        sections[count++] = (struct section) { resolved, header.root_len + 1,
+            &header.root_offset };
+        rc = write_index(path, &header, sections, count);
+    }
+
+    int err = errno;
+    if (b.entries != NULL) {
+        munmap(b.entries, (size_t) b.len * sizeof(struct index_entry));
+        munmap(b.paths, b.paths_len);
+    }
+    if (b.entries_file != NULL) {
+        fclose(b.entries_file);
+    }
+    if (b.paths_file != NULL) {
+        fclose(b.paths_file);
+    }
+    free(b.table);
+    free(b.postings);
+    free(b.text);
+    free(b.names);
+    free(b.suffixes);
+    free(resolved);
+    errno = err;
+    return rc;
+}
+
+/**
+ * Checks that a table lies within the file.
+ */
+static bool in_file(const struct index_header *h, uint64_t offset, uint64_t len)
+{
+    return offset >= sizeof(*h) && offset <= h->size && len <= h->size - offset;
+}
+
+static bool valid_header(const struct index_header *h, size_t size)
+{
+    if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION || h->size != size
+            || !in_file(h, h->entries_offset,
+                (uint64_t) h->entry_count * sizeof(struct index_entry))
+            || !in_file(h, h->paths_offset, 0)
+            || !in_file(h, h->root_offset, (uint64_t) h->root_len + 1)) {
+        return false;
+    }
+    switch (h->type) {
+        case INDEX_TRIGRAMS:
+            return in_file(h, h->trigrams_offset,
+                    (uint64_t) h->trigram_count * sizeof(struct index_trigram))
+                && in_file(h, h->postings_offset, 0);
+        case INDEX_SUFFIX_ARRAY:
+            return in_file(h, h->text_offset, h->text_len)
+                && in_file(h, h->suffixes_offset, h->text_len * sizeof(uint32_t))
+                && in_file(h, h->names_offset,
+                        (uint64_t) h->entry_count * sizeof(uint32_t));
+        default:
+            return false;
+    }
+}
+
+struct index *index_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size < sizeof(struct index_header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct index_header *h = base;
+    if (!valid_header(h, st.st_size)) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct index *idx = malloc(sizeof(struct index));
+    if (idx == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    idx->base = base;
+    idx->size = st.st_size;
+    idx->header = h;
+    idx->entries = (const void *) (idx->base + h->entries_offset);
+    idx->trigrams = (const void *) (idx->base + h->trigrams_offset);
+    idx->postings = idx->base + h->postings_offset;
+    idx->text = (const char *) idx->base + h->text_offset;
+    idx->suffixes = (const void *) (idx->base + h->suffixes_offset);
+    idx->names = (const void *) (idx->base + h->names_offset);
+    idx->paths = (const char *) idx->base + h->paths_offset;
+    idx->root = (const char *) idx->base + h->root_offset;
+    return idx;
+}
+
+void index_close(struct index *idx)
+{
+    if (idx == NULL) {
+        return;
+    }
+    munmap((void *) idx->base, idx->size);
+    free(idx);
+}
+
+/**
+ * Finds the entries beneath 'rel' (a path relative to the indexed root).
+ *
+ * @return 0 with the range in [*lo, *hi), or -1 if 'rel' is not a directory
+ * in the index.
+ */
+static int find_subtree(const struct index *idx, const char *rel,
+        uint32_t *lo, uint32_t *hi, int *depth)
+{
+    *lo = 0;
+    *hi = idx->header->entry_count;
+    *depth = 0;
+    while (*rel != '\0') {
+        const char *slash = strchr(rel, '/');
+        size_t len = slash == NULL ? strlen(rel) : (size_t) (slash - rel);
+        uint32_t id = *lo;
+        // siblings are found by skipping over each directory's descendants
+        while (id < *hi) {
+            const struct index_entry *e = &idx->entries[id];
+            if (e->name_len == len && memcmp(entry_name(idx->paths, e), rel, len) == 0) {
+                break;
+            }
+            id = e->end;
+        }
+        if (id >= *hi || idx->entries[id].type != DT_DIR) {
+            return -1;
+        }
+        *lo = id + 1;
+        *hi = idx->entries[id].end;
+        (*depth)++;
+        rel += len;
+        while (*rel == '/') {
+            rel++;
+        }
+    }
+    return 0;
+}
+
+static int compare_trigram(const void *key, const void *elem)
+{
+    uint32_t t = *(const uint32_t *) key;
+    const struct index_trigram *entry = elem;
+    return t < entry->trigram ? -1 : t > entry->trigram;
+}
+
+static int compare_count(const void *a, const void *b)
+{
+    const struct index_trigram *ta = *(const struct index_trigram * const *) a;
+    const struct index_trigram *tb = *(const struct index_trigram * const *) b;
+    return ta->count < tb->count ? -1 : ta->count > tb->count;
+}
+
+/**
+ * Keeps the candidates that also appear in a posting list.
+ *
+ * @return the number of candidates left.
+ */
+static size_t intersect(const uint8_t *p, uint32_t count, uint32_t *cand, size_t n)
+{
+    size_t out = 0;
+    size_t j = 0;
+    uint32_t id = 0;
+    for (uint32_t k = 0; k < count && j < n; ++k) {
+        uint32_t delta;
+        p = read_varint(p, &delta);
+        id += delta;
+        while (j < n && cand[j] < id) {
+            j++;
+        }
+        if (j < n && cand[j] == id) {
+            cand[out++] = cand[j++];
+        }
+    }
+    return out;
+}
+
+/**
+ * Finds the entries in [lo, hi) whose names contain every trigram of the
+ * pattern.
+ *
+ * @return the number of candidates stored in 'cand' (malloc()ed), or -1 on
+ * error.
+ */
+static ssize_t find_candidates(const struct index *idx, const char *pattern,
+        uint32_t lo, uint32_t hi, uint32_t **cand)
+{
+    size_t len = strlen(pattern);
+    uint32_t *trigrams = malloc(len * sizeof(uint32_t));
+    const struct index_trigram **lists = malloc(len * sizeof(*lists));
+    if (trigrams == NULL || lists == NULL) {
+        free(trigrams);
+        free(lists);
+        return -1;
+    }
+
+    /* A trigram no name contains means nothing can match. */
+    size_t n = get_trigrams(pattern, len, trigrams);
+    for (size_t i = 0; i < n; ++i) {
+        lists[i] = bsearch(&trigrams[i], idx->trigrams, idx->header->trigram_count,
+                sizeof(struct index_trigram), compare_trigram);
+        if (lists[i] == NULL) {
+            free(trigrams);
+            free(lists);
+            *cand = NULL;
+            return 0;
+        }
+    }
+    // start from the rarest trigram so the candidate set is small from the start
+    qsort(lists, n, sizeof(*lists), compare_count);
+
+    size_t count = 0;
+    *cand = malloc((lists[0]->count + 1) * sizeof(uint32_t));
+    if (*cand != NULL) {
+        const uint8_t *p = idx->postings + lists[0]->offset;
+        uint32_t id = 0;
+        for (uint32_t k = 0; k < lists[0]->count; ++k) {
+            uint32_t delta;
+            p = read_varint(p, &delta);
+            id += delta;
+            if (id >= hi) {
+                break;
+            }
+            if (id >= lo) {
+                (*cand)[count++] = id;
+            }
+        }
+        for (size_t i = 1; i < n && count > 0; ++i) {
+            count = intersect(idx->postings + lists[i]->offset, lists[i]->count,
+                    *cand, count);
+        }
+    }
+    free(trigrams);
+    free(lists);
+    return *cand == NULL ? -1 : (ssize_t) count;
+}
+
+/**
+ * Compares a suffix of the text with a key, treating a suffix that starts with
+ * the key as equal to it.
+ */
+static int compare_suffix(const struct index *idx, uint32_t pos, const char *key,
+        size_t len)
+{
+    size_t avail = idx->header->text_len - pos;
+    int cmp = memcmp(idx->text + pos, key, avail < len ? avail : len);
+    return cmp == 0 && avail < len ? -1 : cmp;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint32_t ia = *(const uint32_t *) a;
+    uint32_t ib = *(const uint32_t *) b;
+    return ia < ib ? -1 : ia > ib;
+}
+
+/**
+ * Finds the entries in [lo, hi) whose names contain the pattern, using the
+ * suffix array. When only files are wanted and they must match exactly, the
+ * search is for the whole name, separators included.
+ *
+ * @return the number of entries stored in 'cand' (malloc()ed), or -1 on
+ * error.
+ */
+static ssize_t find_suffixes(const struct index *idx, const struct search_opts *opts,
+        uint32_t lo, uint32_t hi, uint32_t **cand)
+{
+    size_t len = strlen(opts->pattern);
+    char *key = malloc(len + 2);
+    if (key == NULL) {
+        return -1;
+    }
+    size_t key_len = len;
+    if (opts->exact_match && !opts->show_dirs) {
+        key[0] = '\0';
+        memcpy(key + 1, opts->pattern, len);
+        key[len + 1] = '\0';
+        key_len = len + 2;
+    } else {
+        memcpy(key, opts->pattern, len);
+    }
+
+    /* The suffixes starting with the key are contiguous: find where they
+     * begin and end. */
+    size_t n = idx->header->text_len;
+    size_t first = 0;
+    size_t last = n;
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        if (compare_suffix(idx, idx->suffixes[mid], key, key_len) < 0) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    last = n;
+    size_t end = first;
+    while (end < last) {
+        size_t mid = end + (last - end) / 2;
+        if (compare_suffix(idx, idx->suffixes[mid], key, key_len) <= 0) {
+            end = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    free(key);
+
+    /* Mapping an occurrence to its entry is a binary search, so when the
+     * pattern is common it is cheaper to check every entry in the range. */
+    size_t range = hi - lo;
+    bool dense = (end - first) * 4 > range;
+    *cand = malloc(((dense ? range : end - first) + 1) * sizeof(uint32_t));
+    if (*cand == NULL) {
+        return -1;
+    }
+    if (dense) {
+        for (size_t i = 0; i < range; ++i) {
+            (*cand)[i] = lo + i;
+        }
+        return range;
+    }
+
+    /* Map each occurrence to the entry whose name it is in. A name can contain
+     * the pattern more than once, so the entries are sorted and deduplicated. */
+    size_t count = 0;
+    for (size_t i = first; i < end; ++i) {
+        uint32_t pos = idx->suffixes[i];
+        size_t l = 0;
+        size_t r = idx->header->entry_count;
+        while (l < r) {
+            size_t mid = l + (r - l) / 2;
+            if (idx->names[mid] <= pos) {
+                l = mid + 1;
+            } else {
+                r = mid;
+            }
+        }
+        uint32_t id = l - 1;
+        if (id >= lo && id < hi) {
+            (*cand)[count++] = id;
+        }
+    }
+    qsort(*cand, count, sizeof(uint32_t), compare_ids);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (unique == 0 || (*cand)[unique - 1] != (*cand)[i]) {
+            (*cand)[unique++] = (*cand)[i];
+        }
+    }
+    return unique;
+}
+
+/**
+ * Applies the same filters as the search library to an entry.
+ */
+static bool entry_matches(const char *name, unsigned char type, int depth,
+        const struct search_opts *opts)
+{
+    return (opts->max_depth < 0 || depth < opts->max_depth)
+        && search_match(opts, name, type);
+}
+
+/**
+ * Matches waiting to be delivered to the caller's callback. Paths are rebuilt
+ * with the caller's spelling of the root, exactly as the search library would
+ * have reported them.
+ */
+struct batch {
+    search_callback callback;
+    void *ctx;
+    const char *root;
+    size_t root_len;
+    struct search_entry entries[SEARCH_BATCH_SIZE];
+    size_t count;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    int rc;
+};
+
+static void batch_flush(struct batch *batch)
+{
+    if (batch->count > 0 && batch->rc == 0) {
+        batch->rc = batch->callback(batch->ctx, batch->entries, batch->count);
+    }
+    batch->count = 0;
+    batch->arena_len = 0;
+}
+
+static void batch_add(struct batch *batch, const char *rel, size_t rel_len,
+        size_t name_len, unsigned char type, int depth)
+{
+    if (batch->count == SEARCH_BATCH_SIZE
+            || batch->arena_len + batch->root_len + rel_len + 2 > batch->arena_cap) {
+        batch_flush(batch);
+    }
+    char *path = batch->arena + batch->arena_len;
+    memcpy(path, batch->root, batch->root_len);
+    path[batch->root_len] = '/';
+    memcpy(path + batch->root_len + 1, rel, rel_len + 1);
+    size_t path_len = batch->root_len + 1 + rel_len;
+    batch->arena_len += path_len + 1;
+
+    struct search_entry *entry = &batch->entries[batch->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = path;
+    entry->path_len = path_len;
+    entry->name = path + path_len - name_len;
+    entry->name_len = name_len;
+    entry->type = type;
+    entry->depth = depth;
+}
+
+static void deliver(const struct index *idx, uint32_t id, size_t skip, int base_depth,
+        const struct search_opts *opts, struct batch *batch)
+{
+    const struct index_entry *e = &idx->entries[id];
+    int depth = e->depth - base_depth;
+    if (entry_matches(entry_name(idx->paths, e), e->type, depth, opts)) {
+        batch_add(batch, idx->paths + e->path_offset + skip, e->path_len - skip,
+                e->name_len, e->type, depth);
+    }
+}
+
+int index_query(const struct index *idx, const char *root,
+        const struct search_opts *opts, search_callback callback, void *ctx)
+{
+    char *resolved = realpath(root, NULL);
+    if (resolved == NULL) {
+        return -1;
+    }
+    size_t root_len = idx->header->root_len;
+    const char *rel = NULL;
+    if (strcmp(resolved, idx->root) == 0) {
+        rel = "";
+    } else if (strncmp(resolved, idx->root, root_len) == 0
+            && (resolved[root_len] == '/' || root_len == 1)) {
+        rel = resolved + root_len + (root_len != 1);
+    }
+
+    uint32_t lo, hi;
+    int base_depth;
+    if (rel == NULL || find_subtree(idx, rel, &lo, &hi, &base_depth) == -1) {
+        free(resolved);
+        return -1;
+    }
+    // entries beneath a subdirectory drop its path and the slash that follows
+    size_t skip = rel[0] == '\0' ? 0 : strlen(rel) + 1;
+    free(resolved);
+
+    struct batch batch = {
+        .callback = callback,
+        .ctx = ctx,
+        .root = root,
+        .root_len = strlen(root),
+        .arena_cap = 64 * 1024 + PATH_MAX * 2,
+    };
+    batch.arena = malloc(batch.arena_cap);
+    if (batch.arena == NULL) {
+        return -1;
+    }
+
+    /* Without a pattern (or, for trigrams, with one shorter than a trigram)
+     * every entry in the range is a candidate. Names are indexed as they are
+     * spelled, so the same goes for a pattern matched without case. */
+    const char *pattern = opts->pattern == NULL ? "" : opts->pattern;
+    struct search_opts filter = *opts;
+    filter.pattern = pattern;
+    size_t min_len = idx->header->type == INDEX_TRIGRAMS ? 3 : 1;
+    if (strlen(pattern) < min_len || opts->ignore_case || opts->unicode_fold) {
+        for (uint32_t id = lo; id < hi && batch.rc == 0; ++id) {
+            deliver(idx, id, skip, base_depth, &filter, &batch);
+        }
+    } else {
+        uint32_t *cand;
+        ssize_t count = idx->header->type == INDEX_TRIGRAMS
+            ? find_candidates(idx, pattern, lo, hi, &cand)
+            : find_suffixes(idx, &filter, lo, hi, &cand);
+        if (count == -1) {
+            free(batch.arena);
+            return -1;
+        }
+        for (ssize_t i = 0; i < count && batch.rc == 0; ++i) {
+            deliver(idx, cand[i], skip, base_depth, &filter, &batch);
+        }
+        free(cand);
+    }
+    batch_flush(&batch);
+    free(batch.arena);
+    return 0;
+}
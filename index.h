@@ -0,0 +1,127 @@
+/**
+ * @file index.h
+ *
+ * Persistent file name index. An index file holds every entry beneath a root
+ * directory, in depth-first order with the entries of each directory sorted
+ * by name, plus one of two structures over the entry names that answer
+ * substring queries without looking at every name:
+ *
+ * - A trigram index maps each three-byte sequence to the entries whose names
+ *   contain it. Queries intersect the lists of the pattern's trigrams and
+ *   check the few entries that survive. Patterns shorter than three bytes
+ *   fall back to checking every entry.
+ * - A suffix array sorts every suffix of the concatenated names. Queries
+ *   binary search for the suffixes that start with the pattern, which finds
+ *   exactly the matching names for patterns of any length. Very common
+ *   patterns fall back to checking every entry.
+ *
+ * The file is written once and then mapped read-only by queries. It is a
+ * snapshot: changes made to the tree after the index was built are not seen.
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "search.h"
+
+#define INDEX_MAGIC 0x58444e49 // "INDX"
+#define INDEX_VERSION 2
+
+enum index_type {
+    INDEX_TRIGRAMS,
+    INDEX_SUFFIX_ARRAY,
+};
+
+/**
+ * The file starts with a header. All offsets are in bytes from the start of
+ * the file, and the tables they point to are 8-byte aligned.
+ */
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type;             // enum index_type
+    uint32_t entry_count;
+    uint64_t entries_offset;   // struct index_entry[entry_count]
+    uint64_t paths_offset;     // NUL-terminated paths, relative to the root
+    uint64_t root_offset;      // absolute path of the indexed root
+    uint32_t root_len;
+
+    /* INDEX_TRIGRAMS */
+    uint32_t trigram_count;
+    uint64_t trigrams_offset;  // struct index_trigram[trigram_count]
+    uint64_t postings_offset;  // delta-varint encoded entry numbers
+
+    /* INDEX_SUFFIX_ARRAY */
+    uint64_t text_offset;      // "\0name\0name...\0": every name, in entry order
+    uint64_t text_len;
+    uint64_t suffixes_offset;  // uint32_t[text_len]: sorted suffixes of the text
+    uint64_t names_offset;     // uint32_t[entry_count]: the separator before each name
+
+    uint64_t size;             // size of the whole file
+};
+
+/**
+ * An entry, numbered by its position in the table. A directory's descendants
+ * are the entries that follow it, up to (but not including) entry 'end'.
+ */
+struct index_entry {
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t name_len;
+    uint32_t end;
+    int32_t depth;             // 0 for entries in the root directory
+    uint8_t type;              // DT_REG or DT_DIR
+    uint8_t reserved[7];
+};
+
+/**
+ * Posting list of a trigram: the numbers of the 'count' entries whose names
+ * contain it, in ascending order. Each number is stored as a LEB128 varint of
+ * its difference from the previous one. The table is sorted by trigram.
+ */
+struct index_trigram {
+    uint32_t trigram;          // three name bytes, first byte most significant
+    uint32_t count;
+    uint64_t offset;           // from postings_offset
+};
+
+struct index;
+
+/**
+ * Indexes everything beneath 'root' (including hidden files) and writes an
+ * index of the given type to 'path'. The tree is searched on 'jobs' threads.
+ * The file is replaced atomically. If 'stats' is not NULL, the counters and
+ * SEARCH_TIMING histograms of every thread's searches are added to it.
+ *
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int index_build(const char *root, const char *path, enum index_type type, int jobs,
+        struct search_stats *stats);
+
+/**
+ * Opens an index file for querying.
+ *
+ * @return the index, or NULL on error (errno is set; EINVAL if the file is not
+ * a valid index).
+ */
+struct index *index_open(const char *path);
+
+/**
+ * Searches 'root' using the index, delivering matches to 'callback' in batches
+ * just like search_run(). Entries carry paths, names, types and depths.
+ *
+ * @return 0 if the index answered the query, or -1 if 'root' is not a
+ * directory in the index (the caller should search directly instead).
+ */
+int index_query(const struct index *idx, const char *root,
+        const struct search_opts *opts, search_callback callback, void *ctx);
+
+/**
+ * Closes an index.
+ */
+void index_close(struct index *idx);
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * @file index_bench.c
+ *
+ * Query benchmark for index files. For each pattern, times a query answered
+ * through the index's trigrams or suffix array against a linear scan of every
+ * name in the same (already mapped) index, and checks that both find the same
+ * number of matches.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "index.h"
+
+static int count_batch(void *ctx, const struct search_entry *entries, size_t count)
+{
+    uint64_t *total = ctx;
+    (void) entries;
+    *total += count;
+    return 0;
+}
+
+/**
+ * Counts the names containing 'pattern' by looking at every entry, with the
+ * same filters as a default search (hidden files are skipped).
+ */
+static uint64_t linear_scan(const uint8_t *base, const char *pattern)
+{
+    const struct index_header *h = (const void *) base;
+    const struct index_entry *entries = (const void *) (base + h->entries_offset);
+    const char *paths = (const char *) base + h->paths_offset;
+    uint64_t total = 0;
+    for (uint32_t id = 0; id < h->entry_count; ++id) {
+        const struct index_entry *e = &entries[id];
+        const char *name = paths + e->path_offset + e->path_len - e->name_len;
+        if (strstr(name, pattern) != NULL && (e->type == DT_DIR || name[0] != '.')) {
+            total++;
+        }
+    }
+    return total;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-n rounds] index-file pattern...\n", prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = 100;
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 1 >= argc || rounds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+
+    struct index *idx = index_open(path);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (idx == NULL || fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return 1;
+    }
+    const uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const struct index_header *h = (const void *) base;
+    const char *root = (const char *) base + h->root_offset;
+
+    printf("%u entries, %s index\n", h->entry_count,
+            h->type == INDEX_TRIGRAMS ? "trigram" : "suffix array");
+    printf("pattern\tmatches\tindex-us\tscan-us\tspeedup\n");
+
+    int failed = 0;
+    for (int i = optind + 1; i < argc; ++i) {
+        struct search_opts opts;
+        search_opts_init(&opts);
+        opts.pattern = argv[i];
+
+        uint64_t found = 0;
+        double start = now();
+        for (int r = 0; r < rounds; ++r) {
+            found = 0;
+            if (index_query(idx, root, &opts, count_batch, &found) == -1) {
+                perror("index_query");
+                return 1;
+            }
+        }
+        double indexed = (now() - start) / rounds;
+
+        uint64_t scanned = 0;
+        start = now();
+        for (int r = 0; r < rounds; ++r) {
+            scanned = linear_scan(base, argv[i]);
+        }
+        double linear = (now() - start) / rounds;
+
+        printf("%s\t%llu\t%.1f\t%.1f\t%.1fx\n", argv[i], (unsigned long long) found,
+                indexed * 1e6, linear * 1e6, linear / indexed);
+        if (found != scanned) {
+            fprintf(stderr, "'%s': index found %llu matches, scan found %llu\n",
+                    argv[i], (unsigned long long) found, (unsigned long long) scanned);
+            failed = 1;
+        }
+    }
+    munmap((void *) base, st.st_size);
+    index_close(idx);
+    return failed;
+}
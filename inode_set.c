@@ -0,0 +1,376 @@
+/**
+ * @file inode_set.c
+ *
+ * Implementation of the (device, inode) set declared in inode_set.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "inode_set.h"
+#include "logger.h"
+
+/* Inode 0 is never handed out by Linux file systems, so it marks free slots. */
+struct inode_key {
+    uint64_t dev;
+    uint64_t ino;
+};
+
+/**
+ * Every FENCE_STRIDE-th key of a run is kept in memory, so a lookup reads a
+ * single block of the run (4 KiB) instead of binary searching the file.
+ */
+#define FENCE_STRIDE 256
+
+/**
+ * Bloom filter bits per key of a run, and bits checked per lookup: about 2%
+ * of the lookups of a key that isn't in the run read the disk at all.
+ */
+#define BLOOM_BITS_PER_KEY 8
+#define BLOOM_PROBES 5
+
+/**
+ * Each run is more than twice as long as the next newer one (see spill()), so
+ * there can't be more runs than this.
+ */
+#define MAX_RUNS 64
+
+/* A sorted file of keys spilled from the table. */
+struct run {
+    FILE *file;
+    size_t len;
+    struct inode_key *fences;   // every FENCE_STRIDE-th key
+    uint64_t *bloom;
+    uint64_t bloom_mask;        // bits in the filter, minus one
+};
+
+struct inode_set {
+    struct inode_key *slots;
+    size_t capacity;   // always a power of two
+    size_t count;      // keys currently in the table
+    size_t total;      // keys in the table plus keys in the runs
+    size_t mem_limit;
+    struct run runs[MAX_RUNS]; // oldest (and longest) first
+    size_t run_count;
+};
+
+static uint64_t hash_key(uint64_t dev, uint64_t ino)
+{
+    /* splitmix64 finalizer over both halves of the key */
+    uint64_t x = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    const struct inode_key *ka = a;
+    const struct inode_key *kb = b;
+    if (ka->dev != kb->dev) {
+        return ka->dev < kb->dev ? -1 : 1;
+    }
+    if (ka->ino != kb->ino) {
+        return ka->ino < kb->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Finds the slot that holds the key, or the free slot where it would go.
+ */
+static struct inode_key *probe(struct inode_key *slots, size_t capacity,
+        uint64_t dev, uint64_t ino)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash_key(dev, ino) & mask;
+    while (slots[i].ino != 0) {
+        if (slots[i].ino == ino && slots[i].dev == dev) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static int grow(struct inode_set *set)
+{
+    size_t new_cap = set->capacity * 2;
+    struct inode_key *slots = calloc(new_cap, sizeof(struct inode_key));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < set->capacity; ++i) {
+        if (set->slots[i].ino != 0) {
+            *probe(slots, new_cap, set->slots[i].dev, set->slots[i].ino)
+                = set->slots[i];
+        }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = new_cap;
+    return 0;
+}
+
+/**
+ * Prepares an empty run that will hold 'len' keys.
+ */
+static int run_open(struct run *run, size_t len)
+{
+    uint64_t bits = 64;
+    while (bits < (uint64_t) len * BLOOM_BITS_PER_KEY) {
+        bits *= 2;
+    }
+    run->file = tmpfile();
+    run->len = 0;
+    run->fences = malloc((len / FENCE_STRIDE + 1) * sizeof(struct inode_key));
+    run->bloom = calloc(bits / 64, sizeof(uint64_t));
+    run->bloom_mask = bits - 1;
+    return run->file == NULL || run->fences == NULL || run->bloom == NULL ? -1 : 0;
+}
+
+static void run_free(struct run *run)
+{
+    if (run->file != NULL) {
+        fclose(run->file);
+    }
+    free(run->fences);
+    free(run->bloom);
+    memset(run, 0, sizeof(*run));
+}
+
+/**
+ * Yields the filter bits of a key, from two halves of its hash.
+ */
+static uint64_t bloom_bit(uint64_t hash, int probe, uint64_t mask)
+{
+    return (hash + probe * ((hash >> 32) | (hash << 32) | 1)) & mask;
+}
+
+/**
+ * Appends a key to a run; keys must come in sorted order.
+ */
+static int run_add(struct run *run, const struct inode_key *key)
+{
+    if (run->len % FENCE_STRIDE == 0) {
+        run->fences[run->len / FENCE_STRIDE] = *key;
+    }
+    uint64_t hash = hash_key(key->dev, key->ino);
+    for (int i = 0; i < BLOOM_PROBES; ++i) {
+        uint64_t bit = bloom_bit(hash, i, run->bloom_mask);
+        run->bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+    if (fwrite(key, sizeof(*key), 1, run->file) != 1) {
+        return -1;
+    }
+    run->len++;
+    return 0;
+}
+
+/**
+ * Merges two runs into a new one.
+ */
+static int merge_runs(struct run *a, struct run *b, struct run *out)
+{
+    if (run_open(out, a->len + b->len) == -1) {
+        return -1;
+    }
+    rewind(a->file);
+    rewind(b->file);
+    struct inode_key ka, kb;
+    bool have_a = fread(&ka, sizeof(ka), 1, a->file) == 1;
+    bool have_b = fread(&kb, sizeof(kb), 1, b->file) == 1;
+    while (have_a || have_b) {
+        int rc;
+        if (!have_b || (have_a && compare_keys(&ka, &kb) < 0)) {
+            rc = run_add(out, &ka);
+            have_a = fread(&ka, sizeof(ka), 1, a->file) == 1;
+        } else {
+            rc = run_add(out, &kb);
+            have_b = fread(&kb, sizeof(kb), 1, b->file) == 1;
+        }
+        if (rc == -1) {
+            return -1;
+        }
+    }
+    return fflush(out->file) == 0 && out->len == a->len + b->len ? 0 : -1;
+}
+
+/**
+ * Sorts the keys in the table into a new run. The table is empty afterward.
+ *
+ * Runs are then merged while the newest is at least half as long as the one
+ * before it, so each run is more than twice as long as the next: there are
+ * O(log n) of them, and every key is rewritten O(log n) times in all rather
+ * than on every spill.
+ */
+static int spill(struct inode_set *set)
+{
+    /* Compact the occupied slots to the front of the table and sort them. */
+    size_t n = 0;
+    for (size_t i = 0; i < set->capacity; ++i) {
+        if (set->slots[i].ino != 0) {
+            set->slots[n++] = set->slots[i];
+        }
+    }
+    qsort(set->slots, n, sizeof(struct inode_key), compare_keys);
+
+    struct run *run = &set->runs[set->run_count];
+    if (run_open(run, n) == -1) {
+        run_free(run);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (run_add(run, &set->slots[i]) == -1) {
+            run_free(run);
+            return -1;
+        }
+    }
+    if (fflush(run->file) != 0) {
+        run_free(run);
+        return -1;
+    }
+    set->run_count++;
+    set->count = 0;
+    memset(set->slots, 0, set->capacity * sizeof(struct inode_key));
+
+    while (set->run_count >= 2) {
+        struct run *older = &set->runs[set->run_count - 2];
+        struct run *newer = &set->runs[set->run_count - 1];
+        if (older->len > 2 * newer->len) {
+            break;
+        }
+        struct run merged;
+        if (merge_runs(older, newer, &merged) == -1) {
+            run_free(&merged);
+            return -1;
+        }
+        run_free(older);
+        run_free(newer);
+        *older = merged;
+        set->run_count--;
+    }
+    LOG("Spilled inode set: %zu keys on disk in %zu runs\n",
+            set->total - set->count, set->run_count);
+    return 0;
+}
+
+static int run_contains(const struct run *run, const struct inode_key *key)
+{
+    uint64_t hash = hash_key(key->dev, key->ino);
+    for (int i = 0; i < BLOOM_PROBES; ++i) {
+        uint64_t bit = bloom_bit(hash, i, run->bloom_mask);
+        if (!(run->bloom[bit / 64] & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+
+    /* Find the last block that starts at or before the key. */
+    size_t lo = 0;
+    size_t hi = (run->len + FENCE_STRIDE - 1) / FENCE_STRIDE;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_keys(&run->fences[mid], key) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    size_t start = (lo - 1) * FENCE_STRIDE;
+    size_t n = run->len - start < FENCE_STRIDE ? run->len - start : FENCE_STRIDE;
+    struct inode_key block[FENCE_STRIDE];
+    ssize_t size = n * sizeof(struct inode_key);
+    if (pread(fileno(run->file), block, size, start * sizeof(struct inode_key)) != size) {
+        return -1;
+    }
+    return bsearch(key, block, n, sizeof(struct inode_key), compare_keys) != NULL;
+}
+
+struct inode_set *inode_set_create(size_t expected, size_t mem_limit)
+{
+    struct inode_set *set = calloc(1, sizeof(struct inode_set));
+    if (set == NULL) {
+        return NULL;
+    }
+
+    /* Keep the table at most half full, but within the memory limit. */
+    size_t capacity = 64;
+    while (capacity < expected * 2
+            && capacity * 2 * sizeof(struct inode_key) <= mem_limit) {
+        capacity *= 2;
+    }
+
+    set->slots = calloc(capacity, sizeof(struct inode_key));
+    if (set->slots == NULL) {
+        free(set);
+        return NULL;
+    }
+    set->capacity = capacity;
+    set->mem_limit = mem_limit;
+    return set;
+}
+
+int inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    if (ino == 0) {
+        return 1;
+    }
+
+    struct inode_key *slot = probe(set->slots, set->capacity, dev, ino);
+    if (slot->ino != 0) {
+        return 0;
+    }
+
+    struct inode_key key = { dev, ino };
+    for (size_t i = 0; i < set->run_count; ++i) {
+        int found = run_contains(&set->runs[i], &key);
+        if (found != 0) {
+            return found == 1 ? 0 : -1;
+        }
+    }
+
+    if ((set->count + 1) * 2 > set->capacity) {
+        int rc;
+        if (set->capacity * 2 * sizeof(struct inode_key) <= set->mem_limit) {
+            rc = grow(set);
+        } else {
+            rc = spill(set);
+        }
+        if (rc == -1) {
+            return -1;
+        }
+        slot = probe(set->slots, set->capacity, dev, ino);
+    }
+
+    *slot = key;
+    set->count++;
+    set->total++;
+    return 1;
+}
+
+size_t inode_set_size(const struct inode_set *set)
+{
+    return set->total;
+}
+
+void inode_set_destroy(struct inode_set *set)
+{
+    if (set == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < set->run_count; ++i) {
+        run_free(&set->runs[i]);
+    }
+    free(set->slots);
+    free(set);
+}
@@ -0,0 +1,54 @@
+/**
+ * @file inode_set.h
+ *
+ * A set of (device, inode) pairs used to report hard-linked files only once.
+ * The set lives in an open-addressing hash table until it reaches its memory
+ * limit; after that, the table is sorted into a run file on disk each time it
+ * fills up, and runs of similar length are merged. Each run keeps a Bloom
+ * filter and every 256th key in memory (1 to 2 bytes per key on disk), so
+ * most lookups of new keys never read a run, and the rest read one block.
+ */
+
+#ifndef _INODE_SET_H_
+#define _INODE_SET_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Default number of bytes the in-memory table may use before spilling to disk.
+ * Can be overridden at compile time, e.g., -DINODE_SET_MEM_LIMIT=4096.
+ */
+#ifndef INODE_SET_MEM_LIMIT
+#define INODE_SET_MEM_LIMIT (64 * 1024 * 1024)
+#endif
+
+struct inode_set;
+
+/**
+ * Creates a new set sized for roughly 'expected' entries. The table never uses
+ * more than 'mem_limit' bytes; once full, it spills to temporary files.
+ *
+ * @return the new set, or NULL on allocation failure.
+ */
+struct inode_set *inode_set_create(size_t expected, size_t mem_limit);
+
+/**
+ * Inserts a (dev, ino) pair into the set.
+ *
+ * @return 1 if the pair was not present before, 0 if it was already in the
+ * set, or -1 on error (errno is set).
+ */
+int inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino);
+
+/**
+ * Retrieves the number of distinct pairs inserted so far.
+ */
+size_t inode_set_size(const struct inode_set *set);
+
+/**
+ * Frees the set and removes its spill files, if any.
+ */
+void inode_set_destroy(struct inode_set *set);
+
+#endif
@@ -0,0 +1,443 @@
+/**
+ * @file match.c
+ *
+ * Implementation of the case-insensitive matching declared in match.h.
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "match.h"
+
+/**
+ * Stands in for a byte that isn't part of valid UTF-8. Adding the byte to a
+ * value past the last code point keeps it from matching any real character.
+ */
+#define INVALID_BYTE 0x110000
+
+/**
+ * Code points first..last fold to themselves plus 'delta'. With a stride of
+ * 2, only every other code point (starting at 'first') folds; the ones in
+ * between are already lowercase.
+ */
+struct fold_range {
+    uint32_t first;
+    uint32_t last;
+    int32_t delta;
+    uint8_t stride;
+};
+
+/* Simple case folding (one code point to one) outside ASCII, from the
+ * Unicode 14.0 Character Database */
+static const struct fold_range fold_ranges[] = {
+    { 0x000B5, 0x000B5,    775, 1 },
+    { 0x000C0, 0x000D6,     32, 1 },
+    { 0x000D8, 0x000DE,     32, 1 },
+    { 0x00100, 0x0012E,      1, 2 },
+    { 0x00132, 0x00136,      1, 2 },
+    { 0x00139, 0x00147,      1, 2 },
+    { 0x0014A, 0x00176,      1, 2 },
+    { 0x00178, 0x00178,   -121, 1 },
+    { 0x00179, 0x0017D,      1, 2 },
+    { 0x0017F, 0x0017F,   -268, 1 },
+    { 0x00181, 0x00181,    210, 1 },
+    { 0x00182, 0x00184,      1, 2 },
+    { 0x00186, 0x00186,    206, 1 },
+    { 0x00187, 0x00187,      1, 1 },
+    { 0x00189, 0x0018A,    205, 1 },
+    { 0x0018B, 0x0018B,      1, 1 },
+    { 0x0018E, 0x0018E,     79, 1 },
+    { 0x0018F, 0x0018F,    202, 1 },
+    { 0x00190, 0x00190,    203, 1 },
+    { 0x00191, 0x00191,      1, 1 },
+    { 0x00193, 0x00193,    205, 1 },
+    { 0x00194, 0x00194,    207, 1 },
+    { 0x00196, 0x00196,    211, 1 },
+    { 0x00197, 0x00197,    209, 1 },
+    { 0x00198, 0x00198,      1, 1 },
+    { 0x0019C, 0x0019C,    211, 1 },
+    { 0x0019D, 0x0019D,    213, 1 },
+    { 0x0019F, 0x0019F,    214, 1 },
+    { 0x001A0, 0x001A4,      1, 2 },
+    { 0x001A6, 0x001A6,    218, 1 },
+    { 0x001A7, 0x001A7,      1, 1 },
+    { 0x001A9, 0x001A9,    218, 1 },
+    { 0x001AC, 0x001AC,      1, 1 },
+    { 0x001AE, 0x001AE,    218, 1 },
+    { 0x001AF, 0x001AF,      1, 1 },
+    { 0x001B1, 0x001B2,    217, 1 },
+    { 0x001B3, 0x001B5,      1, 2 },
+    { 0x001B7, 0x001B7,    219, 1 },
+    { 0x001B8, 0x001B8,      1, 1 },
+    { 0x001BC, 0x001BC,      1, 1 },
+    { 0x001C4, 0x001C4,      2, 1 },
+    { 0x001C5, 0x001C5,      1, 1 },
+    { 0x001C7, 0x001C7,      2, 1 },
+    { 0x001C8, 0x001C8,      1, 1 },
+    { 0x001CA, 0x001CA,      2, 1 },
+    { 0x001CB, 0x001DB,      1, 2 },
+    { 0x001DE, 0x001EE,      1, 2 },
+    { 0x001F1, 0x001F1,      2, 1 },
+    { 0x001F2, 0x001F4,      1, 2 },
+    { 0x001F6, 0x001F6,    -97, 1 },
+    { 0x001F7, 0x001F7,    -56, 1 },
+    { 0x001F8, 0x0021E,      1, 2 },
+    { 0x00220, 0x00220,   -130, 1 },
+    { 0x00222, 0x00232,      1, 2 },
+    { 0x0023A, 0x0023A,  10795, 1 },
+    { 0x0023B, 0x0023B,      1, 1 },
+    { 0x0023D, 0x0023D,   -163, 1 },
+    { 0x0023E, 0x0023E,  10792, 1 },
+    { 0x00241, 0x00241,      1, 1 },
+    { 0x00243, 0x00243,   -195, 1 },
+    { 0x00244, 0x00244,     69, 1 },
+    { 0x00245, 0x00245,     71, 1 },
+    { 0x00246, 0x0024E,      1, 2 },
+    { 0x00345, 0x00345,    116, 1 },
+    { 0x00370, 0x00372,      1, 2 },
+    { 0x00376, 0x00376,      1, 1 },
+    { 0x0037F, 0x0037F,    116, 1 },
+    { 0x00386, 0x00386,     38, 1 },
+    { 0x00388, 0x0038A,     37, 1 },
+    { 0x0038C, 0x0038C,     64, 1 },
+    { 0x0038E, 0x0038F,     63, 1 },
+    { 0x00391, 0x003A1,     32, 1 },
+    { 0x003A3, 0x003AB,     32, 1 },
+    { 0x003C2, 0x003C2,      1, 1 },
+    { 0x003CF, 0x003CF,      8, 1 },
+    { 0x003D0, 0x003D0,    -30, 1 },
+    { 0x003D1, 0x003D1,    -25, 1 },
+    { 0x003D5, 0x003D5,    -15, 1 },
+    { 0x003D6, 0x003D6,    -22, 1 },
+    { 0x003D8, 0x003EE,      1, 2 },
+    { 0x003F0, 0x003F0,    -54, 1 },
+    { 0x003F1, 0x003F1,    -48, 1 },
+    { 0x003F4, 0x003F4,    -60, 1 },
+    { 0x003F5, 0x003F5,    -64, 1 },
+    { 0x003F7, 0x003F7,      1, 1 },
+    { 0x003F9, 0x003F9,     -7, 1 },
+    { 0x003FA, 0x003FA,      1, 1 },
+    { 0x003FD, 0x003FF,   -130, 1 },
+    { 0x00400, 0x0040F,     80, 1 },
+    { 0x00410, 0x0042F,     32, 1 },
+    { 0x00460, 0x00480,      1, 2 },
+    { 0x0048A, 0x004BE,      1, 2 },
+    { 0x004C0, 0x004C0,     15, 1 },
+    { 0x004C1, 0x004CD,      1, 2 },
+    { 0x004D0, 0x0052E,      1, 2 },
+    { 0x00531, 0x00556,     48, 1 },
+    { 0x010A0, 0x010C5,   7264, 1 },
+    { 0x010C7, 0x010C7,   7264, 1 },
+    { 0x010CD, 0x010CD,   7264, 1 },
+    { 0x013F8, 0x013FD,     -8, 1 },
+    { 0x01C80, 0x01C80,  -6222, 1 },
+    { 0x01C81, 0x01C81,  -6221, 1 },
+    { 0x01C82, 0x01C82,  -6212, 1 },
+    { 0x01C83, 0x01C84,  -6210, 1 },
+    { 0x01C85, 0x01C85,  -6211, 1 },
+    { 0x01C86, 0x01C86,  -6204, 1 },
+    { 0x01C87, 0x01C87,  -6180, 1 },
+    { 0x01C88, 0x01C88,  35267, 1 },
+    { 0x01C90, 0x01CBA,  -3008, 1 },
+    { 0x01CBD, 0x01CBF,  -3008, 1 },
+    { 0x01E00, 0x01E94,      1, 2 },
+    { 0x01E9B, 0x01E9B,    -58, 1 },
+    { 0x01E9E, 0x01E9E,  -7615, 1 },
+    { 0x01EA0, 0x01EFE,      1, 2 },
+    { 0x01F08, 0x01F0F,     -8, 1 },
+    { 0x01F18, 0x01F1D,     -8, 1 },
+    { 0x01F28, 0x01F2F,     -8, 1 },
+    { 0x01F38, 0x01F3F,     -8, 1 },
+    { 0x01F48, 0x01F4D,     -8, 1 },
+    { 0x01F59, 0x01F5F,     -8, 2 },
+    { 0x01F68, 0x01F6F,     -8, 1 },
+    { 0x01F88, 0x01F8F,     -8, 1 },
+    { 0x01F98, 0x01F9F,     -8, 1 },
+    { 0x01FA8, 0x01FAF,     -8, 1 },
+    { 0x01FB8, 0x01FB9,     -8, 1 },
+    { 0x01FBA, 0x01FBB,    -74, 1 },
+    { 0x01FBC, 0x01FBC,     -9, 1 },
+    { 0x01FBE, 0x01FBE,  -7173, 1 },
+    { 0x01FC8, 0x01FCB,    -86, 1 },
+    { 0x01FCC, 0x01FCC,     -9, 1 },
+    { 0x01FD8, 0x01FD9,     -8, 1 },
+    { 0x01FDA, 0x01FDB,   -100, 1 },
+    { 0x01FE8, 0x01FE9,     -8, 1 },
+    { 0x01FEA, 0x01FEB,   -112, 1 },
+    { 0x01FEC, 0x01FEC,     -7, 1 },
+    { 0x01FF8, 0x01FF9,   -128, 1 },
+    { 0x01FFA, 0x01FFB,   -126, 1 },
+    { 0x01FFC, 0x01FFC,     -9, 1 },
+    { 0x02126, 0x02126,  -7517, 1 },
+    { 0x0212A, 0x0212A,  -8383, 1 },
+    { 0x0212B, 0x0212B,  -8262, 1 },
+    { 0x02132, 0x02132,     28, 1 },
+    { 0x02160, 0x0216F,     16, 1 },
+    { 0x02183, 0x02183,      1, 1 },
+    { 0x024B6, 0x024CF,     26, 1 },
+    { 0x02C00, 0x02C2F,     48, 1 },
+    { 0x02C60, 0x02C60,      1, 1 },
+    { 0x02C62, 0x02C62, -10743, 1 },
+    { 0x02C63, 0x02C63,  -3814, 1 },
+    { 0x02C64, 0x02C64, -10727, 1 },
+    { 0x02C67, 0x02C6B,      1, 2 },
+    { 0x02C6D, 0x02C6D, -10780, 1 },
+    { 0x02C6E, 0x02C6E, -10749, 1 },
+    { 0x02C6F, 0x02C6F, -10783, 1 },
+    { 0x02C70, 0x02C70, -10782, 1 },
+    { 0x02C72, 0x02C72,      1, 1 },
+    { 0x02C75, 0x02C75,      1, 1 },
+    { 0x02C7E, 0x02C7F, -10815, 1 },
+    { 0x02C80, 0x02CE2,      1, 2 },
+    { 0x02CEB, 0x02CED,      1, 2 },
+    { 0x02CF2, 0x02CF2,      1, 1 },
+    { 0x0A640, 0x0A66C,      1, 2 },
+    { 0x0A680, 0x0A69A,      1, 2 },
+    { 0x0A722, 0x0A72E,      1, 2 },
+    { 0x0A732, 0x0A76E,      1, 2 },
+    { 0x0A779, 0x0A77B,      1, 2 },
+    { 0x0A77D, 0x0A77D, -35332, 1 },
+    { 0x0A77E, 0x0A786,      1, 2 },
+    { 0x0A78B, 0x0A78B,      1, 1 },
+    { 0x0A78D, 0x0A78D, -42280, 1 },
+    { 0x0A790, 0x0A792,      1, 2 },
+    { 0x0A796, 0x0A7A8,      1, 2 },
+    { 0x0A7AA, 0x0A7AA, -42308, 1 },
+    { 0x0A7AB, 0x0A7AB, -42319, 1 },
+    { 0x0A7AC, 0x0A7AC, -42315, 1 },
+    { 0x0A7AD, 0x0A7AD, -42305, 1 },
+    { 0x0A7AE, 0x0A7AE, -42308, 1 },
+    { 0x0A7B0, 0x0A7B0, -42258, 1 },
+    { 0x0A7B1, 0x0A7B1, -42282, 1 },
+    { 0x0A7B2, 0x0A7B2, -42261, 1 },
+    { 0x0A7B3, 0x0A7B3,    928, 1 },
+    { 0x0A7B4, 0x0A7C2,      1, 2 },
+    { 0x0A7C4, 0x0A7C4,    -48, 1 },
+    { 0x0A7C5, 0x0A7C5, -42307, 1 },
+    { 0x0A7C6, 0x0A7C6, -35384, 1 },
+    { 0x0A7C7, 0x0A7C9,      1, 2 },
+    { 0x0A7D0, 0x0A7D0,      1, 1 },
+    { 0x0A7D6, 0x0A7D8,      1, 2 },
+    { 0x0A7F5, 0x0A7F5,      1, 1 },
+    { 0x0AB70, 0x0ABBF, -38864, 1 },
+    { 0x0FF21, 0x0FF3A,     32, 1 },
+    { 0x10400, 0x10427,     40, 1 },
+    { 0x104B0, 0x104D3,     40, 1 },
+    { 0x10570, 0x1057A,     39, 1 },
+    { 0x1057C, 0x1058A,     39, 1 },
+    { 0x1058C, 0x10592,     39, 1 },
+    { 0x10594, 0x10595,     39, 1 },
+    { 0x10C80, 0x10CB2,     64, 1 },
+    { 0x118A0, 0x118BF,     32, 1 },
+    { 0x16E40, 0x16E5F,     32, 1 },
+    { 0x1E900, 0x1E921,     34, 1 },
+};
+
+static char fold_ascii(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+#ifdef __SSE2__
+/**
+ * Folds the uppercase ASCII letters of a block. Bytes from 0x80 up are
+ * negative as signed chars, so the signed compares leave them alone.
+ */
+static __m128i fold_block(__m128i block)
+{
+    __m128i upper = _mm_and_si128(
+            _mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+    return _mm_add_epi8(block, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+
+static __m128i load(const char *ptr)
+{
+    return _mm_loadu_si128((const __m128i *) ptr);
+}
+#endif
+
+static bool equal_ascii(const char *a, const char *b, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i same = _mm_cmpeq_epi8(fold_block(load(a + i)), fold_block(load(b + i)));
+        if (_mm_movemask_epi8(same) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        if (fold_ascii(a[i]) != fold_ascii(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool match_ascii(const char *name, size_t name_len, const char *pattern,
+        size_t pattern_len, bool whole)
+{
+    if (whole) {
+        return name_len == pattern_len && equal_ascii(name, pattern, name_len);
+    }
+    if (pattern_len == 0) {
+        return true;
+    }
+    if (pattern_len > name_len) {
+        return false;
+    }
+
+    char first = fold_ascii(pattern[0]);
+    char last = fold_ascii(pattern[pattern_len - 1]);
+    size_t starts = name_len - pattern_len + 1;
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Check the first and last pattern characters at 16 starting positions at
+     * once; only positions where both agree are compared in full. */
+    const __m128i want_first = _mm_set1_epi8(first);
+    const __m128i want_last = _mm_set1_epi8(last);
+    for (; i + 16 <= starts; i += 16) {
+        __m128i at_first = fold_block(load(name + i));
+        __m128i at_last = fold_block(load(name + i + pattern_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(at_first, want_first),
+                    _mm_cmpeq_epi8(at_last, want_last)));
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (equal_ascii(name + pos, pattern, pattern_len)) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < starts; ++i) {
+        if (fold_ascii(name[i]) == first
+                && equal_ascii(name + i, pattern, pattern_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decodes the code point at the start of 's', storing the number of bytes it
+ * takes in 'used'. Overlong forms, surrogates and truncated sequences are
+ * invalid, and decode one byte at a time.
+ */
+static uint32_t decode(const unsigned char *s, size_t len, size_t *used)
+{
+    unsigned char lead = s[0];
+    *used = 1;
+    if (lead < 0x80) {
+        return lead;
+    }
+
+    size_t extra;
+    uint32_t cp;
+    uint32_t min;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        extra = 1;
+        cp = lead & 0x1F;
+        min = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+        extra = 2;
+        cp = lead & 0x0F;
+        min = 0x800;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        extra = 3;
+        cp = lead & 0x07;
+        min = 0x10000;
+    } else {
+        return INVALID_BYTE + lead;
+    }
+    if (extra >= len) {
+        return INVALID_BYTE + lead;
+    }
+    for (size_t i = 1; i <= extra; ++i) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return INVALID_BYTE + lead;
+        }
+        cp = cp << 6 | (s[i] & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return INVALID_BYTE + lead;
+    }
+    *used = extra + 1;
+    return cp;
+}
+
+static uint32_t fold_char(uint32_t cp)
+{
+    if (cp < 0x80) {
+        return fold_ascii(cp);
+    }
+    // find the first range that ends at or after 'cp'
+    size_t low = 0;
+    size_t high = sizeof(fold_ranges) / sizeof(fold_ranges[0]);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (fold_ranges[mid].last < cp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == sizeof(fold_ranges) / sizeof(fold_ranges[0])) {
+        return cp;
+    }
+    const struct fold_range *range = &fold_ranges[low];
+    if (cp < range->first || (cp - range->first) % range->stride != 0) {
+        return cp;
+    }
+    return cp + range->delta;
+}
+
+int match_fold(const char *str, size_t len, uint32_t *out)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    int count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        if (count == MATCH_CHARS_MAX) {
+            return -1;
+        }
+        size_t used;
+        out[count++] = fold_char(decode(s + pos, len - pos, &used));
+        pos += used;
+    }
+    return count;
+}
+
+bool match_unicode(const char *name, size_t name_len, const uint32_t *pattern,
+        int pattern_len, bool whole)
+{
+    if (pattern_len < 0) {
+        // too long to match any name
+        return false;
+    }
+    uint32_t folded[MATCH_CHARS_MAX];
+    int len = match_fold(name, name_len, folded);
+    if (len < 0) {
+        return false;
+    }
+    if (whole) {
+        return len == pattern_len
+            && memcmp(folded, pattern, len * sizeof(uint32_t)) == 0;
+    }
+    if (pattern_len == 0) {
+        return true;
+    }
+    for (int i = 0; i + pattern_len <= len; ++i) {
+        if (folded[i] == pattern[0]
+                && memcmp(folded + i, pattern, pattern_len * sizeof(uint32_t)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
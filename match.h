@@ -0,0 +1,56 @@
+/**
+ * @file match.h
+ *
+ * Case-insensitive name matching for search_match(). Two levels of folding are
+ * offered:
+ *
+ * - ASCII: only 'A'-'Z' are folded. Names are compared 16 bytes at a time
+ *   with SSE2, folding each block with two compares and an add, so this costs
+ *   about as much as a case-sensitive search.
+ * - Unicode: names are decoded as UTF-8 and each code point is folded with the
+ *   simple case folding of the Unicode Character Database (one code point to
+ *   one), looked up in a table compiled into the library. The pattern is
+ *   folded once up front; names are folded on the fly into a buffer on the
+ *   stack, so no memory is allocated and no locale is consulted per name.
+ *
+ * Bytes that are not valid UTF-8 are kept as themselves and only match the
+ * same bytes in the pattern.
+ */
+
+#ifndef _MATCH_H_
+#define _MATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Most code points a folded name or pattern can hold. Names on Linux are at
+ * most 255 bytes, so they always fit; a longer pattern can't match anything.
+ */
+#define MATCH_CHARS_MAX 256
+
+/**
+ * Checks whether 'name' contains 'pattern' (or, with 'whole', equals it),
+ * ignoring the case of ASCII letters.
+ */
+bool match_ascii(const char *name, size_t name_len, const char *pattern,
+        size_t pattern_len, bool whole);
+
+/**
+ * Decodes and folds a UTF-8 string into 'out', which must hold
+ * MATCH_CHARS_MAX code points.
+ *
+ * @return the number of code points, or -1 if there are more than
+ * MATCH_CHARS_MAX.
+ */
+int match_fold(const char *str, size_t len, uint32_t *out);
+
+/**
+ * Checks whether 'name' contains (or, with 'whole', equals) a pattern already
+ * folded with match_fold(), folding the name as it goes.
+ */
+bool match_unicode(const char *name, size_t name_len, const uint32_t *pattern,
+        int pattern_len, bool whole);
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * @file merge.c
+ *
+ * Implementation of the loser tree declared in merge.h. Source s is the leaf
+ * at node k + s; every internal node holds the source that lost the match
+ * played there, so replaying a leaf only compares it against the losers on
+ * its path to the root.
+ */
+
+#include <stdlib.h>
+
+#include "merge.h"
+
+/**
+ * Tells whether source 'a' wins against source 'b'. Source k stands in for
+ * the leaves that have not been played yet and beats everything.
+ */
+static bool beats(struct merge *m, size_t a, size_t b)
+{
+    if (a == m->k) {
+        return true;
+    }
+    if (b == m->k) {
+        return false;
+    }
+    return m->less(m->ctx, a, b);
+}
+
+static void replay(struct merge *m, size_t s)
+{
+    for (size_t t = (s + m->k) / 2; t > 0; t /= 2) {
+        if (beats(m, m->tree[t], s)) {
+            size_t loser = s;
+            s = m->tree[t];
+            m->tree[t] = loser;
+        }
+    }
+    m->tree[0] = s;
+}
+
+int merge_init(struct merge *m, size_t k, merge_less_fn less, void *ctx)
+{
+    m->k = k;
+    m->less = less;
+    m->ctx = ctx;
+    m->tree = malloc((k + 1) * sizeof(size_t));
+    if (m->tree == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= k; ++i) {
+        m->tree[i] = k;
+    }
+    for (size_t s = 0; s < k; ++s) {
+        replay(m, s);
+    }
+    return 0;
+}
+
+size_t merge_winner(const struct merge *m)
+{
+    return m->tree[0];
+}
+
+void merge_replay(struct merge *m)
+{
+    replay(m, m->tree[0]);
+}
+
+void merge_destroy(struct merge *m)
+{
+    free(m->tree);
+    m->tree = NULL;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file merge.h
+ *
+ * Loser tree for k-way merges. The tree only deals in source numbers: the
+ * caller keeps the current item of each source and says how two of them
+ * compare. Picking the next item costs one comparison per level of the tree
+ * (log2 k), rather than the two per level of a binary heap.
+ *
+ * Example Usage:
+ *
+ *     struct merge m;
+ *     merge_init(&m, k, less, sources);      // every source's first item loaded
+ *     for (size_t s = merge_winner(&m); !exhausted(s); s = merge_winner(&m)) {
+ *         consume(s);
+ *         advance(s);                         // load the source's next item
+ *         merge_replay(&m);
+ *     }
+ *     merge_destroy(&m);
+ */
+
+#ifndef _MERGE_H_
+#define _MERGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Tells whether the current item of source 'a' sorts before that of source
+ * 'b'. Exhausted sources must sort after everything else.
+ */
+typedef bool (*merge_less_fn)(void *ctx, size_t a, size_t b);
+
+struct merge {
+    size_t k;
+    size_t *tree;      // tree[0] is the winner; tree[1..k-1] hold losers
+    merge_less_fn less;
+    void *ctx;
+};
+
+/**
+ * Builds a tree over 'k' sources, whose first items must already be loaded.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated.
+ */
+int merge_init(struct merge *m, size_t k, merge_less_fn less, void *ctx);
+
+/**
+ * Retrieves the source whose current item sorts first (k if there are no
+ * sources at all).
+ */
+size_t merge_winner(const struct merge *m);
+
+/**
+ * Restores the tree after the winning source has moved to its next item (or
+ * run out of items).
+ */
+void merge_replay(struct merge *m);
+
+void merge_destroy(struct merge *m);
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * @file output.c
+ *
+ * Implementation of the output sink and formatters declared in output.h.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+int sink_init(struct sink *sink, int fd, size_t cap)
+{
+    sink->fd = fd;
+    sink->len = 0;
+    sink->written = 0;
+    sink->cap = cap;
+    sink->failed = false;
+    sink->buf = malloc(cap);
+    return sink->buf == NULL ? -1 : 0;
+}
+
+int sink_flush(struct sink *sink)
+{
+    size_t done = 0;
+    while (done < sink->len && !sink->failed) {
+        ssize_t n = write(sink->fd, sink->buf + done, sink->len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            sink->failed = true;
+            break;
+        }
+        done += n;
+        sink->written += n;
+    }
+    sink->len = 0;
+    return sink->failed ? -1 : 0;
+}
+
+char *sink_reserve(struct sink *sink, size_t len)
+{
+    if (sink->cap - sink->len >= len) {
+        return sink->buf + sink->len;
+    }
+    sink_flush(sink);
+    if (len > sink->cap) {
+        // only very long paths get here; keep the bigger buffer afterward
+        char *buf = realloc(sink->buf, len);
+        if (buf == NULL) {
+            return NULL;
+        }
+        sink->buf = buf;
+        sink->cap = len;
+    }
+    return sink->buf;
+}
+
+void sink_commit(struct sink *sink, size_t len)
+{
+    sink->len += len;
+}
+
+void sink_printf(struct sink *sink, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(sink->buf + sink->len, sink->cap - sink->len, fmt, args);
+    va_end(args);
+    if (needed < 0) {
+        return;
+    }
+    if ((size_t) needed >= sink->cap - sink->len) {
+        // didn't fit: make room and format again
+        char *dest = sink_reserve(sink, needed + 1);
+        if (dest == NULL) {
+            return;
+        }
+        va_start(args, fmt);
+        vsnprintf(dest, needed + 1, fmt, args);
+        va_end(args);
+    }
+    sink_commit(sink, needed);
+}
+
+int sink_close(struct sink *sink)
+{
+    int rc = sink_flush(sink);
+    free(sink->buf);
+    sink->buf = NULL;
+    return rc;
+}
+
+/**
+ * Writes the path followed by a single terminator byte.
+ */
+static void write_terminated(struct sink *sink, const struct output_entry *entry,
+        char terminator)
+{
+    char *dest = sink_reserve(sink, entry->path_len + 1);
+    if (dest == NULL) {
+        return;
+    }
+    memcpy(dest, entry->path, entry->path_len);
+    dest[entry->path_len] = terminator;
+    sink_commit(sink, entry->path_len + 1);
+}
+
+static void write_text(struct sink *sink, const struct output_entry *entry)
+{
+    write_terminated(sink, entry, '\n');
+}
+
+static void write_nul(struct sink *sink, const struct output_entry *entry)
+{
+    write_terminated(sink, entry, '\0');
+}
+
+/**
+ * Measures the valid UTF-8 sequence at the start of 's' (which holds 'len'
+ * bytes), rejecting overlong forms, surrogates and code points past U+10FFFF.
+ *
+ * @return the length of the sequence, or 0 if it isn't valid.
+ */
+static size_t utf8_length(const unsigned char *s, size_t len)
+{
+    unsigned char c = s[0];
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf; // allowed range of the second byte
+    if (c < 0x80) {
+        return 1;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        lo = c == 0xe0 ? 0xa0 : 0x80;
+        hi = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        lo = c == 0xf0 ? 0x90 : 0x80;
+        hi = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    if (len < n || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+    for (size_t i = 2; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/**
+ * Writes one JSON object per line. Control characters, quotes and backslashes
+ * in the path are escaped. JSON strings can only hold Unicode, so bytes that
+ * aren't valid UTF-8 become U+FFFD in "path", and the exact bytes are given
+ * in base64 in an extra "path_bytes" field.
+ */
+static void write_json(struct sink *sink, const struct output_entry *entry)
+{
+    static const char hex[] = "0123456789abcdef";
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // worst case: every byte becomes \u00XX, plus base64 and the other fields
+    char *dest = sink_reserve(sink, entry->path_len * 6 + (entry->path_len + 2) / 3 * 4 + 112);
+    if (dest == NULL) {
+        return;
+    }
+    const unsigned char *path = (const unsigned char *) entry->path;
+    bool valid = true;
+    char *p = dest;
+    memcpy(p, "{\"path\":\"", 9);
+    p += 9;
+    for (size_t i = 0; i < entry->path_len; ) {
+        unsigned char c = path[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+            i++;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[c >> 4];
+            p[5] = hex[c & 0xf];
+            p += 6;
+            i++;
+        } else {
+            size_t n = utf8_length(path + i, entry->path_len - i);
+            if (n == 0) {
+                memcpy(p, "\xef\xbf\xbd", 3); // U+FFFD REPLACEMENT CHARACTER
+                p += 3;
+                valid = false;
+                i++;
+            } else {
+                memcpy(p, path + i, n);
+                p += n;
+                i += n;
+            }
+        }
+    }
+    *p++ = '"';
+    if (!valid) {
+        memcpy(p, ",\"path_bytes\":\"", 15);
+        p += 15;
+        for (size_t i = 0; i < entry->path_len; i += 3) {
+            size_t left = entry->path_len - i;
+            uint32_t v = path[i] << 16;
+            if (left > 1) {
+                v |= path[i + 1] << 8;
+            }
+            if (left > 2) {
+                v |= path[i + 2];
+            }
+            p[0] = base64[v >> 18];
+            p[1] = base64[(v >> 12) & 0x3f];
+            p[2] = left > 1 ? base64[(v >> 6) & 0x3f] : '=';
+            p[3] = left > 2 ? base64[v & 0x3f] : '=';
+            p += 4;
+        }
+        *p++ = '"';
+    }
+    p += sprintf(p, ",\"type\":\"%s\",\"size\":%llu,\"mtime_ns\":%lld}\n",
+            entry->type == DT_DIR ? "dir" : "file",
+            (unsigned long long) entry->size, (long long) entry->mtime_ns);
+    sink_commit(sink, p - dest);
+}
+
+static void write_binary(struct sink *sink, const struct output_entry *entry)
+{
+    size_t len = sizeof(struct output_record) + entry->path_len;
+    char *dest = sink_reserve(sink, len);
+    if (dest == NULL) {
+        return;
+    }
+    struct output_record record = {
+        .length = len,
+        .path_len = entry->path_len,
+        .type = entry->type == DT_DIR ? OUTPUT_RECORD_DIR : OUTPUT_RECORD_FILE,
+        .size = entry->size,
+        .mtime_ns = entry->mtime_ns,
+    };
+    memcpy(dest, &record, sizeof(record));
+    memcpy(dest + sizeof(record), entry->path, entry->path_len);
+    sink_commit(sink, len);
+}
+
+static const struct output_formatter formatters[] = {
+    { "text", false, write_text },
+    { "nul", false, write_nul },
+    { "json", true, write_json },
+    { "binary", true, write_binary },
+};
+
+const struct output_formatter *output_formatter_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(formatters) / sizeof(formatters[0]); ++i) {
+        if (strcmp(formatters[i].name, name) == 0) {
+            return &formatters[i];
+        }
+    }
+    return NULL;
+}
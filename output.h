@@ -0,0 +1,121 @@
+/**
+ * @file output.h
+ *
+ * Buffered output sink and the formatters that write search results into it.
+ * Formatters reserve space in the sink's buffer and encode entries in place,
+ * so printing a result never allocates.
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default capacity of an output sink's buffer.
+ */
+#define SINK_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Accumulates output in a buffer and hands it to write(2) in large chunks.
+ */
+struct sink {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed; // a write failed; further output is discarded
+    uint64_t written; // bytes written so far
+};
+
+/**
+ * A search result to be formatted. 'size' and 'mtime_ns' are only filled in
+ * when the formatter's 'needs_stat' flag is set.
+ */
+struct output_entry {
+    const char *path;
+    size_t path_len;
+    unsigned char type; // d_type of the entry (DT_REG, DT_DIR, ...)
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+/**
+ * Layout of a record in the binary output format. Each record is followed by
+ * 'path_len' bytes of path (not NUL-terminated); 'length' covers the header and
+ * the path, so a reader can skip records without decoding them. Fields are in
+ * host byte order.
+ */
+struct output_record {
+    uint32_t length;
+    uint32_t path_len;
+    uint8_t type;       // OUTPUT_RECORD_FILE or OUTPUT_RECORD_DIR
+    uint8_t reserved[7];
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+#define OUTPUT_RECORD_FILE 1
+#define OUTPUT_RECORD_DIR  2
+
+/**
+ * An output format: a name that can be selected on the command line and a
+ * function that writes one entry into a sink.
+ */
+struct output_formatter {
+    const char *name;
+    bool needs_stat;
+    void (*write)(struct sink *sink, const struct output_entry *entry);
+};
+
+/**
+ * Looks up an output format by name ("text", "nul", "json" or "binary").
+ *
+ * @return the formatter, or NULL if the name is unknown.
+ */
+const struct output_formatter *output_formatter_find(const char *name);
+
+/**
+ * Prepares a sink that writes to 'fd' through a buffer of 'cap' bytes.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int sink_init(struct sink *sink, int fd, size_t cap);
+
+/**
+ * Returns a pointer to at least 'len' bytes of free buffer space, flushing or
+ * growing the buffer as needed. Data written there is not output until
+ * sink_commit() is called.
+ *
+ * @return the reserved space, or NULL on failure.
+ */
+char *sink_reserve(struct sink *sink, size_t len);
+
+/**
+ * Marks 'len' bytes of previously reserved space as ready for output.
+ */
+void sink_commit(struct sink *sink, size_t len);
+
+/**
+ * Appends formatted text to the sink, like printf(3).
+ */
+void sink_printf(struct sink *sink, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Writes any buffered data to the sink's file descriptor.
+ *
+ * @return 0 on success, -1 if any write (now or earlier) failed.
+ */
+int sink_flush(struct sink *sink);
+
+/**
+ * Flushes the sink and frees its buffer.
+ *
+ * @return the result of the final flush.
+ */
+int sink_close(struct sink *sink);
+
+#endif
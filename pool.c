@@ -0,0 +1,159 @@
+/**
+ * @file pool.c
+ *
+ * Implementation of the worker pool declared in pool.h. Each batch gets a new
+ * generation number; workers wake up when it changes and claim indexes from a
+ * shared counter until the batch runs out.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "logger.h"
+#include "pool.h"
+
+struct worker {
+    pthread_t thread;
+    struct pool *pool;
+    size_t id;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start;   // a new batch (or shutdown) is ready
+    pthread_cond_t done;    // the last item of the batch finished
+    unsigned long generation;
+    bool stopping;
+
+    /* The current batch */
+    pool_fn fn;
+    void *ctx;
+    size_t count;
+    size_t next;            // next index to claim
+    size_t finished;
+
+    struct worker *workers;
+    size_t size;            // threads started, plus the caller
+};
+
+/**
+ * Works on the current batch until every item has been claimed.
+ */
+static void work(struct pool *pool, size_t id)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->count) {
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->fn(pool->ctx, id, index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->count) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    unsigned long seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        work(pool, w->id);
+    }
+}
+
+struct pool *pool_create(int jobs)
+{
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    size_t threads = jobs > 1 ? jobs - 1 : 0;
+    pool->workers = calloc(threads + 1, sizeof(struct worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->size = 1;
+    for (size_t i = 0; i < threads; ++i) {
+        struct worker *w = &pool->workers[pool->size];
+        w->pool = pool;
+        w->id = pool->size;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            break;
+        }
+        pool->size++;
+    }
+    LOG("Started a pool of %zu threads\n", pool->size);
+    return pool;
+}
+
+size_t pool_size(const struct pool *pool)
+{
+    return pool->size;
+}
+
+void pool_run(struct pool *pool, size_t count, pool_fn fn, void *ctx)
+{
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    // a single item isn't worth waking anybody up for
+    if (count > 1) {
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->count) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->size; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,54 @@
+/**
+ * @file pool.h
+ *
+ * A fixed set of worker threads for running the same function over a batch of
+ * items in parallel. The calling thread works on the batch too, and the call
+ * returns once every item is done, so callers can go on to use the results in
+ * their original order.
+ *
+ * Example Usage:
+ *
+ *     struct pool *pool = pool_create(jobs);
+ *     pool_run(pool, count, check_file, files);   // check_file(files, w, i) for i < count
+ *     pool_destroy(pool);
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+/**
+ * Processes item 'index' of a batch. 'worker' identifies the thread (0 for the
+ * caller, up to pool_size() - 1), so per-thread scratch space can be indexed
+ * by it.
+ */
+typedef void (*pool_fn)(void *ctx, size_t worker, size_t index);
+
+struct pool;
+
+/**
+ * Starts a pool that runs batches on 'jobs' threads, the caller included. If
+ * some threads can't be started, the pool makes do with fewer.
+ *
+ * @return the pool, or NULL on allocation failure.
+ */
+struct pool *pool_create(int jobs);
+
+/**
+ * Retrieves the number of threads working on each batch, the caller included.
+ */
+size_t pool_size(const struct pool *pool);
+
+/**
+ * Calls 'fn' for every index below 'count' and waits for all of the calls to
+ * finish. Only one batch runs at a time.
+ */
+void pool_run(struct pool *pool, size_t count, pool_fn fn, void *ctx);
+
+/**
+ * Stops the worker threads and frees the pool.
+ */
+void pool_destroy(struct pool *pool);
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * @file runs.c
+ *
+ * Implementation of the sorted runs declared in runs.h. A run is a sequence of
+ * records, each holding two LEB128 varints (the prefix length shared with the
+ * previous path and the length of the rest), the entry type, and the rest of
+ * the path.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "merge.h"
+#include "runs.h"
+
+int path_compare(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    for (size_t i = 0; i < n; ++i) {
+        if (a[i] != b[i]) {
+            // '/' ends a component, so it sorts before everything else
+            unsigned char ca = a[i] == '/' ? 0 : a[i];
+            unsigned char cb = b[i] == '/' ? 0 : b[i];
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    const struct run_item *ia = a;
+    const struct run_item *ib = b;
+    return path_compare(ia->path, ia->len, ib->path, ib->len);
+}
+
+int run_buffer_init(struct run_buffer *buf, size_t mem_limit)
+{
+    memset(buf, 0, sizeof(*buf));
+    /* A quarter of the memory goes to items; paths average well under the
+     * 48 bytes of path space that leaves per item. */
+    buf->cap = mem_limit / 4 / sizeof(struct run_item);
+    buf->arena_cap = mem_limit - buf->cap * sizeof(struct run_item);
+    if (buf->cap == 0 || buf->arena_cap < PATH_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    buf->items = malloc(buf->cap * sizeof(struct run_item));
+    buf->arena = malloc(buf->arena_cap);
+    if (buf->items == NULL || buf->arena == NULL) {
+        free(buf->items);
+        free(buf->arena);
+        return -1;
+    }
+    return 0;
+}
+
+static void put_varint(FILE *out, uint32_t value)
+{
+    while (value >= 0x80) {
+        putc_unlocked((value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc_unlocked(value, out);
+}
+
+static int get_varint(FILE *in, uint32_t *value)
+{
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = getc_unlocked(in);
+        if (c == EOF) {
+            return -1;
+        }
+        v |= (uint32_t) (c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int run_buffer_spill(struct run_buffer *buf)
+{
+    if (buf->len == 0) {
+        return 0;
+    }
+    if (buf->run_count == buf->run_cap) {
+        size_t cap = buf->run_cap == 0 ? 8 : buf->run_cap * 2;
+        FILE **runs = realloc(buf->runs, cap * sizeof(FILE *));
+        if (runs == NULL) {
+            return -1;
+        }
+        buf->runs = runs;
+        buf->run_cap = cap;
+    }
+    FILE *out = tmpfile();
+    if (out == NULL) {
+        return -1;
+    }
+
+    qsort(buf->items, buf->len, sizeof(struct run_item), compare_items);
+    const char *prev = "";
+    size_t prev_len = 0;
+    for (size_t i = 0; i < buf->len; ++i) {
+        const struct run_item *item = &buf->items[i];
+        size_t shared = 0;
+        size_t max = item->len < prev_len ? item->len : prev_len;
+        while (shared < max && item->path[shared] == prev[shared]) {
+            shared++;
+        }
+        put_varint(out, shared);
+        put_varint(out, item->len - shared);
+        putc_unlocked(item->type, out);
+        fwrite(item->path + shared, 1, item->len - shared, out);
+        prev = item->path;
+        prev_len = item->len;
+    }
+    if (fflush(out) != 0 || ferror(out)) {
+        fclose(out);
+        return -1;
+    }
+    rewind(out);
+    LOG("Spilled a run of %zu paths\n", buf->len);
+
+    buf->runs[buf->run_count++] = out;
+    buf->len = 0;
+    buf->arena_len = 0;
+    return 0;
+}
+
+int run_buffer_add(struct run_buffer *buf, const char *path, size_t len,
+        unsigned char type)
+{
+    if (len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (buf->len == buf->cap || buf->arena_len + len > buf->arena_cap) {
+        if (run_buffer_spill(buf) == -1) {
+            return -1;
+        }
+    }
+    char *copy = buf->arena + buf->arena_len;
+    memcpy(copy, path, len);
+    buf->arena_len += len;
+    buf->items[buf->len++] = (struct run_item) { copy, len, type };
+    return 0;
+}
+
+void run_buffer_destroy(struct run_buffer *buf)
+{
+    for (size_t i = 0; i < buf->run_count; ++i) {
+        fclose(buf->runs[i]);
+    }
+    free(buf->runs);
+    free(buf->items);
+    free(buf->arena);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/**
+ * The current path of a run being merged. Front coding means each path is
+ * decoded on top of the previous one.
+ */
+struct run_reader {
+    FILE *in;
+    char path[PATH_MAX];
+    uint32_t len;
+    unsigned char type;
+    bool done;
+    bool failed;
+};
+
+static void reader_next(struct run_reader *r)
+{
+    uint32_t shared, rest;
+    if (get_varint(r->in, &shared) == -1) {
+        // a clean end of the run, unless the file could not be read
+        r->done = true;
+        r->failed = ferror(r->in);
+        return;
+    }
+    int type;
+    if (get_varint(r->in, &rest) == -1 || shared > r->len
+            || (size_t) shared + rest >= PATH_MAX
+            || (type = getc_unlocked(r->in)) == EOF
+            || fread(r->path + shared, 1, rest, r->in) != rest) {
+        r->done = true;
+        r->failed = true;
+        return;
+    }
+    r->len = shared + rest;
+    r->path[r->len] = '\0';
+    r->type = type;
+}
+
+static bool reader_less(void *ctx, size_t a, size_t b)
+{
+    struct run_reader *readers = ctx;
+    if (readers[a].done) {
+        return false;
+    }
+    if (readers[b].done) {
+        return true;
+    }
+    return path_compare(readers[a].path, readers[a].len,
+            readers[b].path, readers[b].len) < 0;
+}
+
+int runs_merge(FILE **runs, size_t count, run_fn fn, void *ctx)
+{
+    struct run_reader *readers = calloc(count + 1, sizeof(struct run_reader));
+    if (readers == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        readers[i].in = runs[i];
+        reader_next(&readers[i]);
+    }
+    struct merge m;
+    if (merge_init(&m, count, reader_less, readers) == -1) {
+        free(readers);
+        return -1;
+    }
+
+    int rc = 0;
+    size_t s;
+    while (rc == 0 && (s = merge_winner(&m)) < count && !readers[s].done) {
+        rc = fn(ctx, readers[s].path, readers[s].len, readers[s].type);
+        reader_next(&readers[s]);
+        merge_replay(&m);
+    }
+    for (size_t i = 0; i < count && rc == 0; ++i) {
+        if (readers[i].failed) {
+            errno = EIO;
+            rc = -1;
+        }
+    }
+    merge_destroy(&m);
+    free(readers);
+    return rc;
+}
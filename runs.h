@@ -0,0 +1,98 @@
+/**
+ * @file runs.h
+ *
+ * Sorted runs of paths for sorting more paths than fit in memory. A run buffer
+ * collects paths up to a memory limit, then sorts them and spills them to a
+ * temporary file as a run. Neighboring paths in a sorted run share long
+ * prefixes, so each one is front-coded: stored as the length of the prefix it
+ * shares with the previous path followed by the rest. runs_merge() combines
+ * any number of runs back into a single sorted stream.
+ *
+ * Paths are ordered component by component, as if '/' sorted before every
+ * other byte. This puts each directory right before its contents, so a sorted
+ * list of paths is a depth-first listing of the tree with the entries of each
+ * directory sorted by name.
+ */
+
+#ifndef _RUNS_H_
+#define _RUNS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Default number of bytes of paths buffered before a run is spilled. Can be
+ * overridden at compile time, e.g., -DRUN_MEM_LIMIT=4096.
+ */
+#ifndef RUN_MEM_LIMIT
+#define RUN_MEM_LIMIT (64 * 1024 * 1024)
+#endif
+
+struct run_item {
+    const char *path;
+    uint32_t len;
+    unsigned char type;
+};
+
+struct run_buffer {
+    char *arena;            // the buffered paths
+    size_t arena_len;
+    size_t arena_cap;
+    struct run_item *items;
+    size_t len;
+    size_t cap;
+    FILE **runs;            // runs spilled so far
+    size_t run_count;
+    size_t run_cap;
+};
+
+/**
+ * Compares two paths in run order.
+ */
+int path_compare(const char *a, size_t a_len, const char *b, size_t b_len);
+
+/**
+ * Prepares a buffer that holds up to 'mem_limit' bytes of paths and items.
+ *
+ * @return 0 on success, or -1 if memory could not be allocated.
+ */
+int run_buffer_init(struct run_buffer *buf, size_t mem_limit);
+
+/**
+ * Adds a path to the buffer, spilling a run first if the buffer is full.
+ *
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int run_buffer_add(struct run_buffer *buf, const char *path, size_t len,
+        unsigned char type);
+
+/**
+ * Sorts the buffered paths and writes them out as a run. Does nothing if the
+ * buffer is empty.
+ *
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int run_buffer_spill(struct run_buffer *buf);
+
+/**
+ * Frees the buffer and closes (and thereby removes) its runs.
+ */
+void run_buffer_destroy(struct run_buffer *buf);
+
+/**
+ * Receives the paths of a merge in order.
+ *
+ * @return 0 to continue, or any other value to stop the merge.
+ */
+typedef int (*run_fn)(void *ctx, const char *path, size_t len, unsigned char type);
+
+/**
+ * Merges runs (from any number of buffers) and passes every path to 'fn'.
+ *
+ * @return 0 when every path has been passed on, the callback's return value
+ * if it stopped the merge, or -1 on error (errno is set).
+ */
+int runs_merge(FILE **runs, size_t count, run_fn fn, void *ctx);
+
+#endif
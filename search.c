@@ -7,25 +7,166 @@
  * variety of filtering options.
  */
 
+#define _GNU_SOURCE // strerrorname_np()
+
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "contents.h"
+#include "copy.h"
+#include "daemon.h"
+#include "dircache.h"
+#include "dupes.h"
+#include "exec.h"
+#include "ext_set.h"
+#include "fuzzy.h"
+#include "hash.h"
+#include "index.h"
 #include "logger.h"
+#include "output.h"
+#include "pool.h"
+#include "search.h"
+#include "snapshot.h"
+#include "sorter.h"
+#include "topk.h"
 
 struct options {
-    int max_depth;
-    bool exact_match : 1; // these are bitfields (1 bit each)
-    bool show_dirs : 1;
-    bool show_files : 1;
-    bool show_hidden : 1;
+    struct search_opts search; // what to look for, passed on to the library
+    bool top_by_mtime : 1; // these are bitfields (1 bit each)
+    bool count_only : 1;
+    bool summary : 1;
+    bool duplicates : 1; // group identical files (--duplicates)
+    bool manifest : 1;   // print a checksum for each file (--manifest)
+    enum hash_type manifest_type;
+    int sizes_top; // number of directories to report for --sizes (0 = off)
+    int top_files; // number of files to report for --top (0 = off)
+    const struct output_formatter *format;
+    bool serve : 1;     // run as the indexing daemon (--daemon)
+    bool no_daemon : 1; // never ask a running daemon (--no-daemon)
+    char *socket_path;
+    char *build_index;  // write an index file and exit (--build-index)
+    enum index_type index_type;
+    int jobs;           // worker threads (-j)
+    char *index_path;   // answer queries from an index file (--index)
+    char *snapshot_path; // record the tree in a snapshot file (--snapshot)
+    char *diff_path;    // report changes since a snapshot (--diff)
+    char *cache_path;   // replay unchanged directory listings (--cache)
+    char *extensions;   // only report files with these extensions (--ext)
+    char *contains;     // only report files containing this (--contains)
+    char *copy_to;      // copy matching files beneath this (--copy-to)
+    char **exec_argv;   // command run on the matches (--exec, --exec-batch)
+    size_t exec_argc;
+    bool exec_batch : 1; // pass many matches to each command (--exec-batch)
+    bool sort : 1;      // print the results in order (--sort)
+    enum sort_key sort_key;
+    char *fuzzy;        // rank names by how well they match this (--fuzzy)
+    int fuzzy_results;  // number of --fuzzy matches to report
+    bool stats : 1;     // print what the search did (--stats)
+    bool stats_json : 1;
+};
+
+/**
+ * A directory retained in the --sizes report.
+ */
+struct dir_report {
+    uint64_t bytes; // allocated bytes (st_blocks * 512), like du(1)
+    uint64_t files; // regular files
+    char path[];
+};
+
+/**
+ * Number of matches for a file extension in the --summary report.
+ */
+struct ext_count {
+    char *ext;
+    unsigned long long count;
+};
+
+/**
+ * Match counts gathered by -c and --summary.
+ */
+struct tally {
+    unsigned long long matches;
+    unsigned long long files;
+    unsigned long long dirs;
+    unsigned long long *depths;
+    size_t depth_cap;
+    struct ext_count *exts; // open-addressing table keyed by extension
+    size_t ext_cap;
+    size_t ext_len;
+};
+
+/**
+ * A file retained in the --top report.
+ */
+struct top_file {
+    uint64_t size;
+    int64_t mtime_ns;
+    size_t path_len;
+    char path[];
+};
+
+/**
+ * A match retained in the --fuzzy report.
+ */
+struct fuzzy_match {
+    int score;
+    unsigned char type;
+    uint64_t size;
+    int64_t mtime_ns;
+    size_t path_len;
+    char path[];
+};
+
+/**
+ * Per-file work on one batch of entries, spread over the worker pool: the
+ * --contains check, the --manifest checksum and the --copy-to copy.
+ */
+struct file_work {
+    struct context *ctx;
+    char **buffers;                     // a read buffer for each pool thread
+    size_t buffer_count;
+    const char *pattern;                // --contains pattern, or NULL
+    size_t pattern_len;
+    size_t root_len;                    // length of the searched directory
+    unsigned long copies[COPY_METHODS]; // files copied by each method
+    bool failed;                        // a file couldn't be read, hashed or copied
+    const struct search_entry *entries; // the batch being worked on
+    bool hits[SEARCH_BATCH_SIZE];       // files that passed (and were hashed)
+    char digests[SEARCH_BATCH_SIZE][HASH_HEX_MAX];
+};
+
+/**
+ * Everything one run of the command needs: its options, the output sink and
+ * the reports being gathered. Keeping this out of globals means the functions
+ * below can be used for several searches at once.
+ */
+struct context {
+    struct options opts;
+    struct sink out;            // buffered standard output shared by all reports
+    struct tally tally;         // counts for -c and --summary
+    struct topk heaviest_dirs;  // the heaviest directories seen so far by --sizes
+    struct topk top_files;      // the largest (or newest) files seen so far by --top
+    struct index *index;        // opened by --index, or NULL
+    struct file_work *work;     // set up by --contains, --manifest and --copy-to
+    struct dupes *dupes;        // files collected by --duplicates, or NULL
+    struct exec_runner *exec;   // runs --exec and --exec-batch, or NULL
+    struct sorter *sorter;      // results held back by --sort, or NULL
+    struct fuzzy_query fuzzy;   // the --fuzzy pattern
+    struct topk fuzzy_matches;  // the best --fuzzy matches seen so far
+    struct pool *pool;          // worker threads for file contents
+    struct search_stats stats;  // filled in by the search for --stats
 };
-//-1 is default depth
-struct options default_options = {-1, false, true, true, false};
 
 /**
  * Prints help/program usage information.
@@ -35,94 +176,1045 @@ struct options default_options = {-1, false, true, true, false};
  */
 void print_usage(char *prog_name)
 {
-    printf("Usage: %s [-defhH] [-l depth-limit] [directory] [search-pattern]\n" , prog_name);
+    printf("Usage: %s [-cdefhHi] [-j jobs] [-l depth-limit] [directory] [search-pattern]\n" , prog_name);
     printf("\n");
     printf("Options:\n"
+"    * -c    Only print the number of matches.\n"
 "    * -d    Only display directories (no files)\n"
 "    * -e    Match search-pattern exactly; no partial matches reported.\n"
 "    * -f    Only display files (no directories)\n"
+"    * -i    Ignore case when matching search-pattern (ASCII letters only).\n"
+"    * --ext EXT[,EXT...]\n"
+"            Only report files with one of the given extensions, e.g.,\n"
+"            --ext jpg,png,mp4 (with -i, in either case).\n"
+"    * --unicode-fold\n"
+"            Ignore case across Unicode, reading names as UTF-8 (e.g., 'é'\n"
+"            matches 'É' and 'σ' matches 'Σ' and 'ς').\n"
 "    * -l    Set a depth limit, e.g., recurse no more than 2 directories deep.\n"
 "    * -h    Display hidden files.\n"
-"    * -H    Display help/usage information\n");
+"    * -j, --jobs N\n"
+"            Use N threads where work can be split (default: one per CPU).\n"
+"    * -H    Display help/usage information\n"
+"    * --unique-inodes\n"
+"            Report each hard-linked file only once.\n"
+"    * --sizes[=N]\n"
+"            After the results, list the N (default 10) directories with the\n"
+"            most allocated bytes, including everything beneath them.\n"
+"    * --top N [--by size|mtime]\n"
+"            Only report the N largest (or most recently modified) matching\n"
+"            files, prefixed by their size in bytes (or mtime in seconds).\n"
+"    * --fuzzy PATTERN [--top N]\n"
+"            Print the N (default 20) entries whose names best match\n"
+"            PATTERN as a subsequence, as fzf(1) does, prefixed by their\n"
+"            score. Matching ignores case unless PATTERN has uppercase.\n"
+"    * --summary\n"
+"            Only print match counts by type, extension and depth.\n"
+"    * -0    Terminate each result with a NUL byte instead of a newline.\n"
+"    * --json\n"
+"            Print each result as a JSON object (path, type, size, mtime_ns).\n"
+"    * --format text|nul|json|binary\n"
+"            Select the output format. 'binary' writes fixed-size records\n"
+"            (see struct output_record) followed by the path.\n"
+"    * --sort name|path|size|mtime\n"
+"            Print the results ordered by file name, path, size (smallest\n"
+"            first) or modification time (oldest first), with ties in path\n"
+"            order. Path order is produced as the search goes, by sorting\n"
+"            each directory as it is read; the other orders are sorted on\n"
+"            -j threads once the search is done, spilling to temporary\n"
+"            files when there are too many results to hold in memory.\n"
+"    * --stats[=text|json]\n"
+"            Print what the search did to stderr: directories opened,\n"
+"            entries read, getdents calls and bytes, stat calls, matches,\n"
+"            bytes written and errors by errno, with latency percentiles\n"
+"            for opening directories, getdents and stat (timed on a sample\n"
+"            of the calls). Always searches the directory directly.\n"
+"    * --daemon\n"
+"            Index the directory, keep the index current with inotify, and\n"
+"            answer queries from other search commands over a Unix socket.\n"
+"            Searches use a running daemon automatically when they can.\n"
+"    * --no-daemon\n"
+"            Always scan the directory, even if a daemon is running.\n"
+"    * --socket PATH\n"
+"            Socket used by --daemon and its clients (default:\n"
+"            $XDG_RUNTIME_DIR/search.sock or /tmp/search-UID/search.sock).\n"
+"            Its directory must be yours and writable by no one else.\n"
+"    * --build-index FILE [--index-type trigram|sa]\n"
+"            Index every entry beneath the directory into FILE and exit.\n"
+"            Names are indexed by trigram (the default) or with a suffix\n"
+"            array, which is larger but fast for patterns of any length.\n"
+"    * --index FILE\n"
+"            Answer the search from an index built with --build-index.\n"
+"            The results reflect the tree as it was when FILE was built.\n"
+"    * --contains TEXT\n"
+"            Only report files whose contents include TEXT. Binary files\n"
+"            are skipped; files are read on -j threads.\n"
+"    * --duplicates\n"
+"            Print groups of identical files (of the matching files), largest\n"
+"            first. Files are compared by size, then by hashes of their first\n"
+"            and last 4 KiB, then by hashes of their whole contents.\n"
+"    * --manifest sha256|xxh64\n"
+"            Print a checksum and the path of each matching file, in the\n"
+"            format of sha256sum(1) or xxhsum(1). Files are hashed on -j\n"
+"            threads.\n"
+"    * --copy-to DIR\n"
+"            Copy each matching file to the same path beneath DIR instead\n"
+"            of printing it, on -j threads. Copies share the files' data\n"
+"            (reflinks) where the filesystem supports it.\n"
+"    * --exec COMMAND ... ;\n"
+"            Run COMMAND on each match instead of printing it, with every\n"
+"            argument that is exactly {} replaced by the path. The ';' ends\n"
+"            the command (quote it from the shell).\n"
+"    * --exec-batch COMMAND ... {} +\n"
+"            Run COMMAND with as many matches appended as fit within\n"
+"            ARG_MAX. Up to -j commands run at a time, while the search\n"
+"            goes on; the exit status is 1 if any of them fails.\n"
+"    * --cache FILE\n"
+"            Keep directory listings in FILE and reuse them for directories\n"
+"            whose mtime hasn't changed since an earlier search.\n"
+"    * --snapshot FILE\n"
+"            Record every entry beneath the directory in FILE.\n"
+"    * --diff FILE\n"
+"            Print the matching entries added (+), removed (-) or modified\n"
+"            (M) since the snapshot in FILE. With --snapshot, the new\n"
+"            snapshot is written in the same pass (FILE may be reused).\n");
     printf("\n");
 }
 
 
-int recursive_search(struct options *opts, char *directory, char *search_term, int depth) {
-    DIR *dir = opendir(directory);
-    if (dir == NULL) {
-        perror("opendir");
-        return 1;
+/**
+ * Hashes a string (FNV-1a).
+ */
+size_t string_hash(const char *str)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; ++str) {
+        hash ^= (unsigned char) *str;
+        hash *= 1099511628211ULL;
     }
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    return hash;
+}
+
+/**
+ * Offers a directory's final totals to the --sizes report. The path is only
+ * copied if the directory is heavy enough to be retained.
+ */
+void record_dir_usage(struct context *ctx, const struct search_entry *entry)
+{
+    if (!topk_accepts(&ctx->heaviest_dirs, entry->total_bytes)) {
+        return;
+    }
+    struct dir_report *report = malloc(sizeof(struct dir_report) + entry->path_len + 1);
+    if (report == NULL) {
+        perror("malloc");
+        return;
+    }
+    report->bytes = entry->total_bytes;
+    report->files = entry->total_files;
+    memcpy(report->path, entry->path, entry->path_len + 1);
+    free(topk_push(&ctx->heaviest_dirs, entry->total_bytes, report));
+}
+
+/**
+ * Prints the --sizes report, heaviest directory first: allocated bytes, number
+ * of files, and the directory path, separated by tabs.
+ */
+void print_dir_usage(struct context *ctx)
+{
+    size_t count = topk_sort(&ctx->heaviest_dirs);
+    for (size_t i = 0; i < count; ++i) {
+        struct dir_report *report = ctx->heaviest_dirs.items[i].data;
+        sink_printf(&ctx->out, "%llu\t%llu\t%s\n", (unsigned long long) report->bytes,
+                (unsigned long long) report->files, report->path);
+        free(report);
+    }
+    topk_destroy(&ctx->heaviest_dirs);
+}
+
+/**
+ * Writes an entry in the selected output format.
+ */
+void print_entry(struct context *ctx, const struct search_entry *entry)
+{
+    struct output_entry result = {
+        entry->path, entry->path_len, entry->type, entry->size, entry->mtime_ns
+    };
+    ctx->opts.format->write(&ctx->out, &result);
+}
+
+/**
+ * Reports a matching file: printed right away, or offered to the --top heap.
+ */
+void report_file(struct context *ctx, const struct search_entry *entry)
+{
+    if (ctx->opts.top_files == 0) {
+        print_entry(ctx, entry);
+        return;
+    }
+
+    /* Nanosecond resolution so files modified in the same second still order.
+     * Flipping the sign bit keeps times before 1970 below the later ones. */
+    unsigned long long key = ctx->opts.top_by_mtime
+        ? (unsigned long long) entry->mtime_ns ^ (1ULL << 63) : entry->size;
+    if (!topk_accepts(&ctx->top_files, key)) {
+        return;
+    }
+    struct top_file *file = malloc(sizeof(struct top_file) + entry->path_len + 1);
+    if (file == NULL) {
+        perror("malloc");
+        return;
+    }
+    file->size = entry->size;
+    file->mtime_ns = entry->mtime_ns;
+    file->path_len = entry->path_len;
+    memcpy(file->path, entry->path, entry->path_len + 1);
+    free(topk_push(&ctx->top_files, key, file));
+}
+
+/**
+ * Prints the --top report, largest (or newest) file first. The text format
+ * prefixes each path with its key; other formats carry the size and mtime in
+ * their own fields.
+ */
+void print_top_files(struct context *ctx)
+{
+    bool text = strcmp(ctx->opts.format->name, "text") == 0;
+    size_t count = topk_sort(&ctx->top_files);
+    for (size_t i = 0; i < count; ++i) {
+        struct top_file *file = ctx->top_files.items[i].data;
+        if (text) {
+            long long key = ctx->opts.top_by_mtime
+                ? file->mtime_ns / 1000000000LL : (long long) file->size;
+            sink_printf(&ctx->out, "%lld\t%s\n", key, file->path);
+        } else {
+            struct output_entry result = {
+                file->path, file->path_len, DT_REG, file->size, file->mtime_ns
+            };
+            ctx->opts.format->write(&ctx->out, &result);
         }
-        // stop recursing once we reach the max depth - if it is not specified then it won't stop
-        if (depth == opts->max_depth) {
-            return 0;
+        free(file);
+    }
+    topk_destroy(&ctx->top_files);
+}
+
+/**
+ * Prints a group of identical files. The text format separates groups with a
+ * blank line, like fdupes(1); other formats list each group's files in a row.
+ */
+void print_duplicates(void *arg, uint64_t size, const char *const *paths, size_t count)
+{
+    struct context *ctx = arg;
+    bool text = strcmp(ctx->opts.format->name, "text") == 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct output_entry result = { paths[i], strlen(paths[i]), DT_REG, size, 0 };
+        ctx->opts.format->write(&ctx->out, &result);
+    }
+    if (text) {
+        sink_printf(&ctx->out, "\n");
+    }
+}
+
+/**
+ * Finds the counter for a file extension in the --summary table, adding it if
+ * it has not been seen before.
+ */
+unsigned long long *tally_extension(struct tally *tally, const char *ext)
+{
+    if ((tally->ext_len + 1) * 2 > tally->ext_cap) {
+        size_t cap = tally->ext_cap == 0 ? 64 : tally->ext_cap * 2;
+        struct ext_count *exts = calloc(cap, sizeof(struct ext_count));
+        if (exts == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < tally->ext_cap; ++i) {
+            if (tally->exts[i].ext == NULL) {
+                continue;
+            }
+            size_t j = string_hash(tally->exts[i].ext) & (cap - 1);
+            while (exts[j].ext != NULL) {
+                j = (j + 1) & (cap - 1);
+            }
+            exts[j] = tally->exts[i];
+        }
+        free(tally->exts);
+        tally->exts = exts;
+        tally->ext_cap = cap;
+    }
+
+    size_t i = string_hash(ext) & (tally->ext_cap - 1);
+    while (tally->exts[i].ext != NULL) {
+        if (strcmp(tally->exts[i].ext, ext) == 0) {
+            return &tally->exts[i].count;
+        }
+        i = (i + 1) & (tally->ext_cap - 1);
+    }
+    tally->exts[i].ext = strdup(ext);
+    if (tally->exts[i].ext == NULL) {
+        return NULL;
+    }
+    tally->ext_len++;
+    return &tally->exts[i].count;
+}
+
+/**
+ * Counts a match for -c or --summary. Only the entry's name is needed.
+ */
+void tally_match(struct context *ctx, const struct search_entry *entry)
+{
+    int depth = entry->depth;
+    ctx->tally.matches++;
+    if (!ctx->opts.summary) {
+        return;
+    }
+
+    if (entry->type == DT_DIR) {
+        ctx->tally.dirs++;
+    } else {
+        ctx->tally.files++;
+        // dotfiles like .bashrc have no extension
+        const char *ext = strrchr(entry->name, '.');
+        if (ext == NULL || ext == entry->name) {
+            ext = "";
         }
-        // allocate memory
-        char *buf = malloc(strlen(directory) + strlen(entry->d_name) + strlen("/") + 1);
-        if (buf == NULL) {
+        unsigned long long *count = tally_extension(&ctx->tally, ext);
+        if (count == NULL) {
             perror("malloc");
-            break;
+        } else {
+            (*count)++;
+        }
+    }
+
+    if ((size_t) depth >= ctx->tally.depth_cap) {
+        size_t cap = ctx->tally.depth_cap == 0 ? 16 : ctx->tally.depth_cap * 2;
+        while (cap <= (size_t) depth) {
+            cap *= 2;
+        }
+        unsigned long long *depths = realloc(ctx->tally.depths, cap * sizeof(*depths));
+        if (depths == NULL) {
+            perror("realloc");
+            return;
         }
-        sprintf(buf, "%s/%s", directory, entry->d_name);
-        if (entry->d_type == DT_DIR) {
-            if (strstr(entry->d_name, search_term) != NULL && opts->show_dirs == true) {
-                printf("%s\n", buf);
+        memset(depths + ctx->tally.depth_cap, 0, (cap - ctx->tally.depth_cap) * sizeof(*depths));
+        ctx->tally.depths = depths;
+        ctx->tally.depth_cap = cap;
+    }
+    ctx->tally.depths[depth]++;
+}
+
+int compare_ext_counts(const void *a, const void *b)
+{
+    const struct ext_count *ea = a;
+    const struct ext_count *eb = b;
+    if (ea->count != eb->count) {
+        return ea->count < eb->count ? 1 : -1;
+    }
+    return strcmp(ea->ext, eb->ext);
+}
+
+/**
+ * Prints the -c count, or the --summary breakdown as tab-separated lines:
+ * "type", "ext" (most common first; empty for files without one) and "depth"
+ * (0 is the searched directory itself).
+ */
+void print_tally(struct context *ctx)
+{
+    if (!ctx->opts.summary) {
+        sink_printf(&ctx->out, "%llu\n", ctx->tally.matches);
+        return;
+    }
+
+    sink_printf(&ctx->out, "matches\t%llu\n", ctx->tally.matches);
+    sink_printf(&ctx->out, "type\tfile\t%llu\n", ctx->tally.files);
+    sink_printf(&ctx->out, "type\tdir\t%llu\n", ctx->tally.dirs);
+
+    size_t n = 0;
+    for (size_t i = 0; i < ctx->tally.ext_cap; ++i) {
+        if (ctx->tally.exts[i].ext != NULL) {
+            ctx->tally.exts[n++] = ctx->tally.exts[i];
+        }
+    }
+    qsort(ctx->tally.exts, n, sizeof(struct ext_count), compare_ext_counts);
+    for (size_t i = 0; i < n; ++i) {
+        sink_printf(&ctx->out, "ext\t%s\t%llu\n", ctx->tally.exts[i].ext, ctx->tally.exts[i].count);
+        free(ctx->tally.exts[i].ext);
+    }
+    free(ctx->tally.exts);
+
+    for (size_t i = 0; i < ctx->tally.depth_cap; ++i) {
+        if (ctx->tally.depths[i] > 0) {
+            sink_printf(&ctx->out, "depth\t%zu\t%llu\n", i, ctx->tally.depths[i]);
+        }
+    }
+    free(ctx->tally.depths);
+}
+
+/**
+ * Prints one latency histogram of the --stats text report.
+ */
+void print_latency_text(const char *name, const struct search_histogram *hist)
+{
+    if (hist->count == 0) {
+        return;
+    }
+    fprintf(stderr, "    %-10s %10llu %10llu %10llu %10llu %10llu %10llu\n", name,
+            (unsigned long long) hist->count,
+            (unsigned long long) (hist->total_ns / hist->count),
+            (unsigned long long) search_histogram_percentile(hist, 50),
+            (unsigned long long) search_histogram_percentile(hist, 90),
+            (unsigned long long) search_histogram_percentile(hist, 99),
+            (unsigned long long) hist->max_ns);
+}
+
+/**
+ * Prints one latency histogram of the --stats JSON report, with its non-empty
+ * buckets as [lowest value, count] pairs.
+ */
+void print_latency_json(const char *name, const struct search_histogram *hist)
+{
+    fprintf(stderr, "\"%s\":{\"sampled\":%llu,\"mean\":%llu,\"p50\":%llu,"
+            "\"p90\":%llu,\"p99\":%llu,\"max\":%llu,\"buckets\":[", name,
+            (unsigned long long) hist->count,
+            (unsigned long long) (hist->count == 0 ? 0 : hist->total_ns / hist->count),
+            (unsigned long long) search_histogram_percentile(hist, 50),
+            (unsigned long long) search_histogram_percentile(hist, 90),
+            (unsigned long long) search_histogram_percentile(hist, 99),
+            (unsigned long long) hist->max_ns);
+    const char *sep = "";
+    for (size_t i = 0; i < SEARCH_HIST_BUCKETS; ++i) {
+        if (hist->buckets[i] > 0) {
+            fprintf(stderr, "%s[%llu,%llu]", sep,
+                    (unsigned long long) search_histogram_bucket_start(i),
+                    (unsigned long long) hist->buckets[i]);
+            sep = ",";
+        }
+    }
+    fprintf(stderr, "]}");
+}
+
+/**
+ * Names an errno value for --stats, e.g., "EACCES". Slot 0 of the counts
+ * holds every value the library doesn't count separately.
+ */
+const char *errno_name(int err)
+{
+    const char *name = err == 0 ? NULL : strerrorname_np(err);
+    return name == NULL ? "other" : name;
+}
+
+/**
+ * Prints the --stats report to stderr, as aligned text or as one JSON object.
+ * 'written' is the number of bytes of results written to stdout.
+ */
+void print_stats(const struct search_stats *stats, uint64_t written, bool json)
+{
+    const struct {
+        const char *name;
+        uint64_t value;
+    } counters[] = {
+        { "dirs_opened", stats->dirs_opened },
+        { "dirs_cached", stats->dirs_cached },
+        { "entries_read", stats->entries_read },
+        { "getdents_calls", stats->getdents_calls },
+        { "getdents_bytes", stats->getdents_bytes },
+        { "stat_calls", stats->stat_calls },
+        { "matches", stats->matches },
+        { "bytes_written", written },
+        { "errors", stats->errors },
+    };
+    size_t count = sizeof(counters) / sizeof(counters[0]);
+
+    if (!json) {
+        for (size_t i = 0; i < count; ++i) {
+            fprintf(stderr, "%-16s %12llu\n", counters[i].name,
+                    (unsigned long long) counters[i].value);
+        }
+        for (int err = 0; err < SEARCH_ERRNO_MAX; ++err) {
+            if (stats->errors_by_errno[err] > 0) {
+                fprintf(stderr, "    %-12s %12llu\n", errno_name(err),
+                        (unsigned long long) stats->errors_by_errno[err]);
             }
-            // increase depth by 1 each time we make a recursive call
-            recursive_search(opts, buf, search_term, depth + 1);
-        // if d_type is a file and show_files is true
-        } else if (entry->d_type == DT_REG && opts->show_files == true) {
-            // don't print a hidden file if show_hidden is false
-            if (opts->show_hidden == false && entry->d_name[0] == '.') {
-                continue;
+        }
+        fprintf(stderr, "latency_ns    %10s %10s %10s %10s %10s %10s\n",
+                "sampled", "mean", "p50", "p90", "p99", "max");
+        print_latency_text("opendir", &stats->opendir_ns);
+        print_latency_text("getdents", &stats->getdents_ns);
+        print_latency_text("stat", &stats->stat_ns);
+        return;
+    }
+
+    fprintf(stderr, "{");
+    for (size_t i = 0; i < count; ++i) {
+        fprintf(stderr, "\"%s\":%llu,", counters[i].name,
+                (unsigned long long) counters[i].value);
+    }
+    fprintf(stderr, "\"errors_by_errno\":{");
+    const char *sep = "";
+    for (int err = 0; err < SEARCH_ERRNO_MAX; ++err) {
+        if (stats->errors_by_errno[err] > 0) {
+            fprintf(stderr, "%s\"%s\":%llu", sep, errno_name(err),
+                    (unsigned long long) stats->errors_by_errno[err]);
+            sep = ",";
+        }
+    }
+    fprintf(stderr, "},\"latency_ns\":{");
+    print_latency_json("opendir", &stats->opendir_ns);
+    fprintf(stderr, ",");
+    print_latency_json("getdents", &stats->getdents_ns);
+    fprintf(stderr, ",");
+    print_latency_json("stat", &stats->stat_ns);
+    fprintf(stderr, "}}\n");
+}
+
+/**
+ * Scores an entry's name for --fuzzy and offers it to the heap of best
+ * matches. Names without the pattern's characters are rejected before any
+ * scoring is done.
+ */
+void offer_fuzzy(struct context *ctx, const struct search_entry *entry)
+{
+    if (!fuzzy_prefilter(&ctx->fuzzy, entry->name, entry->name_len)) {
+        return;
+    }
+    int score = fuzzy_score(&ctx->fuzzy, entry->name, entry->name_len);
+    if (score < 0) {
+        return;
+    }
+    // best score first, then the shortest path
+    uint32_t len = entry->path_len < UINT32_MAX ? entry->path_len : UINT32_MAX;
+    unsigned long long key = (unsigned long long) score << 32 | (UINT32_MAX - len);
+    if (!topk_accepts(&ctx->fuzzy_matches, key)) {
+        return;
+    }
+    struct fuzzy_match *match = malloc(sizeof(struct fuzzy_match) + entry->path_len + 1);
+    if (match == NULL) {
+        perror("malloc");
+        return;
+    }
+    match->score = score;
+    match->type = entry->type;
+    match->size = entry->size;
+    match->mtime_ns = entry->mtime_ns;
+    match->path_len = entry->path_len;
+    memcpy(match->path, entry->path, entry->path_len + 1);
+    free(topk_push(&ctx->fuzzy_matches, key, match));
+}
+
+/**
+ * Prints the --fuzzy report, best match first. As with --top, the text format
+ * prefixes each path with its key (the score).
+ */
+void print_fuzzy_matches(struct context *ctx)
+{
+    bool text = strcmp(ctx->opts.format->name, "text") == 0;
+    size_t count = topk_sort(&ctx->fuzzy_matches);
+    for (size_t i = 0; i < count; ++i) {
+        struct fuzzy_match *match = ctx->fuzzy_matches.items[i].data;
+        if (text) {
+            sink_printf(&ctx->out, "%d\t%s\n", match->score, match->path);
+        } else {
+            struct output_entry result = {
+                match->path, match->path_len, match->type, match->size, match->mtime_ns
+            };
+            ctx->opts.format->write(&ctx->out, &result);
+        }
+        free(match);
+    }
+    topk_destroy(&ctx->fuzzy_matches);
+}
+
+/**
+ * Writes an entry coming out of --sort.
+ */
+int print_sorted(void *arg, const struct output_entry *entry)
+{
+    struct context *ctx = arg;
+    ctx->opts.format->write(&ctx->out, entry);
+    return 0;
+}
+
+/**
+ * Handles an entry produced by the search.
+ */
+void report_match(struct context *ctx, const struct search_entry *entry)
+{
+    if (entry->leaving) {
+        record_dir_usage(ctx, entry);
+    } else if (ctx->exec != NULL) {
+        if (exec_add(ctx->exec, entry->path, entry->path_len) == -1) {
+            perror("malloc");
+        }
+    } else if (ctx->dupes != NULL) {
+        if (entry->type == DT_REG
+                && dupes_add(ctx->dupes, entry->path, entry->path_len, entry->size) == -1) {
+            perror("malloc");
+        }
+    } else if (ctx->opts.fuzzy != NULL) {
+        offer_fuzzy(ctx, entry);
+    } else if (ctx->sorter != NULL) {
+        struct output_entry result = {
+            entry->path, entry->path_len, entry->type, entry->size, entry->mtime_ns
+        };
+        if (sorter_add(ctx->sorter, &result) == -1) {
+            perror("sort");
+        }
+    } else if (ctx->opts.count_only || ctx->opts.summary) {
+        tally_match(ctx, entry);
+    } else if (entry->type == DT_DIR) {
+        // --top only ranks files, so directories are left out of its report
+        if (ctx->opts.top_files == 0) {
+            print_entry(ctx, entry);
+        }
+    } else {
+        report_file(ctx, entry);
+    }
+}
+
+/**
+ * Checks whether the --copy-to directory lies within the searched one, where
+ * the search would find (and copy again) its own copies. The destination may
+ * not exist yet, so its deepest existing ancestor is resolved instead.
+ */
+bool copy_dest_inside(const char *dest, const char *root)
+{
+    char *real_root = realpath(root, NULL);
+    if (real_root == NULL) {
+        // the search itself reports the missing directory
+        return false;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dest);
+    char *real_dest;
+    while ((real_dest = realpath(path, NULL)) == NULL && errno == ENOENT) {
+        char *slash = strrchr(path, '/');
+        if (slash == NULL) {
+            strcpy(path, ".");
+        } else {
+            slash[slash == path ? 1 : 0] = '\0';
+        }
+    }
+    size_t len = strlen(real_root);
+    bool inside = real_dest != NULL && strncmp(real_dest, real_root, len) == 0
+        && (real_dest[len] == '/' || real_dest[len] == '\0' || real_root[len - 1] == '/');
+    free(real_dest);
+    free(real_root);
+    return inside;
+}
+
+/**
+ * Copies a file to the same place beneath the --copy-to directory as it has
+ * beneath the searched one.
+ *
+ * @return 0 on success, or -1 on error (reported to stderr).
+ */
+int copy_out(struct file_work *work, const struct search_entry *entry, char *buffer)
+{
+    const char *dest_root = work->ctx->opts.copy_to;
+    const char *relative = entry->path + work->root_len + 1;
+    size_t root_len = strlen(dest_root);
+    size_t relative_len = entry->path_len - work->root_len - 1;
+    char *dest = malloc(root_len + relative_len + 2);
+    if (dest == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(dest, dest_root, root_len);
+    dest[root_len] = '/';
+    memcpy(dest + root_len + 1, relative, relative_len + 1);
+
+    int method = copy_file(entry->path, dest, buffer);
+    if (method == -1) {
+        fprintf(stderr, "%s -> %s: %s\n", entry->path, dest, strerror(errno));
+    } else {
+        __atomic_fetch_add(&work->copies[method], 1, __ATOMIC_RELAXED);
+    }
+    free(dest);
+    return method == -1 ? -1 : 0;
+}
+
+/**
+ * Checks the contents of one file in a batch, computes its checksum for
+ * --manifest and copies it for --copy-to. Runs on the pool's threads.
+ */
+void work_on_file(void *arg, size_t worker, size_t index)
+{
+    struct file_work *work = arg;
+    struct context *ctx = work->ctx;
+    const struct search_entry *entry = &work->entries[index];
+    work->hits[index] = false;
+    if (entry->leaving || entry->type != DT_REG) {
+        return;
+    }
+    if (work->pattern != NULL) {
+        int rc = contents_match(entry->path, work->pattern, work->pattern_len,
+                work->buffers[worker]);
+        if (rc != 1) {
+            if (rc == -1) {
+                perror(entry->path);
+                __atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
             }
-            else if (strstr(entry->d_name, search_term) != NULL) {  
-                if (opts->exact_match == true) {
-                    if (strcmp(search_term, entry->d_name) == 0) {
-                        printf("%s\n", buf);
-                    }
-                } else {
-                    printf("%s\n", buf);
-                }
+            return;
+        }
+    }
+    if (ctx->opts.manifest && hash_file(entry->path, ctx->opts.manifest_type,
+                work->buffers[worker], work->digests[index]) == -1) {
+        perror(entry->path);
+        __atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    if (ctx->opts.copy_to != NULL
+            && copy_out(work, entry, work->buffers[worker]) == -1) {
+        __atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    work->hits[index] = true;
+}
+
+/**
+ * Prints a --manifest line as sha256sum does: two spaces between the digest
+ * and the path, and a path holding a newline or backslash escaped with a
+ * leading backslash, so sha256sum -c reads it back.
+ */
+void print_manifest_line(struct context *ctx, const char *digest,
+        const char *path, size_t path_len)
+{
+    if (strpbrk(path, "\\\n") == NULL) {
+        sink_printf(&ctx->out, "%s  %s\n", digest, path);
+        return;
+    }
+    sink_printf(&ctx->out, "\\%s  ", digest);
+    char *dest = sink_reserve(&ctx->out, path_len * 2 + 1);
+    if (dest == NULL) {
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < path_len; ++i) {
+        if (path[i] == '\n') {
+            dest[len++] = '\\';
+            dest[len++] = 'n';
+        } else if (path[i] == '\\') {
+            dest[len++] = '\\';
+            dest[len++] = '\\';
+        } else {
+            dest[len++] = path[i];
+        }
+    }
+    dest[len++] = '\n';
+    sink_commit(&ctx->out, len);
+}
+
+/**
+ * Receives a batch of entries from search_run().
+ */
+int report_batch(void *arg, const struct search_entry *entries, size_t count)
+{
+    struct context *ctx = arg;
+    struct file_work *work = ctx->work;
+    if (work == NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            report_match(ctx, &entries[i]);
+        }
+        return 0;
+    }
+
+    /* The whole batch is worked on in parallel, then reported in order. */
+    for (size_t start = 0; start < count; start += SEARCH_BATCH_SIZE) {
+        size_t n = count - start < SEARCH_BATCH_SIZE ? count - start : SEARCH_BATCH_SIZE;
+        work->entries = entries + start;
+        pool_run(ctx->pool, n, work_on_file, work);
+        for (size_t i = 0; i < n; ++i) {
+            const struct search_entry *entry = &entries[start + i];
+            if (entry->leaving) {
+                report_match(ctx, entry);
+            } else if (work->hits[i] && ctx->opts.manifest) {
+                print_manifest_line(ctx, work->digests[i], entry->path, entry->path_len);
+            } else if (work->hits[i] && ctx->opts.copy_to == NULL) {
+                report_match(ctx, entry);
             }
         }
-        free(buf);
     }
-    closedir(dir);
     return 0;
 }
 
+/**
+ * Sets up the buffers for --contains, --manifest and --copy-to, for a search
+ * of 'root'.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+int start_file_work(struct context *ctx, const char *root)
+{
+    struct file_work *work = calloc(1, sizeof(struct file_work));
+    if (work == NULL) {
+        return -1;
+    }
+    ctx->work = work;
+    work->ctx = ctx;
+    work->root_len = strlen(root);
+    if (ctx->opts.contains != NULL) {
+        work->pattern = ctx->opts.contains;
+        work->pattern_len = strlen(ctx->opts.contains);
+    }
+    work->buffers = calloc(pool_size(ctx->pool), sizeof(char *));
+    if (work->buffers == NULL) {
+        return -1;
+    }
+    work->buffer_count = pool_size(ctx->pool);
+    size_t size = HASH_READ_SIZE;
+    if (size < CONTENTS_MMAP_MIN) {
+        size = CONTENTS_MMAP_MIN;
+    }
+    if (size < COPY_BUFFER_SIZE) {
+        size = COPY_BUFFER_SIZE;
+    }
+    for (size_t i = 0; i < work->buffer_count; ++i) {
+        work->buffers[i] = malloc(size);
+        if (work->buffers[i] == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void stop_file_work(struct context *ctx)
+{
+    struct file_work *work = ctx->work;
+    if (work == NULL) {
+        return;
+    }
+    if (ctx->opts.copy_to != NULL) {
+        LOG("Copied %lu files by reflink, %lu with copy_file_range, "
+                "%lu with sendfile and %lu with read/write\n",
+                work->copies[COPY_CLONE], work->copies[COPY_RANGE],
+                work->copies[COPY_SENDFILE], work->copies[COPY_READ_WRITE]);
+    }
+    for (size_t i = 0; i < work->buffer_count; ++i) {
+        free(work->buffers[i]);
+    }
+    free(work->buffers);
+    free(work);
+    ctx->work = NULL;
+}
 
+/**
+ * Searches a directory with the search library and reports what it finds.
+ */
+int recursive_search(struct context *ctx, char *directory, char *search_term)
+{
+    ctx->opts.search.pattern = search_term;
+    bool sort_by_stat = ctx->opts.sort
+        && (ctx->opts.sort_key == SORT_SIZE || ctx->opts.sort_key == SORT_MTIME);
+    if (ctx->opts.format->needs_stat || ctx->opts.top_files > 0 || ctx->opts.duplicates
+            || sort_by_stat) {
+        ctx->opts.search.flags |= SEARCH_STAT;
+    }
+    if (ctx->opts.sizes_top > 0) {
+        ctx->opts.search.flags |= SEARCH_DIR_TOTALS;
+    } else if ((ctx->opts.count_only || ctx->opts.summary) && ctx->work == NULL) {
+        // counting only needs names, so paths are not tracked at all
+        ctx->opts.search.flags |= SEARCH_NO_PATHS;
+    }
+    if (ctx->opts.sort && ctx->opts.sort_key == SORT_PATH) {
+        // directories sorted as they are read give path order without a buffer
+        ctx->opts.search.flags |= SEARCH_SORTED;
+    }
+
+    /* Index files and the daemon only know names and types, so they can answer
+     * queries that don't need stat() data, inode numbers or sorted listings.
+     * --stats is about the traversal, so there has to be one. Matches that are
+     * read, copied or handed to --exec come from the tree itself, never from
+     * an answer that may be stale. */
+    bool names_only = !ctx->opts.search.unique_inodes
+        && ctx->opts.sizes_top == 0 && ctx->opts.top_files == 0 && !ctx->opts.duplicates
+        && !ctx->opts.format->needs_stat && !ctx->opts.sort && !ctx->opts.stats
+        && ctx->opts.exec_argv == NULL && ctx->work == NULL;
+    if (ctx->index != NULL) {
+        if (names_only && index_query(ctx->index, directory, &ctx->opts.search,
+                    report_batch, ctx) == 0) {
+            return 0;
+        }
+        LOG("Index %s can't answer this query; searching directly\n",
+                ctx->opts.index_path);
+    }
+    if (names_only && !ctx->opts.no_daemon) {
+        // -1 means there's no answer at all, so the tree is searched instead
+        int rc = daemon_query(ctx->opts.socket_path, directory, &ctx->opts.search,
+                report_batch, ctx);
+        if (rc != -1) {
+            return rc;
+        }
+    }
+
+    if (search_run(directory, &ctx->opts.search, report_batch, ctx) == -1) {
+        perror("opendir");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Prints a change reported by snapshot_diff() if the entry matches the search.
+ */
+int report_change(void *arg, enum snapshot_change change, const struct search_entry *entry)
+{
+    struct context *ctx = arg;
+    int max_depth = ctx->opts.search.max_depth;
+    if ((max_depth < 0 || entry->depth < max_depth)
+            && search_match(&ctx->opts.search, entry->name, entry->type)) {
+        sink_printf(&ctx->out, "%c %s\n", change, entry->path);
+    }
+    return 0;
+}
+
+/**
+ * Writes a snapshot of a directory and/or reports its changes since an older
+ * one. Snapshots always record the whole tree; the search only filters the
+ * changes that are printed.
+ */
+int compare_snapshot(struct context *ctx, char *directory, char *search_term)
+{
+    ctx->opts.search.pattern = search_term;
+    if (snapshot_diff(directory, ctx->opts.diff_path, ctx->opts.snapshot_path,
+                ctx->opts.diff_path != NULL ? report_change : NULL, ctx) != 0) {
+        perror("snapshot");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Takes the command of --exec or --exec-batch out of argv, up to its closing
+ * ';' or '+', so getopt never sees (or reorders) the command's own options.
+ *
+ * @return 0 on success, or -1 if the command is malformed.
+ */
+int take_exec_command(int *argc, char *argv[], struct options *opts)
+{
+    for (int i = 1; i < *argc && strcmp(argv[i], "--") != 0; ++i) {
+        bool batch = strcmp(argv[i], "--exec-batch") == 0;
+        if (!batch && strcmp(argv[i], "--exec") != 0) {
+            continue;
+        }
+        const char *end = batch ? "+" : ";";
+        int j = i + 1;
+        while (j < *argc && strcmp(argv[j], end) != 0) {
+            j++;
+        }
+        if (opts->exec_argv != NULL) {
+            fprintf(stderr, "Only one --exec or --exec-batch can be given.\n");
+            return -1;
+        }
+        if (j == *argc || j == i + 1) {
+            fprintf(stderr, "%s needs a command ending in '%s'.\n", argv[i], end);
+            return -1;
+        }
+        if (batch && strcmp(argv[j - 1], "{}") != 0) {
+            fprintf(stderr, "--exec-batch needs {} right before '+'.\n");
+            return -1;
+        }
+
+        /* The command's words are moved to the end of argv, past the
+         * arguments getopt looks at. */
+        int len = j - i - 1;
+        char *words[len];
+        memcpy(words, &argv[i + 1], len * sizeof(char *));
+        memmove(&argv[i], &argv[j + 1], (*argc - j - 1) * sizeof(char *));
+        *argc -= len + 2;
+        memcpy(&argv[*argc], words, len * sizeof(char *));
+        argv[*argc + len] = NULL;
+        opts->exec_argv = &argv[*argc];
+        opts->exec_argc = len;
+        opts->exec_batch = batch;
+        i--;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
 
-    struct options opts;
-    opts = default_options;
+    struct options opts = { 0 };
+    search_opts_init(&opts.search);
+    opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.format = output_formatter_find("text");
     int c;
     opterr = 0;
+    if (take_exec_command(&argc, argv, &opts) == -1) {
+        print_usage(argv[0]);
+        return 1;
+    }
 
-    while ((c = getopt(argc, argv, "defhHl:")) != -1) {
+    static struct option long_options[] = {
+        { "unique-inodes", no_argument, NULL, 'U' },
+        { "sizes", optional_argument, NULL, 'S' },
+        { "top", required_argument, NULL, 'T' },
+        { "by", required_argument, NULL, 'B' },
+        { "summary", no_argument, NULL, 'Y' },
+        { "json", no_argument, NULL, 'J' },
+        { "format", required_argument, NULL, 'F' },
+        { "daemon", no_argument, NULL, 'D' },
+        { "no-daemon", no_argument, NULL, 'N' },
+        { "socket", required_argument, NULL, 'P' },
+        { "build-index", required_argument, NULL, 'I' },
+        { "index", required_argument, NULL, 'X' },
+        { "index-type", required_argument, NULL, 'K' },
+        { "snapshot", required_argument, NULL, 'W' },
+        { "diff", required_argument, NULL, 'V' },
+        { "cache", required_argument, NULL, 'C' },
+        { "contains", required_argument, NULL, 'G' },
+        { "duplicates", no_argument, NULL, 'E' },
+        { "manifest", required_argument, NULL, 'M' },
+        { "copy-to", required_argument, NULL, 'O' },
+        { "sort", required_argument, NULL, 'Q' },
+        { "fuzzy", required_argument, NULL, 'Z' },
+        { "unicode-fold", no_argument, NULL, 'L' },
+        { "ext", required_argument, NULL, 'A' },
+        { "stats", optional_argument, NULL, 'R' },
+        { "jobs", required_argument, NULL, 'j' },
+        { 0 },
+    };
+
+    while ((c = getopt_long(argc, argv, "0cdefhHij:l:", long_options, NULL)) != -1) {
         switch (c) {
+            case '0':
+                opts.format = output_formatter_find("nul");
+                break;
+            case 'c':
+                opts.count_only = true;
+                break;
             case 'd':
-                opts.show_files = false;
+                opts.search.show_files = false;
                 break;
             case 'H':
                 print_usage(argv[0]);
                 return 1;
             case 'h':
-                opts.show_hidden = true;
+                opts.search.show_hidden = true;
                 break;
             case 'e':
-                opts.exact_match = true;
+                opts.search.exact_match = true;
                 break;
             case 'f':
-                opts.show_dirs = false;
+                opts.search.show_dirs = false;
+                break;
+            case 'i':
+                opts.search.ignore_case = true;
+                break;
+            case 'L':
+                opts.search.unicode_fold = true;
+                break;
+            case 'A':
+                opts.extensions = optarg;
+                // only files have extensions
+                opts.search.show_dirs = false;
+                break;
+            case 'R':
+                if (optarg != NULL && strcmp(optarg, "json") == 0) {
+                    opts.stats_json = true;
+                } else if (optarg != NULL && strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "Unknown --stats format '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                opts.stats = true;
+                opts.search.flags |= SEARCH_TIMING;
                 break;
             case 'l': {
                 char *num_string = optarg;
@@ -132,11 +1224,146 @@ int main(int argc, char *argv[]) {
                         print_usage(argv[0]);
                         return 1;
             }
-                opts.max_depth = depth_limit;
+                opts.search.max_depth = depth_limit;
             }
                 break;
+            case 'j':
+                opts.jobs = atoi(optarg);
+                if (opts.jobs <= 0) {
+                    fprintf(stderr, "Invalid number of jobs\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'U':
+                opts.search.unique_inodes = true;
+                break;
+            case 'S':
+                opts.sizes_top = optarg == NULL ? 10 : atoi(optarg);
+                if (opts.sizes_top <= 0) {
+                    fprintf(stderr, "Invalid number of directories for --sizes\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'T':
+                opts.top_files = atoi(optarg);
+                if (opts.top_files <= 0) {
+                    fprintf(stderr, "Invalid number of files for --top\n");
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'B':
+                if (strcmp(optarg, "size") == 0) {
+                    opts.top_by_mtime = false;
+                } else if (strcmp(optarg, "mtime") == 0) {
+                    opts.top_by_mtime = true;
+                } else {
+                    fprintf(stderr, "Unknown --by key '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'Y':
+                opts.summary = true;
+                break;
+            case 'D':
+                opts.serve = true;
+                break;
+            case 'N':
+                opts.no_daemon = true;
+                break;
+            case 'P':
+                opts.socket_path = optarg;
+                break;
+            case 'I':
+                opts.build_index = optarg;
+                break;
+            case 'X':
+                opts.index_path = optarg;
+                break;
+            case 'K':
+                if (strcmp(optarg, "trigram") == 0) {
+                    opts.index_type = INDEX_TRIGRAMS;
+                } else if (strcmp(optarg, "sa") == 0) {
+                    opts.index_type = INDEX_SUFFIX_ARRAY;
+                } else {
+                    fprintf(stderr, "Unknown --index-type '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'W':
+                opts.snapshot_path = optarg;
+                break;
+            case 'V':
+                opts.diff_path = optarg;
+                break;
+            case 'C':
+                opts.cache_path = optarg;
+                break;
+            case 'G':
+                opts.contains = optarg;
+                // only files have contents
+                opts.search.show_dirs = false;
+                break;
+            case 'E':
+                opts.duplicates = true;
+                break;
+            case 'M':
+                if (strcmp(optarg, "sha256") == 0) {
+                    opts.manifest_type = HASH_SHA256;
+                } else if (strcmp(optarg, "xxh64") == 0) {
+                    opts.manifest_type = HASH_XXH64;
+                } else {
+                    fprintf(stderr, "Unknown --manifest hash '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                opts.manifest = true;
+                // only files have contents
+                opts.search.show_dirs = false;
+                break;
+            case 'O':
+                opts.copy_to = optarg;
+                // directories are created as files are copied into them
+                opts.search.show_dirs = false;
+                break;
+            case 'Q':
+                if (strcmp(optarg, "name") == 0) {
+                    opts.sort_key = SORT_NAME;
+                } else if (strcmp(optarg, "path") == 0) {
+                    opts.sort_key = SORT_PATH;
+                } else if (strcmp(optarg, "size") == 0) {
+                    opts.sort_key = SORT_SIZE;
+                } else if (strcmp(optarg, "mtime") == 0) {
+                    opts.sort_key = SORT_MTIME;
+                } else {
+                    fprintf(stderr, "Unknown --sort key '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                opts.sort = true;
+                break;
+            case 'Z':
+                opts.fuzzy = optarg;
+                break;
+            case 'J':
+                opts.format = output_formatter_find("json");
+                break;
+            case 'F':
+                opts.format = output_formatter_find(optarg);
+                if (opts.format == NULL) {
+                    fprintf(stderr, "Unknown output format '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
             case '?':
-                if (optopt == 's') {
+                if (optopt == 0) {
+                    fprintf(stderr, "Unknown option '%s'.\n", argv[optind - 1]);
+                } else if (optopt == 's') {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 } else if (isprint(optopt)) {
                     fprintf(stderr, "Unknown option '-%c'.\n", optopt);
@@ -150,6 +1377,62 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if ((opts.count_only || opts.summary || opts.duplicates || opts.manifest
+                || opts.exec_argv != NULL || opts.copy_to != NULL || opts.sort)
+            && opts.fuzzy != NULL) {
+        fprintf(stderr, "--fuzzy cannot be combined with -c, --summary, --duplicates, "
+                "--manifest, --exec, --copy-to or --sort.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (opts.fuzzy != NULL) {
+        // --top sets how many matches are kept, instead of ranking by size
+        opts.fuzzy_results = opts.top_files > 0 ? opts.top_files : 20;
+        opts.top_files = 0;
+    }
+    if ((opts.count_only || opts.summary) && opts.top_files > 0) {
+        fprintf(stderr, "--top cannot be combined with -c or --summary.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.count_only || opts.summary || opts.top_files > 0) && opts.duplicates) {
+        fprintf(stderr, "--duplicates cannot be combined with -c, --summary or --top.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.count_only || opts.summary || opts.top_files > 0 || opts.duplicates)
+            && opts.manifest) {
+        fprintf(stderr, "--manifest cannot be combined with -c, --summary, --top or --duplicates.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.count_only || opts.summary || opts.top_files > 0 || opts.duplicates
+                || opts.manifest) && opts.exec_argv != NULL) {
+        fprintf(stderr, "--exec cannot be combined with -c, --summary, --top, --duplicates or --manifest.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.count_only || opts.summary || opts.top_files > 0 || opts.duplicates
+                || opts.exec_argv != NULL) && opts.copy_to != NULL) {
+        fprintf(stderr, "--copy-to cannot be combined with -c, --summary, --top, --duplicates or --exec.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.count_only || opts.summary || opts.top_files > 0 || opts.duplicates
+                || opts.manifest || opts.exec_argv != NULL || opts.copy_to != NULL)
+            && opts.sort) {
+        fprintf(stderr, "--sort cannot be combined with -c, --summary, --top, --duplicates, "
+                "--manifest, --exec or --copy-to.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((opts.snapshot_path != NULL || opts.diff_path != NULL) && opts.stats) {
+        // snapshots are taken with their own traversal, which keeps no counters
+        fprintf(stderr, "--stats cannot be combined with --snapshot or --diff.\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
     /* Default values. We search the current working directory (CWD) '.', and
      * provide an empty search string (no filtering applied). */
     char *dir = ".";
@@ -170,13 +1453,164 @@ int main(int argc, char *argv[]) {
     }
 
     LOG("Starting search. Directory: %s; Search pattern: %s\n", dir, search);
-    LOG("Depth limit: %d; Exact match %s; Show files %s; Show dirs %s; Show hidden %s\n",
-            opts.max_depth,
-            opts.exact_match ? "ON" : "OFF",
-            opts.show_files ? "ON" : "OFF",
-            opts.show_dirs ? "ON" : "OFF",
-            opts.show_hidden ? "ON" : "OFF");
-
-    // by default pass in 0 as the depth because if depth isn't specified it wont matter
-    return recursive_search(&opts, dir, search, 0);
+    LOG("Depth limit: %d; Exact match %s; Ignore case %s; Show files %s; Show dirs %s; Show hidden %s\n",
+            opts.search.max_depth,
+            opts.search.exact_match ? "ON" : "OFF",
+            opts.search.unicode_fold ? "UNICODE" : opts.search.ignore_case ? "ON" : "OFF",
+            opts.search.show_files ? "ON" : "OFF",
+            opts.search.show_dirs ? "ON" : "OFF",
+            opts.search.show_hidden ? "ON" : "OFF");
+    LOG("Unique inodes %s; Sizes report %d; Top files %d by %s; Count %s; Summary %s\n",
+            opts.search.unique_inodes ? "ON" : "OFF", opts.sizes_top,
+            opts.top_files, opts.top_by_mtime ? "mtime" : "size",
+            opts.count_only ? "ON" : "OFF", opts.summary ? "ON" : "OFF");
+    LOG("Output format: %s\n", opts.format->name);
+
+    char default_socket[PATH_MAX];
+    if (opts.socket_path == NULL) {
+        daemon_default_socket(default_socket, sizeof(default_socket));
+        opts.socket_path = default_socket;
+    }
+    if (opts.serve) {
+        return daemon_serve(opts.socket_path, dir);
+    }
+    if (opts.build_index != NULL) {
+        struct search_stats stats = { 0 };
+        if (index_build(dir, opts.build_index, opts.index_type, opts.jobs,
+                    opts.stats ? &stats : NULL) == -1) {
+            perror("index");
+            return 1;
+        }
+        if (opts.stats) {
+            print_stats(&stats, 0, opts.stats_json);
+        }
+        return 0;
+    }
+
+    struct context ctx = { .opts = opts };
+    if (opts.stats) {
+        ctx.opts.search.stats = &ctx.stats;
+    }
+    if (opts.index_path != NULL) {
+        ctx.index = index_open(opts.index_path);
+        if (ctx.index == NULL) {
+            perror(opts.index_path);
+            return 1;
+        }
+    }
+    if (opts.cache_path != NULL) {
+        ctx.opts.search.cache = dircache_open(opts.cache_path);
+        if (ctx.opts.search.cache == NULL) {
+            perror(opts.cache_path);
+            return 1;
+        }
+    }
+    if (opts.extensions != NULL) {
+        ctx.opts.search.extensions = ext_set_create(opts.extensions,
+                opts.search.ignore_case || opts.search.unicode_fold);
+        if (ctx.opts.search.extensions == NULL) {
+            perror("--ext");
+            return 1;
+        }
+    }
+    bool file_work = opts.contains != NULL || opts.manifest || opts.copy_to != NULL;
+    if (opts.copy_to != NULL && copy_dest_inside(opts.copy_to, dir)) {
+        // like cp -r, which won't copy a directory into itself
+        fprintf(stderr, "--copy-to directory %s is inside %s.\n", opts.copy_to, dir);
+        return 1;
+    }
+    bool buffered_sort = opts.sort && opts.sort_key != SORT_PATH;
+    if ((file_work || opts.duplicates || buffered_sort)
+            && (ctx.pool = pool_create(opts.jobs)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (file_work && start_file_work(&ctx, dir) == -1) {
+        perror("malloc");
+        return 1;
+    }
+    if (opts.exec_argv != NULL && (ctx.exec = exec_create(opts.exec_argv,
+                    opts.exec_argc, opts.exec_batch, opts.jobs)) == NULL) {
+        perror("exec");
+        return 1;
+    }
+    if (buffered_sort && (ctx.sorter = sorter_create(opts.sort_key, SORT_MEM_LIMIT,
+                    ctx.pool)) == NULL) {
+        perror("sort");
+        return 1;
+    }
+    if (opts.duplicates && (ctx.dupes = dupes_create()) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (opts.sizes_top > 0 && topk_init(&ctx.heaviest_dirs, opts.sizes_top) == -1) {
+        perror("malloc");
+        return 1;
+    }
+    if (opts.fuzzy != NULL && (fuzzy_init(&ctx.fuzzy, opts.fuzzy) == -1
+                || topk_init(&ctx.fuzzy_matches, opts.fuzzy_results) == -1)) {
+        perror("malloc");
+        return 1;
+    }
+    if (opts.top_files > 0 && topk_init(&ctx.top_files, opts.top_files) == -1) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (sink_init(&ctx.out, STDOUT_FILENO, SINK_BUFFER_SIZE) == -1) {
+        perror("malloc");
+        return 1;
+    }
+
+    int result;
+    if (opts.snapshot_path != NULL || opts.diff_path != NULL) {
+        result = compare_snapshot(&ctx, dir, search);
+    } else {
+        result = recursive_search(&ctx, dir, search);
+    }
+    if (ctx.sorter != NULL && sorter_finish(ctx.sorter, print_sorted, &ctx) == -1) {
+        perror("sort");
+        result = 1;
+    }
+    if (ctx.exec != NULL && exec_finish(ctx.exec) != 0) {
+        result = 1;
+    }
+    if (opts.count_only || opts.summary) {
+        print_tally(&ctx);
+    }
+    if (opts.fuzzy != NULL) {
+        print_fuzzy_matches(&ctx);
+        fuzzy_destroy(&ctx.fuzzy);
+    }
+    if (opts.top_files > 0) {
+        print_top_files(&ctx);
+    }
+    if (opts.duplicates && dupes_find(ctx.dupes, ctx.pool, print_duplicates, &ctx) == -1) {
+        perror("malloc");
+        result = 1;
+    }
+    if (opts.sizes_top > 0) {
+        print_dir_usage(&ctx);
+    }
+    if (sink_close(&ctx.out) == -1) {
+        result = 1;
+    }
+    if (opts.stats) {
+        print_stats(&ctx.stats, ctx.out.written, opts.stats_json);
+    }
+    index_close(ctx.index);
+    if (ctx.work != NULL && ctx.work->failed) {
+        result = 1;
+    }
+    stop_file_work(&ctx);
+    dupes_destroy(ctx.dupes);
+    exec_destroy(ctx.exec);
+    sorter_destroy(ctx.sorter);
+    pool_destroy(ctx.pool);
+    if (dircache_close(ctx.opts.search.cache) == -1) {
+        perror(opts.cache_path);
+        result = 1;
+    }
+    ext_set_free(ctx.opts.search.extensions);
+    return result;
 }
@@ -0,0 +1,282 @@
+/**
+ * @file search.h
+ *
+ * Public API of search.so: an embeddable directory search. A search is opened
+ * on a root directory, entries are pulled one at a time with search_next(),
+ * and the search is released with search_close(). Alternatively, search_run()
+ * pushes entries to a callback in batches.
+ *
+ * A search keeps all of its state in its own handle (options, buffers, error
+ * sink and statistics), so any number of searches can run concurrently in one
+ * process as long as each handle is used by one thread at a time.
+ *
+ * Example Usage:
+ *
+ *     struct search_opts opts;
+ *     search_opts_init(&opts);
+ *     opts.pattern = ".c";
+ *     struct search *it = search_open("src", &opts);
+ *     struct search_entry entry;
+ *     while (search_next(it, &entry) == 1) {
+ *         puts(entry.path);
+ *     }
+ *     search_close(it);
+ */
+
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Marks a function as part of the library's exported interface. Everything
+ * else in search.so is built with hidden visibility.
+ */
+#define SEARCH_API __attribute__((visibility("default")))
+
+/**
+ * Fill in size, blocks, nlink and mtime_ns for every delivered entry.
+ */
+#define SEARCH_STAT        0x1
+
+/**
+ * Do not track paths; entry.path is NULL and only entry.name is available.
+ * This saves building a path string for every entry when only names matter.
+ */
+#define SEARCH_NO_PATHS    0x2
+
+/**
+ * Compute du(1)-style totals for every directory. Once a directory and all of
+ * its subdirectories have been searched, a separate entry with 'leaving' set
+ * is delivered for it (whether or not the directory itself matched).
+ */
+#define SEARCH_DIR_TOTALS  0x4
+
+/**
+ * Deliver the entries of each directory sorted by name (bytewise, as strcmp()
+ * orders them). Each directory is read in full before its first entry is
+ * delivered, but nothing else is held back, so the whole search comes out in
+ * the order of a sorted list of paths (with '/' sorting first) as it goes.
+ */
+#define SEARCH_SORTED      0x8
+
+/**
+ * Time the calls that open directories, read them (getdents64) and stat
+ * entries, into the latency histograms of struct search_stats.
+ */
+#define SEARCH_TIMING      0x10
+
+/**
+ * With SEARCH_TIMING, one call in this many is timed: reading the clock twice
+ * costs a good fraction of a cached stat() call, and a sample gives the same
+ * distribution. Can be overridden at compile time, e.g.,
+ * -DSEARCH_TIMING_INTERVAL=1 to time every call.
+ */
+#ifndef SEARCH_TIMING_INTERVAL
+#define SEARCH_TIMING_INTERVAL 8
+#endif
+
+/**
+ * Latency histograms have log-linear buckets, as in HdrHistogram: values
+ * below 2 * SEARCH_HIST_SUB_BUCKETS nanoseconds get a bucket each, and every
+ * power of two above that is split into SEARCH_HIST_SUB_BUCKETS buckets, so a
+ * value is recorded to within 1/SEARCH_HIST_SUB_BUCKETS of itself. Values
+ * beyond 2^SEARCH_HIST_MAX_SHIFT ns (about nine minutes) go in the last
+ * bucket.
+ */
+#define SEARCH_HIST_SUB_BITS    3
+#define SEARCH_HIST_SUB_BUCKETS (1 << SEARCH_HIST_SUB_BITS)
+#define SEARCH_HIST_MAX_SHIFT   39
+#define SEARCH_HIST_BUCKETS \
+    ((SEARCH_HIST_MAX_SHIFT - SEARCH_HIST_SUB_BITS + 2) * SEARCH_HIST_SUB_BUCKETS)
+
+struct search_histogram {
+    uint64_t count;         // calls timed
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[SEARCH_HIST_BUCKETS];
+};
+
+/**
+ * Number of errno values counted separately in search_stats; errors with
+ * larger values are counted in errors_by_errno[0].
+ */
+#define SEARCH_ERRNO_MAX 134
+
+/**
+ * Counters describing the work a search has done.
+ */
+struct search_stats {
+    uint64_t dirs_opened;
+    uint64_t entries_read;  // directory entries, not counting "." and ".."
+    uint64_t stat_calls;    // fstatat() calls, on directories and entries
+    uint64_t matches;       // entries delivered, not counting 'leaving' entries
+    uint64_t errors;
+    uint64_t dirs_cached;   // listings replayed from the directory cache
+    uint64_t getdents_calls;
+    uint64_t getdents_bytes;
+    uint64_t errors_by_errno[SEARCH_ERRNO_MAX];
+
+    /* Only filled in with SEARCH_TIMING */
+    struct search_histogram opendir_ns;
+    struct search_histogram getdents_ns;
+    struct search_histogram stat_ns;
+};
+
+/**
+ * Adds the counters and histograms of 'from' to 'into', e.g., to total the
+ * searches run on several threads.
+ */
+SEARCH_API void search_stats_merge(struct search_stats *into, const struct search_stats *from);
+
+/**
+ * Finds the value below which 'percentile' percent of a histogram's values
+ * fall, to within the precision of its buckets.
+ *
+ * @return the value in nanoseconds, or 0 if the histogram is empty.
+ */
+SEARCH_API uint64_t search_histogram_percentile(const struct search_histogram *hist,
+        double percentile);
+
+/**
+ * Gives the smallest value that is recorded in bucket 'bucket'.
+ */
+SEARCH_API uint64_t search_histogram_bucket_start(size_t bucket);
+
+/**
+ * Receives an error encountered during a search. 'op' names the operation that
+ * failed (e.g., "opendir"), 'path' is the entry it failed on (just the name
+ * with SEARCH_NO_PATHS), and 'err' is the errno value.
+ */
+typedef void (*search_error_fn)(void *ctx, const char *op, const char *path, int err);
+
+/**
+ * Options that control which entries a search reports.
+ */
+struct search_opts {
+    int max_depth;        // -1 for no limit
+    const char *pattern;  // substring that names must contain ("" for all)
+    bool exact_match;     // files must be named 'pattern' exactly
+    bool ignore_case;     // ASCII letters in names match either case
+    bool unicode_fold;    // fold case across Unicode, decoding names as UTF-8
+    bool show_dirs;
+    bool show_files;
+    bool show_hidden;     // report files whose names start with '.'
+    bool unique_inodes;   // report each hard-linked file only once
+    unsigned int flags;   // SEARCH_* flags
+
+    /* Where errors go. By default (NULL) they are printed to stderr. */
+    search_error_fn on_error;
+    void *error_ctx;
+
+    /* If not NULL, receives the search's counters when it is closed */
+    struct search_stats *stats;
+
+    /* If not NULL, directory listings are replayed from (and stored in) this
+     * cache; see dircache.h */
+    struct dircache *cache;
+
+    /* If not NULL, files must have one of these extensions; see ext_set.h.
+     * Directories are not checked, so clear show_dirs to leave them out. */
+    struct ext_set *extensions;
+};
+
+/**
+ * An entry produced by the search. The strings are borrowed from the search's
+ * internal buffers and are only valid until the next call to search_next() or
+ * search_close().
+ */
+struct search_entry {
+    const char *path;     // NULL with SEARCH_NO_PATHS
+    size_t path_len;
+    const char *name;     // last component of the path
+    size_t name_len;
+    unsigned char type;   // DT_REG or DT_DIR
+    int depth;            // 0 for entries in the root directory
+    ino_t ino;
+
+    /* Only filled in with SEARCH_STAT */
+    uint64_t size;
+    uint64_t blocks;      // allocated 512-byte blocks
+    uint64_t nlink;
+    int64_t mtime_ns;
+
+    /* Only used with SEARCH_DIR_TOTALS */
+    bool leaving;         // this directory is finished; totals are final
+    uint64_t total_bytes; // allocated bytes beneath and including the directory
+    uint64_t total_files; // regular files beneath the directory
+};
+
+struct search;
+
+/**
+ * Maximum number of entries delivered in one search_run() batch.
+ */
+#define SEARCH_BATCH_SIZE 256
+
+/**
+ * Receives a batch of entries from search_run(). The entries and the strings
+ * they point to are only valid until the callback returns.
+ *
+ * @return 0 to continue the search, or any other value to stop it.
+ */
+typedef int (*search_callback)(void *ctx, const struct search_entry *entries,
+        size_t count);
+
+/**
+ * Sets search options to their defaults: no depth limit, no pattern, files and
+ * directories shown, hidden files skipped.
+ */
+SEARCH_API void search_opts_init(struct search_opts *opts);
+
+/**
+ * Tells whether an entry's name and type pass the pattern and type filters of
+ * 'opts' (everything but the depth limit and unique_inodes). This lets
+ * programs that list entries some other way filter them just like a search.
+ */
+SEARCH_API bool search_match(const struct search_opts *opts, const char *name,
+        unsigned char type);
+
+/**
+ * Starts a search of 'root'. The options are copied, so 'opts' does not need
+ * to outlive the call.
+ *
+ * @return the search, or NULL if the root could not be opened (errno is set).
+ */
+SEARCH_API struct search *search_open(const char *root, const struct search_opts *opts);
+
+/**
+ * Retrieves the next entry. Directories that cannot be read are reported to
+ * the error sink and skipped.
+ *
+ * @return 1 if 'entry' was filled in, 0 when the search is complete, or -1 on
+ * an unrecoverable error (errno is set).
+ */
+SEARCH_API int search_next(struct search *it, struct search_entry *entry);
+
+/**
+ * Retrieves the counters of a search in progress.
+ */
+SEARCH_API void search_get_stats(const struct search *it, struct search_stats *stats);
+
+/**
+ * Ends a search and frees its resources.
+ */
+SEARCH_API void search_close(struct search *it);
+
+/**
+ * Runs a complete search of 'root', delivering entries to 'callback' in batches
+ * of up to SEARCH_BATCH_SIZE. Batching amortizes the cost of the callback and
+ * lets the consumer hand whole batches to its own workers (after copying what
+ * it needs to keep).
+ *
+ * @return 0 when the search completes, the callback's return value if it
+ * stopped the search, or -1 on error (errno is set).
+ */
+SEARCH_API int search_run(const char *root, const struct search_opts *opts,
+        search_callback callback, void *ctx);
+
+#endif
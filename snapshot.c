@@ -0,0 +1,556 @@
+/**
+ * @file snapshot.c
+ *
+ * Implementation of the snapshots declared in snapshot.h. The live tree is
+ * walked recursively, one directory at a time: its listing is read (or reused
+ * from the old snapshot), sorted by name, and merged against the old block of
+ * the same directory. Subdirectories are walked from within the merge, so
+ * changes come out in depth-first order, and a directory's block is written
+ * only once its subdirectories' blocks (and therefore their offsets) exist.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "logger.h"
+#include "snapshot.h"
+
+/**
+ * An entry of a live directory.
+ */
+struct item {
+    const char *name;
+    size_t name_offset;     // into the listing's names until they are final
+    uint16_t name_len;
+    unsigned char type;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t child;         // offset of a directory's block in the new snapshot
+};
+
+struct listing {
+    struct item *items;
+    size_t len;
+    size_t cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+};
+
+struct walker {
+    const uint8_t *old;     // the old snapshot, or NULL
+    size_t old_size;
+    FILE *out;              // the new snapshot, or NULL
+    uint64_t out_offset;
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t reused;        // listings taken from the old snapshot
+    int64_t start_ns;       // when the walk began
+    snapshot_fn fn;
+    void *ctx;
+    char path[PATH_MAX];
+    size_t path_len;
+};
+
+static int64_t to_ns(struct timespec ts)
+{
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Retrieves a block of the old snapshot, checking that it lies within the
+ * file.
+ *
+ * @return the block, or NULL if the snapshot is corrupt.
+ */
+static const struct snapshot_dir *old_block(struct walker *w, uint64_t offset)
+{
+    if (offset < sizeof(struct snapshot_header)
+            || offset > w->old_size - sizeof(struct snapshot_dir)) {
+        return NULL;
+    }
+    const struct snapshot_dir *dir = (const void *) (w->old + offset);
+    uint64_t len = (uint64_t) dir->count * sizeof(struct snapshot_entry) + dir->names_len;
+    if (len > w->old_size - offset - sizeof(*dir)
+            || (dir->names_len > 0 && w->old[offset + sizeof(*dir) + len - 1] != '\0')) {
+        return NULL;
+    }
+    return dir;
+}
+
+static const struct snapshot_entry *old_entries(const struct snapshot_dir *dir)
+{
+    return (const void *) (dir + 1);
+}
+
+static const char *old_name(const struct snapshot_dir *dir, const struct snapshot_entry *e)
+{
+    const char *names = (const char *) (old_entries(dir) + dir->count);
+    return e->name_offset < dir->names_len ? names + e->name_offset : "";
+}
+
+static int add_item(struct listing *l, const char *name, unsigned char type)
+{
+    size_t len = strlen(name);
+    if (l->len == l->cap) {
+        size_t cap = l->cap == 0 ? 64 : l->cap * 2;
+        struct item *items = realloc(l->items, cap * sizeof(struct item));
+        if (items == NULL) {
+            return -1;
+        }
+        l->items = items;
+        l->cap = cap;
+    }
+    if (l->names_len + len + 1 > l->names_cap) {
+        size_t cap = l->names_cap == 0 ? 4096 : l->names_cap * 2;
+        while (cap < l->names_len + len + 1) {
+            cap *= 2;
+        }
+        char *names = realloc(l->names, cap);
+        if (names == NULL) {
+            return -1;
+        }
+        l->names = names;
+        l->names_cap = cap;
+    }
+    memcpy(l->names + l->names_len, name, len + 1);
+    l->items[l->len++] = (struct item) {
+        .name_offset = l->names_len,
+        .name_len = len,
+        .type = type,
+    };
+    l->names_len += len + 1;
+    return 0;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(((const struct item *) a)->name, ((const struct item *) b)->name);
+}
+
+/**
+ * Reads the entries of a directory (only files and directories, like a
+ * search) and sorts them by name.
+ */
+static int read_listing(int fd, struct listing *l)
+{
+    int dup_fd = dup(fd);
+    DIR *dir = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+    if (dir == NULL) {
+        if (dup_fd != -1) {
+            close(dup_fd);
+        }
+        return -1;
+    }
+    struct dirent *entry;
+    errno = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+        }
+        if ((type == DT_REG || type == DT_DIR) && add_item(l, entry->d_name, type) == -1) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    int err = errno;
+    closedir(dir);
+    errno = err;
+    return err == 0 ? 0 : -1;
+}
+
+static void push_name(struct walker *w, const char *name, size_t len)
+{
+    w->path[w->path_len] = '/';
+    memcpy(w->path + w->path_len + 1, name, len + 1);
+    w->path_len += len + 1;
+}
+
+static int report(struct walker *w, enum snapshot_change change, const char *name,
+        size_t name_len, unsigned char type, int depth, uint64_t size, int64_t mtime_ns)
+{
+    struct search_entry entry = {
+        .path = w->path,
+        .path_len = w->path_len,
+        .name = name,
+        .name_len = name_len,
+        .type = type,
+        .depth = depth,
+        .size = size,
+        .mtime_ns = mtime_ns,
+    };
+    return w->fn(w->ctx, change, &entry);
+}
+
+/**
+ * Reports everything beneath a directory that is gone from the tree.
+ */
+static int report_removed(struct walker *w, uint64_t offset, int depth)
+{
+    const struct snapshot_dir *dir = old_block(w, offset);
+    if (dir == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct snapshot_entry *entries = old_entries(dir);
+    for (uint32_t i = 0; i < dir->count; ++i) {
+        const char *name = old_name(dir, &entries[i]);
+        size_t len = strlen(name);
+        size_t path_len = w->path_len;
+        if (path_len + len + 1 >= PATH_MAX) {
+            continue;
+        }
+        push_name(w, name, len);
+        int rc = report(w, SNAPSHOT_REMOVED, w->path + path_len + 1, len,
+                entries[i].type, depth, entries[i].size, entries[i].mtime_ns);
+        if (rc == 0 && entries[i].type == DT_DIR && entries[i].child != 0) {
+            rc = report_removed(w, entries[i].child, depth + 1);
+        }
+        w->path_len = path_len;
+        w->path[path_len] = '\0';
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes a directory's block to the new snapshot.
+ */
+static int write_block(struct walker *w, int64_t mtime_ns, int64_t ctime_ns,
+        const struct listing *l, uint64_t *offset)
+{
+    static const char padding[8];
+    size_t pad = (8 - w->out_offset % 8) % 8;
+    if (fwrite(padding, 1, pad, w->out) != pad) {
+        return -1;
+    }
+    w->out_offset += pad;
+    *offset = w->out_offset;
+
+    struct snapshot_dir dir = {
+        .mtime_ns = mtime_ns,
+        .ctime_ns = ctime_ns,
+        .count = l->len,
+    };
+    for (size_t i = 0; i < l->len; ++i) {
+        dir.names_len += l->items[i].name_len + 1;
+    }
+    if (fwrite(&dir, sizeof(dir), 1, w->out) != 1) {
+        return -1;
+    }
+    uint32_t name_offset = 0;
+    for (size_t i = 0; i < l->len; ++i) {
+        const struct item *item = &l->items[i];
+        struct snapshot_entry e = {
+            .size = item->size,
+            .mtime_ns = item->mtime_ns,
+            .child = item->child,
+            .name_offset = name_offset,
+            .name_len = item->name_len,
+            .type = item->type,
+        };
+        name_offset += item->name_len + 1;
+        if (fwrite(&e, sizeof(e), 1, w->out) != 1) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < l->len; ++i) {
+        if (fwrite(l->items[i].name, 1, l->items[i].name_len + 1, w->out)
+                != (size_t) l->items[i].name_len + 1) {
+            return -1;
+        }
+    }
+    w->out_offset += sizeof(dir) + l->len * sizeof(struct snapshot_entry) + dir.names_len;
+    return 0;
+}
+
+static int walk_dir(struct walker *w, int fd, const struct snapshot_dir *old, int depth,
+        uint64_t *offset);
+
+/**
+ * Walks a subdirectory of the directory open at 'fd'. A subdirectory that
+ * can't be opened is reported like a search would and recorded as empty.
+ */
+static int walk_child(struct walker *w, int fd, struct item *item,
+        const struct snapshot_dir *old, int depth)
+{
+    int child_fd = openat(fd, item->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child_fd == -1) {
+        perror("opendir");
+        return 0;
+    }
+    int rc = walk_dir(w, child_fd, old, depth, &item->child);
+    close(child_fd);
+    return rc;
+}
+
+/**
+ * Walks the directory open at 'fd', whose path is in w->path. 'old' is its
+ * block in the old snapshot, or NULL if it is new (or there is no old
+ * snapshot).
+ */
+static int walk_dir(struct walker *w, int fd, const struct snapshot_dir *old, int depth,
+        uint64_t *offset)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    int64_t mtime_ns = to_ns(st.st_mtim);
+    int64_t ctime_ns = to_ns(st.st_ctim);
+    w->dirs++;
+
+    /* An unchanged directory has the same entries as last time. */
+    struct listing l = { 0 };
+    int rc = 0;
+    if (old != NULL && old->mtime_ns == mtime_ns && old->ctime_ns == ctime_ns) {
+        const struct snapshot_entry *entries = old_entries(old);
+        for (uint32_t i = 0; i < old->count && rc == 0; ++i) {
+            rc = add_item(&l, old_name(old, &entries[i]), entries[i].type);
+        }
+        w->reused++;
+    } else if (read_listing(fd, &l) == -1) {
+        perror("readdir");
+    }
+    for (size_t i = 0; i < l.len; ++i) {
+        l.items[i].name = l.names + l.items[i].name_offset;
+    }
+    qsort(l.items, l.len, sizeof(struct item), compare_items);
+
+    bool diffing = w->fn != NULL && w->old != NULL;
+    const struct snapshot_entry *old_list = old == NULL ? NULL : old_entries(old);
+    uint32_t old_count = old == NULL ? 0 : old->count;
+    size_t i = 0;
+    uint32_t j = 0;
+    size_t path_len = w->path_len;
+    while (rc == 0 && (i < l.len || j < old_count)) {
+        struct item *item = i < l.len ? &l.items[i] : NULL;
+        const struct snapshot_entry *prev = j < old_count ? &old_list[j] : NULL;
+        const char *prev_name = prev == NULL ? NULL : old_name(old, prev);
+        int cmp = item == NULL ? 1 : prev == NULL ? -1 : strcmp(item->name, prev_name);
+        const char *name = cmp <= 0 ? item->name : prev_name;
+        size_t name_len = strlen(name);
+        if (path_len + name_len + 1 >= PATH_MAX) {
+            i += cmp <= 0;
+            j += cmp >= 0;
+            continue;
+        }
+        push_name(w, name, name_len);
+        const char *path_name = w->path + path_len + 1;
+
+        if (item != NULL && cmp <= 0 && item->type == DT_REG) {
+            struct stat fst;
+            if (fstatat(fd, item->name, &fst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(fst.st_mode)) {
+                item->size = fst.st_size;
+                item->mtime_ns = to_ns(fst.st_mtim);
+                w->files++;
+            } else {
+                // gone (or replaced) since it was listed; record it as empty
+                perror("stat");
+            }
+        }
+
+        bool same_type = cmp == 0 && item->type == prev->type;
+        if (cmp > 0 || (cmp == 0 && !same_type)) {
+            /* Only in the old snapshot, or replaced by a different type. */
+            if (diffing) {
+                rc = report(w, SNAPSHOT_REMOVED, path_name, name_len, prev->type, depth,
+                        prev->size, prev->mtime_ns);
+                if (rc == 0 && prev->type == DT_DIR && prev->child != 0) {
+                    rc = report_removed(w, prev->child, depth + 1);
+                }
+            }
+        }
+        if (rc == 0 && (cmp < 0 || (cmp == 0 && !same_type))) {
+            /* New: report it and, for a directory, everything beneath it. */
+            if (diffing) {
+                rc = report(w, SNAPSHOT_ADDED, path_name, name_len, item->type, depth,
+                        item->size, item->mtime_ns);
+            }
+            if (rc == 0 && item->type == DT_DIR) {
+                rc = walk_child(w, fd, item, NULL, depth + 1);
+            }
+        } else if (rc == 0 && same_type) {
+            if (item->type == DT_DIR) {
+                const struct snapshot_dir *child = NULL;
+                if (prev->child != 0 && (child = old_block(w, prev->child)) == NULL) {
+                    errno = EINVAL;
+                    rc = -1;
+                } else {
+                    rc = walk_child(w, fd, item, child, depth + 1);
+                }
+            } else if (diffing && (item->size != prev->size
+                        || item->mtime_ns != prev->mtime_ns)) {
+                rc = report(w, SNAPSHOT_MODIFIED, path_name, name_len, item->type, depth,
+                        item->size, item->mtime_ns);
+            }
+        }
+
+        w->path_len = path_len;
+        w->path[path_len] = '\0';
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+
+    if (rc == 0 && w->out != NULL) {
+        /* As in the directory cache, a change made within the same timestamp
+         * tick as this read would leave the times as they are, so a recently
+         * modified directory's listing must be read again next time. */
+        if (w->start_ns - mtime_ns < DIRCACHE_RACY_NS
+                || w->start_ns - ctime_ns < DIRCACHE_RACY_NS) {
+            mtime_ns = SNAPSHOT_RACY;
+        }
+        rc = write_block(w, mtime_ns, ctime_ns, &l, offset);
+    }
+    free(l.items);
+    free(l.names);
+    return rc;
+}
+
+/**
+ * Maps an old snapshot and checks its header.
+ */
+static int map_snapshot(const char *path, struct walker *w)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    w->old = base;
+    w->old_size = st.st_size;
+
+    const struct snapshot_header *h = base;
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION
+            || h->size != (uint64_t) st.st_size || old_block(w, h->root) == NULL) {
+        munmap(base, st.st_size);
+        w->old = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int snapshot_diff(const char *root, const char *old_path, const char *new_path,
+        snapshot_fn fn, void *ctx)
+{
+    struct walker *w = calloc(1, sizeof(struct walker));
+    if (w == NULL) {
+        return -1;
+    }
+    w->fn = fn;
+    w->ctx = ctx;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    w->start_ns = to_ns(now);
+    size_t root_len = strlen(root);
+    if (root_len >= PATH_MAX) {
+        free(w);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(w->path, root, root_len + 1);
+    w->path_len = root_len;
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || (old_path != NULL && map_snapshot(old_path, w) == -1)) {
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        free(w);
+        errno = err;
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    if (new_path != NULL) {
+        if (snprintf(tmp, sizeof(tmp), "%s.tmp", new_path) >= (int) sizeof(tmp)) {
+            errno = ENAMETOOLONG;
+        } else {
+            w->out = fopen(tmp, "wb");
+        }
+    }
+
+    struct snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+    };
+    int rc = -1;
+    if (new_path == NULL || (w->out != NULL
+                && fwrite(&header, sizeof(header), 1, w->out) == 1)) {
+        w->out_offset = sizeof(header);
+        const struct snapshot_dir *old_root = w->old == NULL ? NULL
+            : old_block(w, ((const struct snapshot_header *) w->old)->root);
+        rc = walk_dir(w, fd, old_root, 0, &header.root);
+    }
+    LOG("Walked %llu directories (%llu listings reused) and %llu files\n",
+            (unsigned long long) w->dirs, (unsigned long long) w->reused,
+            (unsigned long long) w->files);
+
+    int err = errno;
+    if (w->out != NULL) {
+        /* The header goes in last, once the root's block has been written. */
+        header.dirs = w->dirs;
+        header.files = w->files;
+        header.size = w->out_offset;
+        if (rc == 0 && (fseek(w->out, 0, SEEK_SET) == -1
+                    || fwrite(&header, sizeof(header), 1, w->out) != 1)) {
+            rc = -1;
+            err = errno;
+        }
+        if (fclose(w->out) != 0 && rc == 0) {
+            rc = -1;
+            err = errno;
+        }
+        if (rc == 0 && rename(tmp, new_path) == -1) {
+            rc = -1;
+            err = errno;
+        }
+        if (rc != 0) {
+            unlink(tmp);
+        }
+    }
+    if (w->old != NULL) {
+        munmap((void *) w->old, w->old_size);
+    }
+    close(fd);
+    free(w);
+    errno = err;
+    return rc;
+}
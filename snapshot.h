@@ -0,0 +1,96 @@
+/**
+ * @file snapshot.h
+ *
+ * Tree snapshots and change reports. A snapshot records every directory's
+ * listing (names, types, and for files their size and modification time).
+ * Comparing the live tree against an older snapshot reports what was added,
+ * removed or modified since, while both listings are walked in step one
+ * directory at a time: memory use depends on the depth of the tree and the
+ * size of its directories, not on the number of files.
+ *
+ * A directory whose mtime and ctime both match the snapshot still has the
+ * same entries, so its recorded listing is reused instead of reading the
+ * directory again. Its files are still checked, though: changing a file's
+ * contents (or anything deeper in the tree) does not touch the directory.
+ * Directories modified shortly before a snapshot is taken are recorded so
+ * that their listings are never reused (see DIRCACHE_RACY_NS).
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "search.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+
+/**
+ * The file starts with a header and holds one block per directory, written
+ * after the blocks of all of its subdirectories. Offsets are in bytes from
+ * the start of the file; blocks are 8-byte aligned.
+ */
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t root;          // offset of the root directory's block
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t size;          // size of the whole file
+};
+
+/**
+ * A directory block: this header, 'count' entries sorted by name, and then
+ * the entries' NUL-terminated names. 'mtime_ns' is SNAPSHOT_RACY if the
+ * directory was modified too close to the snapshot for its listing to be
+ * trusted later.
+ */
+struct snapshot_dir {
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint32_t count;
+    uint32_t names_len;
+};
+
+#define SNAPSHOT_RACY INT64_MIN
+
+struct snapshot_entry {
+    uint64_t size;          // files only
+    int64_t mtime_ns;       // files only
+    uint64_t child;         // offset of a directory's own block
+    uint32_t name_offset;   // from the end of the entry table
+    uint16_t name_len;
+    uint8_t type;           // DT_REG or DT_DIR
+    uint8_t reserved;
+};
+
+enum snapshot_change {
+    SNAPSHOT_ADDED = '+',
+    SNAPSHOT_REMOVED = '-',
+    SNAPSHOT_MODIFIED = 'M',
+};
+
+/**
+ * Receives a change. Entries carry a path, name, type and depth; files also
+ * have their size and mtime (the old ones, for removed files). Everything
+ * beneath an added or removed directory is reported as well.
+ *
+ * @return 0 to continue, or any other value to stop.
+ */
+typedef int (*snapshot_fn)(void *ctx, enum snapshot_change change,
+        const struct search_entry *entry);
+
+/**
+ * Walks the tree under 'root', comparing it against the snapshot in 'old_path'
+ * (if not NULL) and writing a new snapshot to 'new_path' (if not NULL). The
+ * new file replaces the old atomically, so the two may be the same file.
+ * Changes are delivered to 'fn' directory by directory, in name order.
+ *
+ * @return 0 on success, the callback's return value if it stopped the walk,
+ * or -1 on error (errno is set; EINVAL if 'old_path' is not a snapshot).
+ */
+int snapshot_diff(const char *root, const char *old_path, const char *new_path,
+        snapshot_fn fn, void *ctx);
+
+#endif
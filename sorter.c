@@ -0,0 +1,592 @@
+/**
+ * @file sorter.c
+ *
+ * Implementation of the sorter declared in sorter.h. Every sort key is read as
+ * a string of "digits" from 0 to 256, one per radix pass: 0 marks the end of
+ * the key, and the bytes of names and paths are shifted up by one to make room
+ * for it (with '/' moved down to 1, so paths order as path_compare() has
+ * them). Numeric keys are their 8 bytes, most significant first. All keys end
+ * with the path, which breaks ties.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "merge.h"
+#include "runs.h"
+#include "sorter.h"
+
+#define SORT_BUCKETS 257
+
+/**
+ * Ranges of up to this many items are finished with an insertion sort.
+ */
+#define SORT_INSERTION_MAX 32
+
+/**
+ * Buckets smaller than this are not split up further for other threads.
+ */
+#define SORT_PARALLEL_MIN 4096
+
+struct sort_item {
+    const char *path;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t len;
+    uint32_t name;      // offset of the file name in the path
+    unsigned char type;
+};
+
+/**
+ * Layout of an item in a spilled run, followed by its path.
+ */
+struct run_record {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t len;
+    uint32_t name;
+    unsigned char type;
+};
+
+/**
+ * A range of items whose keys agree before 'depth'.
+ */
+struct sort_task {
+    size_t start;
+    size_t len;
+    size_t depth;
+};
+
+struct sorter {
+    enum sort_key key;
+    struct pool *pool;
+    struct sort_item *items;
+    size_t len;
+    size_t cap;
+    char *arena;            // the buffered paths, NUL-terminated
+    size_t arena_len;
+    size_t arena_cap;
+    FILE **runs;            // runs spilled so far
+    size_t run_count;
+    size_t run_cap;
+    size_t total;           // entries added
+
+    /* While the buckets are sorted on the pool */
+    struct sort_task *tasks;
+    bool failed;
+};
+
+struct sorter *sorter_create(enum sort_key key, size_t mem_limit, struct pool *pool)
+{
+    struct sorter *sorter = calloc(1, sizeof(struct sorter));
+    if (sorter == NULL) {
+        return NULL;
+    }
+    sorter->key = key;
+    sorter->pool = pool;
+    // split as in run_buffer_init()
+    sorter->cap = mem_limit / 4 / sizeof(struct sort_item);
+    sorter->arena_cap = mem_limit - sorter->cap * sizeof(struct sort_item);
+    if (sorter->cap == 0) {
+        free(sorter);
+        errno = EINVAL;
+        return NULL;
+    }
+    sorter->items = malloc(sorter->cap * sizeof(struct sort_item));
+    sorter->arena = malloc(sorter->arena_cap);
+    if (sorter->items == NULL || sorter->arena == NULL) {
+        sorter_destroy(sorter);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return sorter;
+}
+
+static uint64_t number(enum sort_key key, const struct sort_item *item)
+{
+    if (key == SORT_SIZE) {
+        return item->size;
+    }
+    // flipping the sign bit orders negative times before positive ones
+    return (uint64_t) item->mtime_ns ^ (1ULL << 63);
+}
+
+static unsigned int path_digit(const struct sort_item *item, size_t i)
+{
+    if (i >= item->len) {
+        return 0;
+    }
+    unsigned char c = item->path[i];
+    return c == '/' ? 1 : c + 1;
+}
+
+/**
+ * Retrieves digit 'depth' of an item's key.
+ */
+static unsigned int key_digit(enum sort_key key, const struct sort_item *item, size_t depth)
+{
+    if (key == SORT_NAME) {
+        size_t name_len = item->len - item->name;
+        if (depth < name_len) {
+            return (unsigned char) item->path[item->name + depth] + 1;
+        }
+        // 1 ends the name, so shorter names come first
+        return depth == name_len ? 1 : path_digit(item, depth - name_len - 1);
+    }
+    if (key == SORT_SIZE || key == SORT_MTIME) {
+        if (depth < 8) {
+            return ((number(key, item) >> (56 - 8 * depth)) & 0xff) + 1;
+        }
+        return path_digit(item, depth - 8);
+    }
+    return path_digit(item, depth);
+}
+
+/**
+ * Compares two items' whole keys, in the order the digits give them.
+ */
+static int compare_items(enum sort_key key, const struct sort_item *a, const struct sort_item *b)
+{
+    if (key == SORT_SIZE || key == SORT_MTIME) {
+        uint64_t na = number(key, a);
+        uint64_t nb = number(key, b);
+        if (na != nb) {
+            return na < nb ? -1 : 1;
+        }
+    } else if (key == SORT_NAME) {
+        size_t a_len = a->len - a->name;
+        size_t b_len = b->len - b->name;
+        int rc = memcmp(a->path + a->name, b->path + b->name, a_len < b_len ? a_len : b_len);
+        if (rc != 0) {
+            return rc;
+        }
+        if (a_len != b_len) {
+            return a_len < b_len ? -1 : 1;
+        }
+    }
+    return path_compare(a->path, a->len, b->path, b->len);
+}
+
+static void insertion_sort(enum sort_key key, struct sort_item *items, size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        struct sort_item item = items[i];
+        size_t j = i;
+        for (; j > 0 && compare_items(key, &item, &items[j - 1]) < 0; --j) {
+            items[j] = items[j - 1];
+        }
+        items[j] = item;
+    }
+}
+
+/**
+ * Moves items into buckets by their key digit at '*depth', after moving past
+ * any digits that all of them share. 'counts' receives the bucket sizes.
+ *
+ * @return false if the items' keys are all the same (so they are sorted).
+ */
+static bool partition(enum sort_key key, struct sort_item *items, size_t n,
+        size_t *depth, size_t counts[SORT_BUCKETS])
+{
+    for (;;) {
+        memset(counts, 0, SORT_BUCKETS * sizeof(size_t));
+        for (size_t i = 0; i < n; ++i) {
+            counts[key_digit(key, &items[i], *depth)]++;
+        }
+        if (counts[0] == n) {
+            return false;
+        }
+        if (counts[key_digit(key, &items[0], *depth)] < n) {
+            break;
+        }
+        (*depth)++;
+    }
+
+    /* In place, like an American flag sort: each item displaced from a bucket
+     * is carried on to its own bucket until the cycle closes. */
+    size_t next[SORT_BUCKETS];
+    size_t end[SORT_BUCKETS];
+    size_t offset = 0;
+    for (size_t b = 0; b < SORT_BUCKETS; ++b) {
+        next[b] = offset;
+        offset += counts[b];
+        end[b] = offset;
+    }
+    for (size_t b = 0; b < SORT_BUCKETS; ++b) {
+        while (next[b] < end[b]) {
+            struct sort_item item = items[next[b]];
+            unsigned int digit = key_digit(key, &item, *depth);
+            while (digit != b) {
+                struct sort_item displaced = items[next[digit]];
+                items[next[digit]++] = item;
+                item = displaced;
+                digit = key_digit(key, &item, *depth);
+            }
+            items[next[b]++] = item;
+        }
+    }
+    return true;
+}
+
+/**
+ * Appends a task to a growable array.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+static int push_task(struct sort_task **tasks, size_t *len, size_t *cap, struct sort_task task)
+{
+    if (*len == *cap) {
+        size_t new_cap = *cap == 0 ? 64 : *cap * 2;
+        struct sort_task *grown = realloc(*tasks, new_cap * sizeof(struct sort_task));
+        if (grown == NULL) {
+            return -1;
+        }
+        *tasks = grown;
+        *cap = new_cap;
+    }
+    (*tasks)[(*len)++] = task;
+    return 0;
+}
+
+/**
+ * Splits a task's items into buckets and adds the buckets that still need
+ * sorting as new tasks.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+static int split_task(enum sort_key key, struct sort_item *items, struct sort_task task,
+        struct sort_task **tasks, size_t *len, size_t *cap)
+{
+    size_t counts[SORT_BUCKETS];
+    if (!partition(key, items + task.start, task.len, &task.depth, counts)) {
+        return 0;
+    }
+    // bucket 0 holds keys that have ended, and so are all the same
+    size_t offset = task.start + counts[0];
+    for (size_t b = 1; b < SORT_BUCKETS; ++b) {
+        struct sort_task bucket = { offset, counts[b], task.depth + 1 };
+        if (counts[b] > 1 && push_task(tasks, len, cap, bucket) == -1) {
+            return -1;
+        }
+        offset += counts[b];
+    }
+    return 0;
+}
+
+/**
+ * Sorts a range of items on the calling thread. Buckets are kept on an
+ * explicit stack rather than recursed into, since keys can be thousands of
+ * digits long.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+static int radix_sort(enum sort_key key, struct sort_item *items, struct sort_task task)
+{
+    struct sort_task *stack = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int rc = push_task(&stack, &len, &cap, task);
+    while (rc == 0 && len > 0) {
+        struct sort_task next = stack[--len];
+        if (next.len <= SORT_INSERTION_MAX) {
+            insertion_sort(key, items + next.start, next.len);
+        } else {
+            rc = split_task(key, items, next, &stack, &len, &cap);
+        }
+    }
+    free(stack);
+    return rc;
+}
+
+/**
+ * Sorts one of the buckets left by the serial passes. Runs on the pool.
+ */
+static void sort_task(void *ctx, size_t worker, size_t index)
+{
+    (void) worker;
+    struct sorter *sorter = ctx;
+    if (radix_sort(sorter->key, sorter->items, sorter->tasks[index]) == -1) {
+        __atomic_store_n(&sorter->failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+static int compare_tasks(const void *a, const void *b)
+{
+    const struct sort_task *ta = a;
+    const struct sort_task *tb = b;
+    return ta->len > tb->len ? -1 : ta->len < tb->len;
+}
+
+/**
+ * Sorts the buffered items. The largest bucket is split serially until every
+ * bucket is a small share of the work, then the buckets are sorted on the
+ * pool, largest first.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+static int sort_items(struct sorter *sorter)
+{
+    size_t threads = sorter->pool == NULL ? 1 : pool_size(sorter->pool);
+    struct sort_task all = { 0, sorter->len, 0 };
+    if (threads == 1 || sorter->len < SORT_PARALLEL_MIN) {
+        return radix_sort(sorter->key, sorter->items, all);
+    }
+
+    size_t target = sorter->len / (4 * threads);
+    if (target < SORT_PARALLEL_MIN) {
+        target = SORT_PARALLEL_MIN;
+    }
+    struct sort_task *tasks = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int rc = push_task(&tasks, &len, &cap, all);
+    while (rc == 0 && len > 0) {
+        size_t largest = 0;
+        for (size_t i = 1; i < len; ++i) {
+            if (tasks[i].len > tasks[largest].len) {
+                largest = i;
+            }
+        }
+        if (tasks[largest].len <= target) {
+            break;
+        }
+        struct sort_task task = tasks[largest];
+        tasks[largest] = tasks[--len];
+        rc = split_task(sorter->key, sorter->items, task, &tasks, &len, &cap);
+    }
+
+    if (rc == 0) {
+        qsort(tasks, len, sizeof(struct sort_task), compare_tasks);
+        LOG("Sorting %zu buckets on %zu threads\n", len, threads);
+        sorter->tasks = tasks;
+        sorter->failed = false;
+        pool_run(sorter->pool, len, sort_task, sorter);
+        sorter->tasks = NULL;
+        rc = sorter->failed ? -1 : 0;
+    }
+    free(tasks);
+    if (rc == -1) {
+        errno = ENOMEM;
+    }
+    return rc;
+}
+
+/**
+ * Sorts the buffered items and writes them out as a run.
+ *
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+static int spill(struct sorter *sorter)
+{
+    if (sorter->run_count == sorter->run_cap) {
+        size_t cap = sorter->run_cap == 0 ? 8 : sorter->run_cap * 2;
+        FILE **runs = realloc(sorter->runs, cap * sizeof(FILE *));
+        if (runs == NULL) {
+            return -1;
+        }
+        sorter->runs = runs;
+        sorter->run_cap = cap;
+    }
+    if (sort_items(sorter) == -1) {
+        return -1;
+    }
+    FILE *out = tmpfile();
+    if (out == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < sorter->len; ++i) {
+        const struct sort_item *item = &sorter->items[i];
+        struct run_record record = {
+            item->size, item->mtime_ns, item->len, item->name, item->type
+        };
+        fwrite(&record, sizeof(record), 1, out);
+        fwrite(item->path, 1, item->len, out);
+    }
+    if (fflush(out) != 0 || ferror(out)) {
+        fclose(out);
+        return -1;
+    }
+    rewind(out);
+    LOG("Spilled a sorted run of %zu entries\n", sorter->len);
+
+    sorter->runs[sorter->run_count++] = out;
+    sorter->len = 0;
+    sorter->arena_len = 0;
+    return 0;
+}
+
+int sorter_add(struct sorter *sorter, const struct output_entry *entry)
+{
+    size_t len = entry->path_len;
+    if (len >= sorter->arena_cap || len > UINT32_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (sorter->len == sorter->cap || sorter->arena_len + len + 1 > sorter->arena_cap) {
+        if (spill(sorter) == -1) {
+            return -1;
+        }
+    }
+    char *copy = sorter->arena + sorter->arena_len;
+    memcpy(copy, entry->path, len);
+    copy[len] = '\0';
+    sorter->arena_len += len + 1;
+
+    size_t name = len;
+    while (name > 0 && copy[name - 1] != '/') {
+        name--;
+    }
+    sorter->items[sorter->len++] = (struct sort_item) {
+        .path = copy,
+        .size = entry->size,
+        .mtime_ns = entry->mtime_ns,
+        .len = len,
+        .name = name,
+        .type = entry->type,
+    };
+    sorter->total++;
+    return 0;
+}
+
+static int emit(sorter_fn fn, void *ctx, const struct sort_item *item)
+{
+    struct output_entry entry = {
+        item->path, item->len, item->type, item->size, item->mtime_ns
+    };
+    return fn(ctx, &entry);
+}
+
+/**
+ * The current item of a run being merged.
+ */
+struct run_reader {
+    FILE *in;
+    struct sort_item item;
+    char *path;
+    size_t path_cap;
+    bool done;
+    bool failed;
+};
+
+struct run_merge {
+    enum sort_key key;
+    struct run_reader *readers;
+};
+
+static void reader_next(struct run_reader *r)
+{
+    struct run_record record;
+    if (fread(&record, sizeof(record), 1, r->in) != 1) {
+        // a clean end of the run, unless the file could not be read
+        r->done = true;
+        r->failed = ferror(r->in);
+        return;
+    }
+    if (record.len + 1 > r->path_cap) {
+        char *path = realloc(r->path, record.len + 1);
+        if (path == NULL) {
+            r->done = true;
+            r->failed = true;
+            return;
+        }
+        r->path = path;
+        r->path_cap = record.len + 1;
+    }
+    if (record.name > record.len || fread(r->path, 1, record.len, r->in) != record.len) {
+        r->done = true;
+        r->failed = true;
+        return;
+    }
+    r->path[record.len] = '\0';
+    r->item = (struct sort_item) {
+        r->path, record.size, record.mtime_ns, record.len, record.name, record.type
+    };
+}
+
+static bool reader_less(void *ctx, size_t a, size_t b)
+{
+    struct run_merge *merge = ctx;
+    if (merge->readers[a].done) {
+        return false;
+    }
+    if (merge->readers[b].done) {
+        return true;
+    }
+    return compare_items(merge->key, &merge->readers[a].item, &merge->readers[b].item) < 0;
+}
+
+/**
+ * Merges the spilled runs and passes every item to 'fn'.
+ */
+static int merge_runs(struct sorter *sorter, sorter_fn fn, void *ctx)
+{
+    size_t count = sorter->run_count;
+    struct run_merge state = {
+        sorter->key, calloc(count + 1, sizeof(struct run_reader))
+    };
+    if (state.readers == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        state.readers[i].in = sorter->runs[i];
+        reader_next(&state.readers[i]);
+    }
+    struct merge m;
+    int rc = -1;
+    if (merge_init(&m, count, reader_less, &state) == 0) {
+        rc = 0;
+        size_t s;
+        while (rc == 0 && (s = merge_winner(&m)) < count && !state.readers[s].done) {
+            rc = emit(fn, ctx, &state.readers[s].item);
+            reader_next(&state.readers[s]);
+            merge_replay(&m);
+        }
+        merge_destroy(&m);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (rc == 0 && state.readers[i].failed) {
+            errno = EIO;
+            rc = -1;
+        }
+        free(state.readers[i].path);
+    }
+    free(state.readers);
+    return rc;
+}
+
+int sorter_finish(struct sorter *sorter, sorter_fn fn, void *ctx)
+{
+    int rc = 0;
+    if (sorter->run_count == 0) {
+        rc = sort_items(sorter);
+        for (size_t i = 0; rc == 0 && i < sorter->len; ++i) {
+            rc = emit(fn, ctx, &sorter->items[i]);
+        }
+    } else if (sorter->len == 0 || spill(sorter) == 0) {
+        LOG("Merging %zu sorted runs\n", sorter->run_count);
+        rc = merge_runs(sorter, fn, ctx);
+    } else {
+        rc = -1;
+    }
+    LOG("Sorted %zu entries\n", sorter->total);
+    return rc;
+}
+
+void sorter_destroy(struct sorter *sorter)
+{
+    if (sorter == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < sorter->run_count; ++i) {
+        fclose(sorter->runs[i]);
+    }
+    free(sorter->runs);
+    free(sorter->items);
+    free(sorter->arena);
+    free(sorter);
+}
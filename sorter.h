@@ -0,0 +1,79 @@
+/**
+ * @file sorter.h
+ *
+ * Sorting search results for --sort. Entries are collected into a buffer of
+ * items and an arena of paths, and sorted with an MSD radix sort: items are
+ * split into buckets by one byte of their key at a time, so long shared
+ * prefixes (like the directories at the start of every path) are passed over
+ * once per bucket instead of once per comparison. The first levels split the
+ * items serially; the buckets they leave are then sorted on a worker pool.
+ *
+ * When the buffer fills up, its items are sorted and spilled to a temporary
+ * file as a run, and the runs are merged (with a loser tree) at the end, so
+ * the memory used stays bounded however many entries there are.
+ *
+ * Ties are broken by path, and paths are ordered as in runs.h, so every
+ * directory comes right before its contents.
+ */
+
+#ifndef _SORTER_H_
+#define _SORTER_H_
+
+#include <stddef.h>
+
+#include "output.h"
+#include "pool.h"
+
+/**
+ * Default number of bytes of items and paths buffered before a run is
+ * spilled. Can be overridden at compile time, e.g., -DSORT_MEM_LIMIT=65536.
+ */
+#ifndef SORT_MEM_LIMIT
+#define SORT_MEM_LIMIT (128 * 1024 * 1024)
+#endif
+
+enum sort_key {
+    SORT_NAME,  // file name, then path
+    SORT_PATH,
+    SORT_SIZE,  // smallest first
+    SORT_MTIME, // oldest first
+};
+
+struct sorter;
+
+/**
+ * Receives the sorted entries in order.
+ *
+ * @return 0 to continue, or any other value to stop.
+ */
+typedef int (*sorter_fn)(void *ctx, const struct output_entry *entry);
+
+/**
+ * Prepares a sorter that buffers up to 'mem_limit' bytes of entries and sorts
+ * them on the threads of 'pool' (or only the caller's, if it is NULL).
+ *
+ * @return the sorter, or NULL on error (errno is set).
+ */
+struct sorter *sorter_create(enum sort_key key, size_t mem_limit, struct pool *pool);
+
+/**
+ * Adds an entry, spilling a run first if the buffer is full.
+ *
+ * @return 0 on success, or -1 on error (errno is set).
+ */
+int sorter_add(struct sorter *sorter, const struct output_entry *entry);
+
+/**
+ * Sorts everything added so far and passes the entries to 'fn' in order.
+ *
+ * @return 0 on success, the callback's return value if it stopped early, or
+ * -1 on error (errno is set).
+ */
+int sorter_finish(struct sorter *sorter, sorter_fn fn, void *ctx);
+
+/**
+ * Frees the sorter and closes (and thereby removes) its runs.
+ */
+void sorter_destroy(struct sorter *sorter);
+
+#endif
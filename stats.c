@@ -0,0 +1,96 @@
+/**
+ * @file stats.c
+ *
+ * Histograms and merging for the search statistics declared in search.h and
+ * stats.h.
+ */
+
+#include "stats.h"
+
+static size_t bucket_of(uint64_t ns)
+{
+    if (ns < 2 * SEARCH_HIST_SUB_BUCKETS) {
+        return ns;
+    }
+    int top = 63 - __builtin_clzll(ns);
+    if (top > SEARCH_HIST_MAX_SHIFT) {
+        return SEARCH_HIST_BUCKETS - 1;
+    }
+    // the power of two picks the row, and the next bits the bucket within it
+    int shift = top - SEARCH_HIST_SUB_BITS;
+    return (shift + 1) * SEARCH_HIST_SUB_BUCKETS
+        + (ns >> shift) - SEARCH_HIST_SUB_BUCKETS;
+}
+
+uint64_t search_histogram_bucket_start(size_t bucket)
+{
+    if (bucket < 2 * SEARCH_HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SEARCH_HIST_SUB_BUCKETS - 1;
+    return (uint64_t) (SEARCH_HIST_SUB_BUCKETS + bucket % SEARCH_HIST_SUB_BUCKETS) << shift;
+}
+
+void histogram_record(struct search_histogram *hist, uint64_t ns)
+{
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    hist->buckets[bucket_of(ns)]++;
+}
+
+uint64_t search_histogram_percentile(const struct search_histogram *hist,
+        double percentile)
+{
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * hist->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < SEARCH_HIST_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            // the highest value the bucket holds, but never beyond the maximum
+            uint64_t end = i + 1 < SEARCH_HIST_BUCKETS
+                ? search_histogram_bucket_start(i + 1) - 1 : hist->max_ns;
+            return end < hist->max_ns ? end : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+static void merge_histogram(struct search_histogram *into,
+        const struct search_histogram *from)
+{
+    into->count += from->count;
+    into->total_ns += from->total_ns;
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+    for (size_t i = 0; i < SEARCH_HIST_BUCKETS; ++i) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+void search_stats_merge(struct search_stats *into, const struct search_stats *from)
+{
+    into->dirs_opened += from->dirs_opened;
+    into->entries_read += from->entries_read;
+    into->stat_calls += from->stat_calls;
+    into->matches += from->matches;
+    into->errors += from->errors;
+    into->dirs_cached += from->dirs_cached;
+    into->getdents_calls += from->getdents_calls;
+    into->getdents_bytes += from->getdents_bytes;
+    for (size_t i = 0; i < SEARCH_ERRNO_MAX; ++i) {
+        into->errors_by_errno[i] += from->errors_by_errno[i];
+    }
+    merge_histogram(&into->opendir_ns, &from->opendir_ns);
+    merge_histogram(&into->getdents_ns, &from->getdents_ns);
+    merge_histogram(&into->stat_ns, &from->stat_ns);
+}
@@ -0,0 +1,20 @@
+/**
+ * @file stats.h
+ *
+ * Recording into the latency histograms of struct search_stats (see search.h
+ * for their layout).
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+#include "search.h"
+
+/**
+ * Adds one value, in nanoseconds, to a histogram.
+ */
+void histogram_record(struct search_histogram *hist, uint64_t ns);
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * @file topk.c
+ *
+ * Implementation of the bounded min-heap declared in topk.h.
+ */
+
+#include <stdlib.h>
+
+#include "topk.h"
+
+static void swap(struct topk_item *a, struct topk_item *b)
+{
+    struct topk_item tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void sift_up(struct topk_item *items, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (items[parent].key <= items[i].key) {
+            break;
+        }
+        swap(&items[parent], &items[i]);
+        i = parent;
+    }
+}
+
+static void sift_down(struct topk_item *items, size_t len, size_t i)
+{
+    while (true) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < len && items[left].key < items[smallest].key) {
+            smallest = left;
+        }
+        if (right < len && items[right].key < items[smallest].key) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        swap(&items[i], &items[smallest]);
+        i = smallest;
+    }
+}
+
+int topk_init(struct topk *heap, size_t k)
+{
+    heap->len = 0;
+    heap->cap = k;
+    heap->items = NULL;
+    if (k > 0) {
+        heap->items = malloc(k * sizeof(struct topk_item));
+        if (heap->items == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool topk_accepts(const struct topk *heap, unsigned long long key)
+{
+    if (heap->len < heap->cap) {
+        return true;
+    }
+    return heap->cap > 0 && key > heap->items[0].key;
+}
+
+void *topk_push(struct topk *heap, unsigned long long key, void *data)
+{
+    if (heap->len < heap->cap) {
+        heap->items[heap->len].key = key;
+        heap->items[heap->len].data = data;
+        sift_up(heap->items, heap->len);
+        heap->len++;
+        return NULL;
+    }
+    if (!topk_accepts(heap, key)) {
+        return data;
+    }
+    void *evicted = heap->items[0].data;
+    heap->items[0].key = key;
+    heap->items[0].data = data;
+    sift_down(heap->items, heap->len, 0);
+    return evicted;
+}
+
+size_t topk_sort(struct topk *heap)
+{
+    /* Repeatedly move the minimum to the end: leaves descending order. */
+    for (size_t n = heap->len; n > 1; --n) {
+        swap(&heap->items[0], &heap->items[n - 1]);
+        sift_down(heap->items, n - 1, 0);
+    }
+    return heap->len;
+}
+
+void topk_destroy(struct topk *heap)
+{
+    free(heap->items);
+    heap->items = NULL;
+    heap->len = heap->cap = 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file topk.h
+ *
+ * A bounded min-heap that keeps the K items with the largest keys seen so far.
+ * Pushing an item costs O(log K) and memory never exceeds K items, no matter
+ * how many are offered.
+ */
+
+#ifndef _TOPK_H_
+#define _TOPK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct topk_item {
+    unsigned long long key;
+    void *data;
+};
+
+struct topk {
+    struct topk_item *items;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Prepares a heap that retains at most k items.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int topk_init(struct topk *heap, size_t k);
+
+/**
+ * Determines whether an item with the given key would be retained. Callers can
+ * use this to avoid building the item's data when it would be discarded.
+ */
+bool topk_accepts(const struct topk *heap, unsigned long long key);
+
+/**
+ * Offers an item to the heap.
+ *
+ * @return the data pointer that is no longer retained (either the evicted
+ * minimum or 'data' itself if it was rejected), or NULL if nothing was
+ * dropped. The caller owns the returned pointer.
+ */
+void *topk_push(struct topk *heap, unsigned long long key, void *data);
+
+/**
+ * Sorts the retained items by descending key. The heap property is destroyed,
+ * so no further pushes are allowed afterward.
+ *
+ * @return the number of items in heap->items.
+ */
+size_t topk_sort(struct topk *heap);
+
+/**
+ * Frees the heap's storage. Data pointers are not freed.
+ */
+void topk_destroy(struct topk *heap);
+
+#endif
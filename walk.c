@@ -0,0 +1,907 @@
+/**
+ * @file walk.c
+ *
+ * Implementation of the search library declared in search.h. The traversal
+ * keeps an explicit stack of open directories so that it can be suspended
+ * after every entry and resumed by the next call to search_next().
+ */
+
+#define _GNU_SOURCE // getdents64(), AT_EMPTY_PATH
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "ext_set.h"
+#include "inode_set.h"
+#include "logger.h"
+#include "match.h"
+#include "search.h"
+#include "stats.h"
+
+/**
+ * Size of each directory's getdents64() buffer, the same as readdir() uses in
+ * glibc.
+ */
+#define DENTS_BUFFER_SIZE (32 * 1024)
+
+// getdents64() records are handed out as struct dirent
+_Static_assert(sizeof(struct dirent) == sizeof(struct dirent64)
+        && offsetof(struct dirent, d_name) == offsetof(struct dirent64, d_name),
+        "struct dirent must have the layout of struct dirent64");
+
+/**
+ * An entry of a directory listing held for SEARCH_SORTED.
+ */
+struct sorted_entry {
+    const char *name;   // in the frame's name arena
+    size_t name_offset; // the same, while the arena may still move
+    ino_t ino;
+    unsigned char type;
+};
+
+/**
+ * The kinds of call timed with SEARCH_TIMING, each sampled on its own.
+ */
+enum timer {
+    TIMER_OPENDIR,
+    TIMER_GETDENTS,
+    TIMER_STAT,
+    TIMERS,
+};
+
+/**
+ * A directory on the traversal stack.
+ */
+struct frame {
+    int fd;
+    int depth;        // depth of the entries in this directory
+    size_t path_len;  // length of this directory's path in the path buffer
+    dev_t dev;
+    uint64_t bytes;   // SEARCH_DIR_TOTALS rollup so far
+    uint64_t files;
+
+    /* With a directory cache: the listing being replayed, or the one being
+     * recorded as the directory is read */
+    const struct dircache_record *cached;
+    uint32_t next_cached;
+    bool recording;
+    struct dircache_listing listing;
+    ino_t ino;
+    int64_t mtime_ns;
+
+    /* With SEARCH_SORTED: the whole listing, sorted by name. The buffers stay
+     * with the stack slot, so they are reused by the next directory at this
+     * depth. */
+    struct sorted_entry *sorted;
+    size_t sorted_len;
+    size_t sorted_cap;
+    size_t next_sorted;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    bool replay_sorted;
+
+    /* Records read by getdents64(); the buffer also stays with the slot */
+    char *dents;
+    size_t dents_len;
+    size_t dents_pos;
+};
+
+struct search {
+    struct search_opts opts;
+    char *pattern;
+    size_t pattern_len;
+
+    /* The pattern decoded and case folded once, for unicode_fold */
+    uint32_t folded[MATCH_CHARS_MAX];
+    int folded_len;
+
+    struct frame *stack;
+    size_t depth;
+    size_t cap;
+
+    /* Path of the current entry, extended and truncated in place */
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+
+    /* Set when the last delivered entry is a directory still to be entered */
+    const char *pending_dir;
+
+    /* Entry replayed from a cached listing */
+    struct dirent replayed;
+
+    struct inode_set *seen_inodes;   // --unique-inodes
+    struct inode_set *sized_inodes;  // multiply-linked files already totaled
+
+    struct search_stats stats;
+    int timer_countdown[TIMERS];  // calls of each kind until the next one timed
+};
+
+void search_opts_init(struct search_opts *opts)
+{
+    opts->max_depth = -1;
+    opts->pattern = "";
+    opts->exact_match = false;
+    opts->ignore_case = false;
+    opts->unicode_fold = false;
+    opts->show_dirs = true;
+    opts->show_files = true;
+    opts->show_hidden = false;
+    opts->unique_inodes = false;
+    opts->flags = 0;
+    opts->on_error = NULL;
+    opts->error_ctx = NULL;
+    opts->stats = NULL;
+    opts->cache = NULL;
+    opts->extensions = NULL;
+}
+
+static bool tracking_paths(struct search *it)
+{
+    return (it->opts.flags & SEARCH_NO_PATHS) == 0;
+}
+
+/**
+ * Hands an error to the search's error sink. 'name' is only used when paths
+ * are not being tracked; otherwise the full path of the current entry is.
+ */
+static void report_error(struct search *it, const char *op, const char *name, int err)
+{
+    it->stats.errors++;
+    it->stats.errors_by_errno[err > 0 && err < SEARCH_ERRNO_MAX ? err : 0]++;
+    const char *path = tracking_paths(it) ? it->path : name;
+    if (it->opts.on_error != NULL) {
+        it->opts.on_error(it->opts.error_ctx, op, path, err);
+        return;
+    }
+    // perror() is thread-safe and keeps the traditional message format
+    errno = err;
+    perror(op);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Starts timing a call for SEARCH_TIMING, if it is one of the sampled calls.
+ * Every kind of call keeps its own count, so each histogram holds one in
+ * SEARCH_TIMING_INTERVAL of its calls however the kinds interleave.
+ *
+ * @return the start time, or 0 if the call isn't timed.
+ */
+static uint64_t start_timer(struct search *it, enum timer timer)
+{
+    if (!(it->opts.flags & SEARCH_TIMING) || --it->timer_countdown[timer] > 0) {
+        return 0;
+    }
+    it->timer_countdown[timer] = SEARCH_TIMING_INTERVAL;
+    return now_ns();
+}
+
+static void stop_timer(struct search *it, enum timer timer, uint64_t start)
+{
+    if (start == 0) {
+        return;
+    }
+    struct search_histogram *hists[TIMERS] = {
+        [TIMER_OPENDIR] = &it->stats.opendir_ns,
+        [TIMER_GETDENTS] = &it->stats.getdents_ns,
+        [TIMER_STAT] = &it->stats.stat_ns,
+    };
+    histogram_record(hists[timer], now_ns() - start);
+}
+
+/**
+ * Stats 'name' in the directory 'dir_fd' without following symlinks, or the
+ * directory itself if 'name' is empty.
+ */
+static int stat_at(struct search *it, int dir_fd, const char *name, struct stat *st)
+{
+    it->stats.stat_calls++;
+    uint64_t start = start_timer(it, TIMER_STAT);
+    int rc = fstatat(dir_fd, name, st,
+            AT_SYMLINK_NOFOLLOW | (name[0] == '\0' ? AT_EMPTY_PATH : 0));
+    stop_timer(it, TIMER_STAT, start);
+    return rc;
+}
+
+/**
+ * Appends "/name" to the path buffer.
+ */
+static int path_push(struct search *it, const char *name, size_t name_len)
+{
+    size_t needed = it->path_len + 1 + name_len + 1;
+    if (needed > it->path_cap) {
+        size_t cap = it->path_cap * 2 > needed ? it->path_cap * 2 : needed;
+        char *path = realloc(it->path, cap);
+        if (path == NULL) {
+            return -1;
+        }
+        it->path = path;
+        it->path_cap = cap;
+    }
+    it->path[it->path_len] = '/';
+    memcpy(it->path + it->path_len + 1, name, name_len + 1);
+    it->path_len += 1 + name_len;
+    return 0;
+}
+
+static void path_truncate(struct search *it, size_t len)
+{
+    if (tracking_paths(it)) {
+        it->path_len = len;
+        it->path[len] = '\0';
+    }
+}
+
+/**
+ * Counts the entries in a directory. Used to size data structures that scale
+ * with the tree before the traversal begins.
+ */
+static size_t count_entries(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        return 0;
+    }
+    size_t count = 0;
+    while (readdir(dir) != NULL) {
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Reads the next entry of a directory, from its sorted or cached listing if it
+ * has one.
+ */
+static struct dirent *next_entry(struct search *it, struct frame *frame)
+{
+    if (frame->replay_sorted) {
+        if (frame->next_sorted == frame->sorted_len) {
+            return NULL;
+        }
+        const struct sorted_entry *e = &frame->sorted[frame->next_sorted++];
+        it->replayed.d_ino = e->ino;
+        it->replayed.d_type = e->type;
+        size_t len = strnlen(e->name, sizeof(it->replayed.d_name) - 1);
+        memcpy(it->replayed.d_name, e->name, len);
+        it->replayed.d_name[len] = '\0';
+        return &it->replayed;
+    }
+    if (frame->cached != NULL) {
+        if (frame->next_cached == frame->cached->count) {
+            return NULL;
+        }
+        const struct dircache_entry *e = &dircache_entries(frame->cached)[frame->next_cached++];
+        it->replayed.d_ino = e->ino;
+        it->replayed.d_type = e->type;
+        const char *name = dircache_name(frame->cached, e);
+        size_t len = strnlen(name, sizeof(it->replayed.d_name) - 1);
+        memcpy(it->replayed.d_name, name, len);
+        it->replayed.d_name[len] = '\0';
+        return &it->replayed;
+    }
+    if (frame->dents_pos == frame->dents_len) {
+        uint64_t start = start_timer(it, TIMER_GETDENTS);
+        ssize_t len = getdents64(frame->fd, frame->dents, DENTS_BUFFER_SIZE);
+        stop_timer(it, TIMER_GETDENTS, start);
+        it->stats.getdents_calls++;
+        if (len <= 0) {
+            if (len == -1) {
+                // an incomplete listing must not be cached
+                frame->recording = false;
+            }
+            return NULL;
+        }
+        it->stats.getdents_bytes += len;
+        frame->dents_len = len;
+        frame->dents_pos = 0;
+    }
+    struct dirent *entry = (struct dirent *) (frame->dents + frame->dents_pos);
+    frame->dents_pos += entry->d_reclen;
+    return entry;
+}
+
+/**
+ * Adds an entry to the listing being recorded for the cache, giving up on the
+ * listing if memory runs out.
+ */
+static void record_entry(struct frame *frame, struct dirent *entry)
+{
+    if (frame->recording && dircache_listing_add(&frame->listing, entry->d_name,
+                entry->d_ino, entry->d_type) == -1) {
+        frame->recording = false;
+    }
+}
+
+/**
+ * Closes a directory on the stack. Its recorded listing goes to the cache if
+ * the directory was read to the end.
+ */
+static void close_dir(struct search *it, struct frame *frame, bool complete)
+{
+    if (complete && frame->recording) {
+        dircache_store(it->opts.cache, frame->dev, frame->ino, frame->mtime_ns,
+                &frame->listing);
+    }
+    dircache_listing_free(&frame->listing);
+    close(frame->fd);
+}
+
+static int compare_sorted(const void *a, const void *b)
+{
+    const struct sorted_entry *ea = a;
+    const struct sorted_entry *eb = b;
+    return strcmp(ea->name, eb->name);
+}
+
+/**
+ * Reads a whole directory (or its cached listing) into the frame's buffers and
+ * sorts it, so that next_entry() replays it in order.
+ *
+ * @return 0 on success, or -1 on allocation failure.
+ */
+static int read_sorted(struct search *it, struct frame *frame)
+{
+    frame->sorted_len = 0;
+    frame->next_sorted = 0;
+    frame->names_len = 0;
+    struct dirent *entry;
+    while ((entry = next_entry(it, frame)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = strlen(entry->d_name) + 1;
+        if (frame->names_len + len > frame->names_cap) {
+            size_t cap = frame->names_cap == 0 ? 4096 : frame->names_cap * 2;
+            while (cap < frame->names_len + len) {
+                cap *= 2;
+            }
+            char *names = realloc(frame->names, cap);
+            if (names == NULL) {
+                return -1;
+            }
+            frame->names = names;
+            frame->names_cap = cap;
+        }
+        if (frame->sorted_len == frame->sorted_cap) {
+            size_t cap = frame->sorted_cap == 0 ? 64 : frame->sorted_cap * 2;
+            struct sorted_entry *sorted = realloc(frame->sorted, cap * sizeof(struct sorted_entry));
+            if (sorted == NULL) {
+                return -1;
+            }
+            frame->sorted = sorted;
+            frame->sorted_cap = cap;
+        }
+        memcpy(frame->names + frame->names_len, entry->d_name, len);
+        frame->sorted[frame->sorted_len++] = (struct sorted_entry) {
+            .name_offset = frame->names_len,
+            .ino = entry->d_ino,
+            .type = entry->d_type,
+        };
+        frame->names_len += len;
+    }
+    for (size_t i = 0; i < frame->sorted_len; ++i) {
+        frame->sorted[i].name = frame->names + frame->sorted[i].name_offset;
+    }
+    qsort(frame->sorted, frame->sorted_len, sizeof(struct sorted_entry), compare_sorted);
+    frame->replay_sorted = true;
+    return 0;
+}
+
+/**
+ * Opens a directory relative to 'parent_fd' and pushes it onto the stack.
+ *
+ * @return 0 on success, -1 if the directory could not be opened (errno set).
+ */
+static int push_dir(struct search *it, int parent_fd, const char *name, int depth)
+{
+    if (it->depth == it->cap) {
+        size_t cap = it->cap == 0 ? 16 : it->cap * 2;
+        struct frame *stack = realloc(it->stack, cap * sizeof(struct frame));
+        if (stack == NULL) {
+            return -1;
+        }
+        // new slots start without sorting buffers
+        memset(stack + it->cap, 0, (cap - it->cap) * sizeof(struct frame));
+        it->stack = stack;
+        it->cap = cap;
+    }
+
+    struct frame *frame = &it->stack[it->depth];
+    if (frame->dents == NULL && (frame->dents = malloc(DENTS_BUFFER_SIZE)) == NULL) {
+        return -1;
+    }
+    uint64_t start = start_timer(it, TIMER_OPENDIR);
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stop_timer(it, TIMER_OPENDIR, start);
+    if (fd == -1) {
+        return -1;
+    }
+
+    it->stats.dirs_opened++;
+    it->depth++;
+    frame->fd = fd;
+    frame->dents_len = 0;
+    frame->dents_pos = 0;
+    frame->depth = depth;
+    frame->path_len = it->path_len;
+    frame->dev = 0;
+    frame->bytes = 0;
+    frame->files = 0;
+    frame->cached = NULL;
+    frame->next_cached = 0;
+    frame->recording = false;
+    frame->replay_sorted = false;
+    memset(&frame->listing, 0, sizeof(frame->listing));
+    // the cache needs nothing for directories whose entries won't be read
+    bool use_cache = it->opts.cache != NULL && depth != it->opts.max_depth;
+    // hard links never cross devices, so one fstat per directory is enough
+    if (it->opts.unique_inodes || (it->opts.flags & SEARCH_DIR_TOTALS) || use_cache) {
+        struct stat st;
+        if (stat_at(it, fd, "", &st) == 0) {
+            frame->dev = st.st_dev;
+            frame->bytes = st.st_blocks * 512ULL;
+            frame->ino = st.st_ino;
+            frame->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+            if (use_cache) {
+                frame->cached = dircache_lookup(it->opts.cache, st.st_dev, st.st_ino,
+                        frame->mtime_ns);
+                frame->recording = frame->cached == NULL;
+                it->stats.dirs_cached += frame->cached != NULL;
+            }
+        }
+    }
+    if ((it->opts.flags & SEARCH_SORTED) && depth != it->opts.max_depth
+            && read_sorted(it, frame) == -1) {
+        int err = errno;
+        close_dir(it, frame, false);
+        it->depth--;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds a non-directory entry's allocated size to its directory's totals. As in
+ * du(1), a file with several hard links is only counted the first time.
+ */
+static void account_file(struct search *it, struct frame *frame, const char *name,
+        struct stat *st)
+{
+    if (st->st_nlink > 1) {
+        int rc = inode_set_insert(it->sized_inodes, st->st_dev, st->st_ino);
+        if (rc == 0) {
+            return;
+        } else if (rc == -1) {
+            report_error(it, "inode_set_insert", name, errno);
+        }
+    }
+    frame->bytes += st->st_blocks * 512ULL;
+    if (S_ISREG(st->st_mode)) {
+        frame->files++;
+    }
+}
+
+/**
+ * Determines whether a file should be reported under unique_inodes. Files are
+ * identified by the device of their directory and the inode number from the
+ * directory entry, so no extra stat() call is needed per file.
+ */
+static bool first_link(struct search *it, struct frame *frame, struct dirent *entry)
+{
+    int rc = inode_set_insert(it->seen_inodes, frame->dev, entry->d_ino);
+    if (rc == -1) {
+        // if we can't track the inode, err on the side of reporting it
+        report_error(it, "inode_set_insert", entry->d_name, errno);
+        return true;
+    }
+    return rc == 1;
+}
+
+/**
+ * Checks whether 'name' contains the pattern (or, with 'whole', is exactly the
+ * pattern) under the case rules of 'opts'. With unicode_fold, 'folded' holds
+ * the pattern already folded by match_fold().
+ */
+static bool pattern_matches(const struct search_opts *opts, const char *pattern,
+        size_t pattern_len, const uint32_t *folded, int folded_len,
+        const char *name, bool whole)
+{
+    if (opts->unicode_fold) {
+        return match_unicode(name, strlen(name), folded, folded_len, whole);
+    }
+    if (opts->ignore_case) {
+        return match_ascii(name, strlen(name), pattern, pattern_len, whole);
+    }
+    return whole ? strcmp(pattern, name) == 0 : strstr(name, pattern) != NULL;
+}
+
+static bool entry_matches(const struct search_opts *opts, const char *pattern,
+        size_t pattern_len, const uint32_t *folded, int folded_len,
+        const char *name, unsigned char type)
+{
+    if (!pattern_matches(opts, pattern, pattern_len, folded, folded_len, name, false)) {
+        return false;
+    }
+    if (type == DT_DIR) {
+        return opts->show_dirs;
+    }
+    // don't report a hidden file if show_hidden is false
+    return type == DT_REG && opts->show_files
+        && (opts->show_hidden || name[0] != '.')
+        && (opts->extensions == NULL
+                || ext_set_match(opts->extensions, name, strlen(name)))
+        && (!opts->exact_match || pattern_matches(opts, pattern, pattern_len,
+                    folded, folded_len, name, true));
+}
+
+bool search_match(const struct search_opts *opts, const char *name, unsigned char type)
+{
+    const char *pattern = opts->pattern == NULL ? "" : opts->pattern;
+    size_t pattern_len = strlen(pattern);
+    uint32_t folded[MATCH_CHARS_MAX];
+    int folded_len = 0;
+    if (opts->unicode_fold) {
+        folded_len = match_fold(pattern, pattern_len, folded);
+    }
+    return entry_matches(opts, pattern, pattern_len, folded, folded_len, name, type);
+}
+
+static bool matches(struct search *it, struct frame *frame, struct dirent *entry)
+{
+    return entry_matches(&it->opts, it->pattern, it->pattern_len, it->folded,
+                it->folded_len, entry->d_name, entry->d_type)
+        && (entry->d_type != DT_REG || !it->opts.unique_inodes
+                || first_link(it, frame, entry));
+}
+
+static void fill_stat(struct search_entry *out, struct stat *st)
+{
+    out->size = st->st_size;
+    out->blocks = st->st_blocks;
+    out->nlink = st->st_nlink;
+    out->mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/**
+ * Pops the directory on top of the stack, folding its totals into its parent.
+ * With SEARCH_DIR_TOTALS, 'out' is filled in with the directory's leave entry.
+ *
+ * @return true if 'out' should be delivered.
+ */
+static bool pop_dir(struct search *it, struct search_entry *out)
+{
+    struct frame *frame = &it->stack[--it->depth];
+    close_dir(it, frame, true);
+    path_truncate(it, frame->path_len);
+    if ((it->opts.flags & SEARCH_DIR_TOTALS) == 0) {
+        return false;
+    }
+
+    if (it->depth > 0) {
+        struct frame *parent = &it->stack[it->depth - 1];
+        parent->bytes += frame->bytes;
+        parent->files += frame->files;
+    }
+    memset(out, 0, sizeof(*out));
+    if (tracking_paths(it)) {
+        out->path = it->path;
+        out->path_len = frame->path_len;
+        const char *slash = strrchr(it->path, '/');
+        out->name = slash == NULL ? it->path : slash + 1;
+        out->name_len = strlen(out->name);
+    }
+    out->type = DT_DIR;
+    out->depth = frame->depth - 1;
+    out->leaving = true;
+    out->total_bytes = frame->bytes;
+    out->total_files = frame->files;
+    return true;
+}
+
+struct search *search_open(const char *root, const struct search_opts *opts)
+{
+    struct search *it = calloc(1, sizeof(struct search));
+    if (it == NULL) {
+        return NULL;
+    }
+    it->opts = *opts;
+    it->pattern = strdup(opts->pattern == NULL ? "" : opts->pattern);
+    if (it->pattern == NULL) {
+        goto fail;
+    }
+    it->opts.pattern = it->pattern;
+    it->pattern_len = strlen(it->pattern);
+    if (it->opts.unicode_fold) {
+        it->folded_len = match_fold(it->pattern, it->pattern_len, it->folded);
+    }
+
+    if (tracking_paths(it)) {
+        it->path_len = strlen(root);
+        it->path_cap = it->path_len + 256;
+        it->path = malloc(it->path_cap);
+        if (it->path == NULL) {
+            goto fail;
+        }
+        memcpy(it->path, root, it->path_len + 1);
+    }
+
+    if (opts->unique_inodes) {
+        it->seen_inodes = inode_set_create(count_entries(root), INODE_SET_MEM_LIMIT);
+        if (it->seen_inodes == NULL) {
+            goto fail;
+        }
+    }
+    if (opts->flags & SEARCH_DIR_TOTALS) {
+        it->sized_inodes = inode_set_create(count_entries(root), INODE_SET_MEM_LIMIT);
+        if (it->sized_inodes == NULL) {
+            goto fail;
+        }
+    }
+
+    if (push_dir(it, AT_FDCWD, root, 0) == -1) {
+        goto fail;
+    }
+    return it;
+
+fail:
+    {
+        int err = errno;
+        search_close(it);
+        errno = err;
+    }
+    return NULL;
+}
+
+int search_next(struct search *it, struct search_entry *out)
+{
+    while (true) {
+        if (it->pending_dir != NULL) {
+            // enter the directory found by the previous iteration (or call)
+            struct frame *parent = &it->stack[it->depth - 1];
+            const char *name = it->pending_dir;
+            it->pending_dir = NULL;
+            // nothing beneath the depth limit is read, so don't even open it
+            // unless its size counts toward the totals
+            if ((parent->depth + 1 != it->opts.max_depth
+                        || (it->opts.flags & SEARCH_DIR_TOTALS))
+                    && push_dir(it, parent->fd, name, parent->depth + 1) == -1) {
+                if (errno == ENOMEM) {
+                    return -1;
+                }
+                report_error(it, "opendir", name, errno);
+            }
+        }
+        if (it->depth == 0) {
+            return 0;
+        }
+
+        struct frame *frame = &it->stack[it->depth - 1];
+        path_truncate(it, frame->path_len);
+
+        // stop recursing once we reach the max depth - if it is not specified then it won't stop
+        struct dirent *entry = NULL;
+        if (frame->depth != it->opts.max_depth) {
+            entry = next_entry(it, frame);
+        }
+        if (entry == NULL) {
+            if (pop_dir(it, out)) {
+                return 1;
+            }
+            continue;
+        }
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        it->stats.entries_read++;
+
+        struct stat st;
+        bool have_stat = false;
+        if (entry->d_type == DT_UNKNOWN
+                || ((it->opts.flags & SEARCH_DIR_TOTALS) && entry->d_type != DT_DIR)) {
+            if (stat_at(it, frame->fd, entry->d_name, &st) == -1) {
+                report_error(it, "fstatat", entry->d_name, errno);
+                record_entry(frame, entry);
+                continue;
+            }
+            have_stat = true;
+            // some file systems don't fill in d_type
+            if (entry->d_type == DT_UNKNOWN) {
+                entry->d_type = IFTODT(st.st_mode);
+            }
+            if ((it->opts.flags & SEARCH_DIR_TOTALS) && entry->d_type != DT_DIR) {
+                account_file(it, frame, entry->d_name, &st);
+            }
+        }
+
+        record_entry(frame, entry);
+
+        size_t name_len = strlen(entry->d_name);
+        if (tracking_paths(it) && path_push(it, entry->d_name, name_len) == -1) {
+            return -1;
+        }
+        if (entry->d_type == DT_DIR) {
+            it->pending_dir = entry->d_name;
+        }
+        if (!matches(it, frame, entry)) {
+            // a directory is still searched on the next iteration
+            continue;
+        }
+
+        memset(out, 0, sizeof(*out));
+        if (tracking_paths(it)) {
+            out->path = it->path;
+            out->path_len = it->path_len;
+            out->name = it->path + it->path_len - name_len;
+        } else {
+            out->name = entry->d_name;
+        }
+        out->name_len = name_len;
+        out->type = entry->d_type;
+        out->depth = frame->depth;
+        out->ino = entry->d_ino;
+        if (it->opts.flags & SEARCH_STAT) {
+            if (!have_stat) {
+                if (stat_at(it, frame->fd, entry->d_name, &st) == -1) {
+                    report_error(it, "fstatat", entry->d_name, errno);
+                    continue;
+                }
+            }
+            fill_stat(out, &st);
+        }
+        it->stats.matches++;
+        return 1;
+    }
+}
+
+void search_get_stats(const struct search *it, struct search_stats *stats)
+{
+    *stats = it->stats;
+}
+
+void search_close(struct search *it)
+{
+    if (it == NULL) {
+        return;
+    }
+    if (it->opts.stats != NULL) {
+        *it->opts.stats = it->stats;
+    }
+    while (it->depth > 0) {
+        close_dir(it, &it->stack[--it->depth], false);
+    }
+    for (size_t i = 0; i < it->cap; ++i) {
+        free(it->stack[i].sorted);
+        free(it->stack[i].names);
+        free(it->stack[i].dents);
+    }
+    inode_set_destroy(it->seen_inodes);
+    inode_set_destroy(it->sized_inodes);
+    free(it->stack);
+    free(it->path);
+    free(it->pattern);
+    free(it);
+}
+
+/**
+ * Entries gathered for the next search_run() callback. Strings are copied into
+ * a single arena, since the iterator's buffers change with every entry.
+ */
+struct batch {
+    struct search_entry entries[SEARCH_BATCH_SIZE];
+    size_t count;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+};
+
+/**
+ * Copies the entry's strings into the batch arena and adds it to the batch,
+ * delivering the batch first if it is full.
+ *
+ * @return 0 on success, the callback's return value if it asked to stop, or
+ * -1 on allocation failure.
+ */
+static int batch_add(struct batch *batch, const struct search_entry *entry,
+        search_callback callback, void *ctx)
+{
+    const char *str = entry->path != NULL ? entry->path : entry->name;
+    size_t len = entry->path != NULL ? entry->path_len : entry->name_len;
+
+    if (batch->count == SEARCH_BATCH_SIZE || batch->arena_len + len + 1 > batch->arena_cap) {
+        if (batch->count > 0) {
+            int rc = callback(ctx, batch->entries, batch->count);
+            batch->count = 0;
+            batch->arena_len = 0;
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        // only an extremely long path needs a bigger arena; the batch is empty
+        // now, so moving the arena can't invalidate any entries
+        if (len + 1 > batch->arena_cap) {
+            char *arena = realloc(batch->arena, len + 1);
+            if (arena == NULL) {
+                return -1;
+            }
+            batch->arena = arena;
+            batch->arena_cap = len + 1;
+        }
+    }
+
+    char *copy = batch->arena + batch->arena_len;
+    memcpy(copy, str, len + 1);
+    batch->arena_len += len + 1;
+
+    struct search_entry *dest = &batch->entries[batch->count++];
+    *dest = *entry;
+    if (entry->path != NULL) {
+        dest->path = copy;
+        dest->name = copy + len - entry->name_len;
+    } else {
+        dest->name = copy;
+    }
+    return 0;
+}
+
+int search_run(const char *root, const struct search_opts *opts,
+        search_callback callback, void *ctx)
+{
+    struct search *it = search_open(root, opts);
+    if (it == NULL) {
+        return -1;
+    }
+
+    struct batch *batch = malloc(sizeof(struct batch));
+    if (batch == NULL) {
+        search_close(it);
+        return -1;
+    }
+    batch->count = 0;
+    batch->arena_len = 0;
+    batch->arena_cap = 64 * 1024;
+    batch->arena = malloc(batch->arena_cap);
+    if (batch->arena == NULL) {
+        free(batch);
+        search_close(it);
+        return -1;
+    }
+
+    struct search_entry entry;
+    int rc;
+    while ((rc = search_next(it, &entry)) == 1) {
+        rc = batch_add(batch, &entry, callback, ctx);
+        if (rc != 0) {
+            break;
+        }
+    }
+    if (rc == 0 && batch->count > 0) {
+        rc = callback(ctx, batch->entries, batch->count);
+    }
+
+    int err = errno;
+    free(batch->arena);
+    free(batch);
+    search_close(it);
+    errno = err;
+    return rc;
+}